@@ -0,0 +1,166 @@
+// Copyright 2024 AQ author, All Rights Reserved.
+// This program is licensed under the AQ License. You can find the AQ license in
+// the root directory.
+
+#ifndef AQ_PROTOTYPE_AQ_H_
+#define AQ_PROTOTYPE_AQ_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32) && defined(AQ_BUILD_SHARED)
+#define AQ_API __declspec(dllexport)
+#elif defined(_WIN32) && defined(AQ_USE_SHARED)
+#define AQ_API __declspec(dllimport)
+#else
+#define AQ_API
+#endif
+
+#define AQ_OK 0
+#define AQ_PREEMPTED 1
+#define AQ_ERROR_OPEN -2
+#define AQ_ERROR_INVALID -3
+#define AQ_ERROR_MEMORY -4
+#define AQ_ERROR_CHILD -5
+
+// A loaded AQBC program. It is immutable after loading and can be shared by
+// any number of VMs, including VMs running on different threads.
+typedef struct Program AqProgram;
+
+// A single interpreter instance with its own memory, heap and program
+// counter. A VM must only be used by one thread at a time.
+typedef struct VM AqVM;
+
+// Builds the native function registry. Must be called once before any other
+// function of the library.
+AQ_API void AqInitialize(void);
+AQ_API void AqDeinitialize(void);
+
+// Loads an AQBC program from |path| or from a copy of |buffer|. Returns AQ_OK
+// and stores the program in |program|, or returns a negative AQ_ERROR_* code.
+AQ_API int AqLoadProgram(const char* path, AqProgram** program);
+AQ_API int AqLoadProgramFromMemory(const void* buffer, size_t size,
+                                   AqProgram** program);
+AQ_API void AqFreeProgram(AqProgram* program);
+
+// Creates a VM for |program|. The program must outlive the VM.
+AQ_API AqVM* AqCreateVM(const AqProgram* program);
+// Runs the VM until it finishes, or returns AQ_PREEMPTED when its time slice
+// runs out. Calling it again then resumes where it stopped.
+AQ_API int AqRunVM(AqVM* vm);
+// Restores the VM to the state it had right after AqCreateVM() so it can be
+// run again. Blocks allocated with NEW that were not freed are released.
+AQ_API void AqResetVM(AqVM* vm);
+AQ_API void AqFreeVM(AqVM* vm);
+
+// Redirects the output of natives such as print. Defaults to stdout.
+AQ_API void AqSetVMOutput(AqVM* vm, FILE* output);
+// Arguments visible to the script through the argc and argv natives. The
+// strings must outlive the run.
+AQ_API void AqSetVMArguments(AqVM* vm, int argc, char** argv);
+
+#define AQ_SCHEDULE_ROUND_ROBIN 0
+#define AQ_SCHEDULE_PRIORITY 1
+
+// Chooses how the green threads started by the VM with GREEN are scheduled.
+// Round-robin runs them in turn; priority always runs the highest-priority
+// runnable thread, round-robin among equals. A thread is switched out after
+// |budget| backward branches and calls (0 keeps the default), on YIELD or when
+// it blocks in a native.
+AQ_API void AqSetVMScheduler(AqVM* vm, int policy, size_t budget);
+
+// Limits every AqRunVM() call to |budget| backward branches and calls of the
+// VM and its green threads together and to |nanoseconds| of elapsed time,
+// measured on a monotonic clock so changes to the system time do not extend
+// it; 0 disables a limit. Loops and calls are the only places a VM can run
+// unboundedly, so they are the only places checked. Parallel loops and joins
+// started by the VM run to completion before it can be preempted.
+AQ_API void AqSetVMTimeSlice(AqVM* vm, size_t budget, long long nanoseconds);
+
+// Sets the number of threads used by the library, including the thread that
+// waits for parallel work. Must be called before the first parallel call;
+// 0 uses one thread per online CPU.
+AQ_API void AqSetThreadCount(size_t count);
+
+// Enables NUMA-aware placement on Linux: worker threads are pinned to CPUs
+// spread across the nodes and each VM's memory is bound to the node of the
+// thread that creates it. Must be called before the first parallel call.
+AQ_API void AqSetPlacement(int enabled);
+// Writes the CPU and node chosen for each worker of the library's pool and
+// how many VMs were placed on each node.
+AQ_API void AqPrintPlacement(FILE* output);
+
+// Runs requests of one program in pre-forked child processes. The parent
+// loads the program and creates its VM once; every child is forked from that
+// warm state, shares it copy-on-write and serves a single request. Not
+// available on Windows.
+typedef struct ForkServer AqForkServer;
+
+// Creates a fork server keeping |warm| idle children ready. The program must
+// outlive the server.
+AQ_API AqForkServer* AqCreateForkServer(const AqProgram* program, size_t warm);
+// Runs the program with the given arguments in a warm child and writes its
+// output to |output|. Returns the child's status, or AQ_ERROR_CHILD if the
+// child died. Safe to call from several threads.
+AQ_API int AqForkServerRun(AqForkServer* server, int argc, char** argv,
+                           FILE* output);
+AQ_API void AqFreeForkServer(AqForkServer* server);
+
+typedef struct {
+  const AqProgram* program;
+  int argc;
+  char** argv;
+  int status;
+  // When set, the job runs in a child of this fork server instead of an
+  // in-process VM.
+  AqForkServer* isolation;
+} AqJob;
+
+// Runs every job on its own VM using the library's worker threads. The output
+// of each job is buffered and written to |output| in job order, as soon as all
+// earlier jobs have finished. Returns AQ_OK or the status of a failed job.
+AQ_API int AqRunJobs(AqJob* jobs, size_t count, FILE* output);
+
+// Samples the threads running VMs |frequency| times per second of CPU time
+// using SIGPROF; 0 uses 997. A sample holds the bytecode offset, relative to
+// the start of the code, of each VM running on the thread, outermost first,
+// and the native an INVOKE is running. Only runs that start while the profiler
+// is running are sampled, so a VM that is already running is picked up at its
+// next AqRunVM() call. Linux limits the rate to the kernel's tick rate.
+// Starting again discards earlier samples. Not available on Windows.
+AQ_API int AqStartProfiler(int frequency);
+AQ_API void AqStopProfiler(void);
+// Writes the samples as folded stacks for flame graph tools: one line per
+// distinct stack, with frames such as ADD@0x1f separated by semicolons and
+// followed by the sample count.
+AQ_API void AqWriteProfile(FILE* output);
+// Writes one line per sampled instruction, sorted by the samples taken while
+// it was the innermost instruction executing (self). The total also counts
+// samples taken in natives or nested VMs it started.
+AQ_API void AqWriteProfileTable(FILE* output);
+
+// Frame types of the --serve protocol. A client sends a 32-bit argument count
+// followed by each argument as a 32-bit length and its bytes, the first being
+// the absolute program path. The server answers with frames made of a type
+// byte, a 32-bit length and a payload: any number of output frames, then one
+// status frame carrying a 32-bit status. Integers use host byte order.
+#define AQ_SERVE_OUTPUT 'O'
+#define AQ_SERVE_STATUS 'S'
+
+// Serves execution requests on the Unix domain socket at |path| using
+// |workers| threads (0 uses one per online CPU). A socket already at |path| is
+// replaced; any other file makes it fail with AQ_ERROR_OPEN. Each request runs
+// on its own VM; programs stay loaded between requests. A client that stops
+// sending before its request is complete is dropped after 10 seconds. Only
+// returns on error. Not available on Windows.
+AQ_API int AqServe(const char* path, size_t workers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // AQ_PROTOTYPE_AQ_H_
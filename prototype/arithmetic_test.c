@@ -0,0 +1,159 @@
+// Copyright 2024 AQ author, All Rights Reserved.
+// This program is licensed under the AQ License. You can find the AQ license in
+// the root directory.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prototype/aq.h"
+#include "prototype/test_builder.h"
+
+// Runs |opcode| (ADD_CHECKED, SUB_CHECKED or MUL_CHECKED) and checks the
+// stored value and whether the handler was taken.
+void ExpectChecked(struct Builder* builder, uint8_t opcode, size_t result,
+                   size_t operand1, size_t operand2, size_t expected,
+                   int overflows, const char* message) {
+  size_t overflowed = AddInteger(builder, 0x01, 0);
+  size_t handler = AddInteger(builder, 0x03, 0);
+  size_t next = AddInteger(builder, 0x03, 0);
+  Emit(builder, 0x06, 3, overflowed, builder->zero, builder->zero);
+  Emit(builder, opcode, 4, result, operand1, operand2, handler);
+  Emit(builder, 0x16, 1, next);
+  SetLabel(builder, handler);
+  Emit(builder, 0x06, 3, overflowed, builder->one, builder->zero);
+  SetLabel(builder, next);
+  Expect(builder, result, expected, message);
+  Expect(builder, overflowed, overflows ? builder->one : builder->zero,
+         message);
+}
+
+void AddCheckedTests(struct Builder* builder) {
+  struct Builder* b = builder;
+  ExpectChecked(b, 0x30, AddInteger(b, 0x02, 0), AddDouble(b, 1.5),
+                AddDouble(b, 1.5), AddInteger(b, 0x02, 3), 0,
+                "ADD_CHECKED int = double 1.5 + double 1.5\n");
+  ExpectChecked(b, 0x31, AddInteger(b, 0x02, 0), AddDouble(b, 1.5),
+                AddInteger(b, 0x02, 4), AddInteger(b, 0x02, -2), 0,
+                "SUB_CHECKED int = double 1.5 - int 4\n");
+  ExpectChecked(b, 0x32, AddInteger(b, 0x03, 0), AddFloat(b, 2.5f),
+                AddInteger(b, 0x03, 3), AddInteger(b, 0x03, 7), 0,
+                "MUL_CHECKED long = float 2.5 * long 3\n");
+  ExpectChecked(b, 0x30, AddInteger(b, 0x02, 0), AddDouble(b, 2147483647.0),
+                AddDouble(b, 1.0), AddInteger(b, 0x02, INT32_MIN), 1,
+                "ADD_CHECKED int = double 2147483647 + double 1\n");
+  ExpectChecked(b, 0x30, AddInteger(b, 0x09, 0), AddDouble(b, -0.5),
+                AddInteger(b, 0x02, 0), AddInteger(b, 0x09, 0), 0,
+                "ADD_CHECKED uint = double -0.5 + int 0\n");
+  ExpectChecked(b, 0x31, AddInteger(b, 0x09, 0), AddDouble(b, 1.0),
+                AddDouble(b, 2.0), AddInteger(b, 0x09, UINT32_MAX), 1,
+                "SUB_CHECKED uint = double 1 - double 2\n");
+  ExpectChecked(b, 0x30, AddInteger(b, 0x03, 0), AddDouble(b, NAN),
+                AddInteger(b, 0x03, 1), AddInteger(b, 0x03, 0), 1,
+                "ADD_CHECKED long = double NaN + long 1\n");
+  ExpectChecked(b, 0x30, AddDouble(b, 0), AddInteger(b, 0x02, 1),
+                AddDouble(b, 0.5), AddDouble(b, 1.5), 0,
+                "ADD_CHECKED double = int 1 + double 0.5\n");
+  ExpectChecked(b, 0x30, AddInteger(b, 0x02, 0),
+                AddInteger(b, 0x02, INT32_MAX), AddInteger(b, 0x02, 1),
+                AddInteger(b, 0x02, INT32_MIN), 1,
+                "ADD_CHECKED int = int INT_MAX + int 1\n");
+  ExpectChecked(b, 0x32, AddInteger(b, 0x01, 0), AddInteger(b, 0x02, 16),
+                AddInteger(b, 0x02, -8), AddInteger(b, 0x01, -128), 0,
+                "MUL_CHECKED byte = int 16 * int -8\n");
+}
+
+// Runs the three-operand |opcode| and checks the stored value.
+void ExpectResult(struct Builder* builder, uint8_t opcode, size_t result,
+                  size_t operand1, size_t operand2, size_t expected,
+                  const char* message) {
+  Emit(builder, opcode, 3, result, operand1, operand2);
+  Expect(builder, result, expected, message);
+}
+
+void AddDivisionTests(struct Builder* builder) {
+  struct Builder* b = builder;
+  ExpectResult(b, 0x09, AddInteger(b, 0x02, 0), AddInteger(b, 0x02, -1025),
+               AddInteger(b, 0x02, 16), AddInteger(b, 0x02, -64),
+               "DIV int = int -1025 / int 16\n");
+  ExpectResult(b, 0x0A, AddInteger(b, 0x02, 0), AddInteger(b, 0x02, -1025),
+               AddInteger(b, 0x02, 16), AddInteger(b, 0x02, -1),
+               "REM int = int -1025 % int 16\n");
+  ExpectResult(b, 0x09, AddInteger(b, 0x03, 0), AddInteger(b, 0x03, -5),
+               AddInteger(b, 0x03, -4), AddInteger(b, 0x03, 1),
+               "DIV long = long -5 / long -4\n");
+  ExpectResult(b, 0x09, AddInteger(b, 0x01, 0), AddInteger(b, 0x01, -128),
+               AddInteger(b, 0x01, 2), AddInteger(b, 0x01, -64),
+               "DIV byte = byte -128 / byte 2\n");
+  ExpectResult(b, 0x09, AddInteger(b, 0x02, 0), AddInteger(b, 0x03, -7),
+               AddInteger(b, 0x02, 2), AddInteger(b, 0x02, -3),
+               "DIV int = long -7 / int 2\n");
+  ExpectResult(b, 0x0A, AddInteger(b, 0x02, 0), AddInteger(b, 0x03, -7),
+               AddInteger(b, 0x02, 2), AddInteger(b, 0x02, -1),
+               "REM int = long -7 % int 2\n");
+  ExpectResult(b, 0x09, AddInteger(b, 0x01, 0), AddInteger(b, 0x02, -100),
+               AddInteger(b, 0x03, 8), AddInteger(b, 0x01, -12),
+               "DIV byte = int -100 / long 8\n");
+  ExpectResult(b, 0x0A, AddInteger(b, 0x01, 0), AddInteger(b, 0x02, -100),
+               AddInteger(b, 0x03, 8), AddInteger(b, 0x01, -4),
+               "REM byte = int -100 % long 8\n");
+  ExpectResult(b, 0x09, AddInteger(b, 0x03, 0), AddInteger(b, 0x01, -9),
+               AddInteger(b, 0x02, -4), AddInteger(b, 0x03, 2),
+               "DIV long = byte -9 / int -4\n");
+  ExpectResult(b, 0x0A, AddInteger(b, 0x03, 0), AddInteger(b, 0x01, -9),
+               AddInteger(b, 0x02, -4), AddInteger(b, 0x03, -1),
+               "REM long = byte -9 % int -4\n");
+  ExpectResult(b, 0x09, AddInteger(b, 0x02, 0), AddInteger(b, 0x02, -300),
+               AddInteger(b, 0x02, 4), AddInteger(b, 0x02, -75),
+               "DIV int = int -300 / int 4\n");
+  ExpectResult(b, 0x09, AddInteger(b, 0x01, 0), AddInteger(b, 0x02, -300),
+               AddInteger(b, 0x02, 4), AddInteger(b, 0x01, -75),
+               "DIV byte = int -300 / int 4\n");
+  ExpectResult(b, 0x09, AddDouble(b, 0), AddInteger(b, 0x02, -7),
+               AddInteger(b, 0x02, 2), AddDouble(b, -3.5),
+               "DIV double = int -7 / int 2\n");
+  ExpectResult(b, 0x09, AddInteger(b, 0x02, 0), AddDouble(b, -7.0),
+               AddInteger(b, 0x02, 2), AddInteger(b, 0x02, -3),
+               "DIV int = double -7 / int 2\n");
+  ExpectResult(b, 0x09, AddInteger(b, 0x06, 0), AddInteger(b, 0x06, -7),
+               AddInteger(b, 0x09, 2), AddInteger(b, 0x06, -4),
+               "DIV short = short -7 / uint 2\n");
+}
+
+int main(void) {
+  AqInitialize();
+  static struct Builder builder;
+  StartProgram(&builder);
+  AddCheckedTests(&builder);
+  AddDivisionTests(&builder);
+  size_t size;
+  uint8_t* image = FinishProgram(&builder, &size);
+
+  AqProgram* program;
+  if (AqLoadProgramFromMemory(image, size, &program) != AQ_OK) {
+    fprintf(stderr, "Error: Could not load the test program\n");
+    return 1;
+  }
+  AqVM* vm = AqCreateVM(program);
+  FILE* output = tmpfile();
+  AqSetVMOutput(vm, output);
+  AqRunVM(vm);
+
+  char text[4096];
+  rewind(output);
+  size_t length = fread(text, 1, sizeof(text) - 1, output);
+  text[length] = '\0';
+  int failed = strcmp(text, "done\n") != 0;
+  if (failed) {
+    fprintf(stderr, "Failed:\n%s", text);
+  }
+
+  fclose(output);
+  AqFreeVM(vm);
+  AqFreeProgram(program);
+  free(image);
+  AqDeinitialize();
+  return failed;
+}
@@ -0,0 +1,115 @@
+// Copyright 2024 AQ author, All Rights Reserved.
+// This program is licensed under the AQ License. You can find the AQ license in
+// the root directory.
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "prototype/aq.h"
+
+bool ReadAll(int fd, void* buffer, size_t size) {
+  while (size > 0) {
+    ssize_t count = read(fd, buffer, size);
+    if (count <= 0) {
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buffer = (char*)buffer + count;
+    size -= count;
+  }
+  return true;
+}
+
+bool WriteAll(int fd, const void* buffer, size_t size) {
+  while (size > 0) {
+    ssize_t count = write(fd, buffer, size);
+    if (count <= 0) {
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buffer = (const char*)buffer + count;
+    size -= count;
+  }
+  return true;
+}
+
+bool WriteArgument(int fd, const char* argument) {
+  uint32_t size = strlen(argument);
+  return WriteAll(fd, &size, sizeof(size)) && WriteAll(fd, argument, size);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    printf("Usage: %s <socket> <filename> [arguments...]\n", argv[0]);
+    return -1;
+  }
+
+  // The server resolves paths against its own working directory.
+  char path[PATH_MAX];
+  if (realpath(argv[2], path) == NULL) {
+    printf("Error: Could not open file %s\n", argv[2]);
+    return -2;
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 ||
+      connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+    printf("Error: Could not connect to %s\n", argv[1]);
+    return -1;
+  }
+
+  uint32_t count = argc - 2;
+  bool sent = WriteAll(fd, &count, sizeof(count)) && WriteArgument(fd, path);
+  for (int i = 3; sent && i < argc; i++) {
+    sent = WriteArgument(fd, argv[i]);
+  }
+
+  int32_t status = -1;
+  char header[5];
+  while (sent && ReadAll(fd, header, sizeof(header))) {
+    uint32_t size;
+    memcpy(&size, header + 1, sizeof(size));
+    char* payload = (char*)malloc(size);
+    if (payload == NULL || !ReadAll(fd, payload, size)) {
+      free(payload);
+      break;
+    }
+    if (header[0] == AQ_SERVE_OUTPUT) {
+      fwrite(payload, 1, size, stdout);
+      fflush(stdout);
+    } else if (header[0] == AQ_SERVE_STATUS && size == sizeof(status)) {
+      memcpy(&status, payload, sizeof(status));
+    }
+    free(payload);
+  }
+  close(fd);
+
+  switch (status) {
+    case AQ_ERROR_OPEN:
+      printf("Error: Could not open file %s\n", path);
+      break;
+    case AQ_ERROR_INVALID:
+      printf("Error: Invalid bytecode file\n");
+      break;
+    case AQ_ERROR_MEMORY:
+      printf("Error: Out of memory\n");
+      break;
+  }
+  return status;
+}
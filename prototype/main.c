@@ -0,0 +1,311 @@
+// Copyright 2024 AQ author, All Rights Reserved.
+// This program is licensed under the AQ License. You can find the AQ license in
+// the root directory.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prototype/aq.h"
+
+void PrintUsage(const char* name) {
+  printf("Usage: %s <filename> [arguments...]\n", name);
+  printf("       %s --jobs <count> <filename>...\n", name);
+  printf("       %s --jobs <count> <filename> --inputs <input>...\n", name);
+  printf("       %s [--jobs <count>] --serve <socket>\n", name);
+  printf("       %s [--jobs <count>] --prefork <count> <filename>\n", name);
+  printf("--numa may precede any form to enable NUMA-aware placement.\n");
+  printf("--profile <file> may precede any form to write folded stacks to\n");
+  printf("<file> and a table of the hottest instructions to stderr.\n");
+}
+
+int LoadProgramOrReport(const char* path, AqProgram** program) {
+  switch (AqLoadProgram(path, program)) {
+    case AQ_OK:
+      return 0;
+    case AQ_ERROR_OPEN:
+      printf("Error: Could not open file %s\n", path);
+      return -2;
+    case AQ_ERROR_INVALID:
+      printf("Error: Invalid bytecode file\n");
+      return -3;
+    default:
+      printf("Error: Out of memory\n");
+      return -4;
+  }
+}
+
+int RunSingle(int argc, char* argv[]) {
+  AqProgram* program;
+  int status = LoadProgramOrReport(argv[0], &program);
+  if (status != 0) {
+    return status;
+  }
+
+  AqVM* vm = AqCreateVM(program);
+  if (vm == NULL) {
+    printf("Error: Out of memory\n");
+    AqFreeProgram(program);
+    return -4;
+  }
+  AqSetVMArguments(vm, argc, argv);
+
+  printf("\nProgram started.\n");
+  AqRunVM(vm);
+
+  printf("\nProgram finished\n");
+  AqFreeVM(vm);
+  AqFreeProgram(program);
+  return 0;
+}
+
+// Runs every file in |files| as its own job. A file that appears several times
+// is loaded only once. With |inputs|, |files| holds one program that is run
+// once per input, receiving the input as its first argument.
+int RunBatch(char** files, int file_count, char** inputs, int input_count) {
+  int job_count = inputs != NULL ? input_count : file_count;
+  AqJob* jobs = (AqJob*)malloc(job_count * sizeof(AqJob));
+  AqProgram** programs = (AqProgram**)malloc(file_count * sizeof(AqProgram*));
+  char** job_argv = (char**)malloc(2 * job_count * sizeof(char*));
+  if (jobs == NULL || programs == NULL || job_argv == NULL) {
+    printf("Error: Out of memory\n");
+    free(jobs);
+    free(programs);
+    free(job_argv);
+    return -4;
+  }
+
+  int status = 0;
+  int loaded = 0;
+  for (; loaded < file_count; loaded++) {
+    programs[loaded] = NULL;
+    for (int i = 0; i < loaded; i++) {
+      if (strcmp(files[i], files[loaded]) == 0) {
+        programs[loaded] = programs[i];
+        break;
+      }
+    }
+    if (programs[loaded] == NULL) {
+      status = LoadProgramOrReport(files[loaded], &programs[loaded]);
+      if (status != 0) {
+        break;
+      }
+    }
+  }
+
+  if (status == 0) {
+    for (int i = 0; i < job_count; i++) {
+      int file = inputs != NULL ? 0 : i;
+      job_argv[2 * i] = files[file];
+      job_argv[2 * i + 1] = inputs != NULL ? inputs[i] : NULL;
+      jobs[i].program = programs[file];
+      jobs[i].argc = inputs != NULL ? 2 : 1;
+      jobs[i].argv = &job_argv[2 * i];
+      jobs[i].status = AQ_OK;
+      jobs[i].isolation = NULL;
+    }
+    AqRunJobs(jobs, job_count, stdout);
+  }
+
+  for (int i = 0; i < loaded; i++) {
+    bool shared = false;
+    for (int j = 0; j < i; j++) {
+      shared = shared || programs[j] == programs[i];
+    }
+    if (!shared) {
+      AqFreeProgram(programs[i]);
+    }
+  }
+  free(jobs);
+  free(programs);
+  free(job_argv);
+  return status;
+}
+
+// Runs |file| once per line of standard input, each time in a fresh child of a
+// fork server with |warm| idle children. The words of a line are passed as
+// the program's arguments.
+int RunPreforked(const char* file, int warm) {
+  AqProgram* program;
+  int status = LoadProgramOrReport(file, &program);
+  if (status != 0) {
+    return status;
+  }
+  AqForkServer* server = AqCreateForkServer(program, warm);
+  if (server == NULL) {
+    printf("Error: Could not start fork server\n");
+    AqFreeProgram(program);
+    return -1;
+  }
+
+  size_t job_count = 0;
+  size_t capacity = 0;
+  AqJob* jobs = NULL;
+  char line[4096];
+  while (fgets(line, sizeof(line), stdin) != NULL) {
+    // fgets() would split a longer line into several jobs.
+    if (strchr(line, '\n') == NULL && !feof(stdin)) {
+      printf("Error: Input line %zu is longer than %zu bytes\n",
+             job_count + 1, sizeof(line) - 2);
+      status = -3;
+      break;
+    }
+    if (job_count == capacity) {
+      size_t grown = capacity == 0 ? 16 : 2 * capacity;
+      AqJob* resized = (AqJob*)realloc(jobs, grown * sizeof(AqJob));
+      if (resized == NULL) {
+        status = -4;
+        break;
+      }
+      jobs = resized;
+      capacity = grown;
+    }
+    char** job_argv = (char**)malloc((strlen(line) / 2 + 2) * sizeof(char*));
+    if (job_argv == NULL) {
+      status = -4;
+      break;
+    }
+    AqJob* job = &jobs[job_count++];
+    job->program = program;
+    job->argc = 1;
+    job->argv = job_argv;
+    job->argv[0] = (char*)file;
+    for (char* word = strtok(line, " \t\r\n"); word != NULL;
+         word = strtok(NULL, " \t\r\n")) {
+      char* argument = (char*)malloc(strlen(word) + 1);
+      if (argument == NULL) {
+        status = -4;
+        break;
+      }
+      strcpy(argument, word);
+      job->argv[job->argc++] = argument;
+    }
+    job->status = AQ_OK;
+    job->isolation = server;
+    if (status != 0) {
+      break;
+    }
+  }
+
+  if (status == -4) {
+    printf("Error: Out of memory\n");
+  }
+  if (status == 0) {
+    status = AqRunJobs(jobs, job_count, stdout);
+  }
+  for (size_t i = 0; i < job_count; i++) {
+    for (int j = 1; j < jobs[i].argc; j++) {
+      free(jobs[i].argv[j]);
+    }
+    free(jobs[i].argv);
+  }
+  free(jobs);
+  AqFreeForkServer(server);
+  AqFreeProgram(program);
+  return status;
+}
+
+int main(int argc, char* argv[]) {
+  /*LARGE_INTEGER frequency;
+  LARGE_INTEGER start, end;
+  double elapsedTime;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&start);*/
+
+  int jobs = 0;
+  bool numa = false;
+  const char* profile = NULL;
+  int first = 1;
+  while (first < argc) {
+    if (strcmp(argv[first], "--numa") == 0) {
+      numa = true;
+      first++;
+    } else if (first + 1 < argc && strcmp(argv[first], "--profile") == 0) {
+      profile = argv[first + 1];
+      first += 2;
+    } else if (first + 1 < argc && strcmp(argv[first], "--jobs") == 0) {
+      jobs = atoi(argv[first + 1]);
+      first += 2;
+      if (jobs <= 0) {
+        PrintUsage(argv[0]);
+        return -1;
+      }
+    } else {
+      break;
+    }
+  }
+
+  if (argc <= first) {
+    PrintUsage(argv[0]);
+    return -1;
+  }
+
+  AqInitialize();
+  AqSetPlacement(numa);
+  if (profile != NULL && AqStartProfiler(0) != AQ_OK) {
+    printf("Error: Could not start the profiler\n");
+    AqDeinitialize();
+    return -1;
+  }
+
+  int status;
+  if (strcmp(argv[first], "--prefork") == 0) {
+    int warm = argc == first + 3 ? atoi(argv[first + 1]) : 0;
+    if (warm <= 0) {
+      PrintUsage(argv[0]);
+      status = -1;
+    } else {
+      if (jobs > 0) {
+        AqSetThreadCount(jobs);
+      }
+      status = RunPreforked(argv[first + 2], warm);
+    }
+  } else if (strcmp(argv[first], "--serve") == 0) {
+    if (argc != first + 2) {
+      PrintUsage(argv[0]);
+      status = -1;
+    } else {
+      status = AqServe(argv[first + 1], jobs);
+      printf("Error: Could not serve on %s\n", argv[first + 1]);
+    }
+  } else if (jobs == 0) {
+    status = RunSingle(argc - first, argv + first);
+  } else {
+    AqSetThreadCount(jobs);
+    int inputs = first;
+    while (inputs < argc && strcmp(argv[inputs], "--inputs") != 0) {
+      inputs++;
+    }
+    if (inputs < argc && inputs != first + 1) {
+      PrintUsage(argv[0]);
+      status = -1;
+    } else if (inputs < argc) {
+      status = RunBatch(argv + first, 1, argv + inputs + 1, argc - inputs - 1);
+    } else {
+      status = RunBatch(argv + first, argc - first, NULL, 0);
+    }
+  }
+
+  if (numa) {
+    AqPrintPlacement(stderr);
+  }
+  if (profile != NULL) {
+    AqStopProfiler();
+    FILE* output = fopen(profile, "w");
+    if (output == NULL) {
+      printf("Error: Could not open file %s\n", profile);
+    } else {
+      AqWriteProfile(output);
+      fclose(output);
+    }
+    AqWriteProfileTable(stderr);
+  }
+  AqDeinitialize();
+
+  /*QueryPerformanceCounter(&end);
+  elapsedTime = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+  printf("Elapsed time: %f seconds\n", elapsedTime);*/
+
+  return status;
+}
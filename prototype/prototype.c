@@ -2,19 +2,91 @@
 // This program is licensed under the AQ License. You can find the AQ license in
 // the root directory.
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <float.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define AQ_THREADS
+#define AQ_MAPPED_FILES
+#define AQ_READERS
+#define AQ_PROFILER
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define AQ_SSE2
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#define AQ_CRC32C_SSE42
+#define AQ_POPCNT
+#define AQ_FMA
+#define AQ_SSE41
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define AQ_CRC32C_ARM
+#endif
+
+#ifdef __linux__
+#define AQ_COPY_ON_WRITE
+#endif
+
+#if defined(__linux__) && defined(AQ_THREADS)
+#include <sys/syscall.h>
+#define AQ_NUMA
+#endif
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#define AQ_EVENTS
+#if __has_include(<linux/io_uring.h>)
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#define AQ_IO_URING
+#endif
+#endif
+
+#include "prototype/aq.h"
 
 typedef struct {
   size_t size;
   size_t* index;
 } InternalObject;
 
-typedef void (*func_ptr)(InternalObject, size_t);
+struct VM;
+
+typedef void (*func_ptr)(struct VM*, InternalObject, size_t);
 
 struct Pair {
   char* first;
@@ -32,21 +104,89 @@ struct Memory {
   size_t size;
 };
 
-func_ptr GetFunction(const char* name);
+struct HeapBlock {
+  struct HeapBlock* prev;
+  struct HeapBlock* next;
+};
+
+struct Program {
+  void* bytecode;
+  size_t bytecode_size;
+  void* data;
+  uint8_t* type;
+  size_t memory_size;
+  void* run_code;
+  void* end;
+  // memfd holding the initial data segment, or -1.
+  int template_fd;
+};
 
-struct Memory* memory;
+struct VM {
+  const struct Program* program;
+  struct Memory* memory;
+  // Whether memory->data is a copy-on-write mapping of the program template.
+  bool mapped_memory;
+  struct HeapBlock heap;
+  // Files mapped with file_map, released with the heap.
+  struct MappedFile* mapped_files;
+  struct LinkedList* name_table;
+  bool is_big_endian;
+  FILE* output;
+  int argc;
+  char** argv;
+  void* run_code;
+  void* end;
+  void* pc;
+  struct SpawnedTask* spawned;
+  // The VM created by the embedder that this task or green thread context
+  // belongs to, or the VM itself.
+  struct VM* root;
+  struct Scheduler* scheduler;
+  int schedule_policy;
+  size_t schedule_budget;
+  // Set by natives that block the green thread running on this context.
+  bool blocked;
+  long long deadline;
+  // The descriptor and poll events a blocked native waits for, or -1.
+  int wait_fd;
+  short wait_events;
+  // The io_uring used by the file natives, created on first use and shared
+  // with the VM's green threads, and the request a native waits for.
+  struct Ring* ring;
+  struct RingRequest* request;
+  // Time slicing, counted in ticks: backward branches and calls. The budget
+  // and time limit apply to each AqRunVM() call; green threads use the ones
+  // of the scheduler's owner.
+  size_t slice_budget;
+  long long slice_time;
+  size_t slice_remaining;
+  long long slice_deadline;
+  size_t slice_ticks;
+  size_t green_remaining;
+  // The instruction RunVM is executing, read by the sampling profiler. Only
+  // kept up to date by runs that started while the profiler was running.
+  void* volatile executing;
+};
 
-struct LinkedList name_table[1024];
+func_ptr GetFunction(const struct LinkedList* list, const char* name);
+void JoinSpawnedTasks(struct VM* vm);
+void FreeRing(struct Ring* ring);
 
-bool is_big_endian;
+struct LinkedList name_table[1024];
 
+// Slot types 0x06 to 0x0A are short and unsigned byte, short, int and long.
 #define GET_SIZE(x)  \
   ((x) == 0x00   ? 0 \
    : (x) == 0x01 ? 1 \
    : (x) == 0x02 ? 4 \
    : (x) == 0x03 ? 8 \
    : (x) == 0x04 ? 4 \
-   : (x) == 0x02 ? 8 \
+   : (x) == 0x05 ? 8 \
+   : (x) == 0x06 ? 2 \
+   : (x) == 0x07 ? 1 \
+   : (x) == 0x08 ? 2 \
+   : (x) == 0x09 ? 4 \
+   : (x) == 0x0A ? 8 \
                  : 0)
 
 /*typedef struct {
@@ -54,16 +194,16 @@ bool is_big_endian;
   uint8_t type;
 } Ptr;*/
 
-void IsBigEndian() {
+bool IsBigEndian() {
   uint16_t test_data = 0x0011;
-  is_big_endian = (*(uint8_t*)&test_data == 0x00);
+  return *(uint8_t*)&test_data == 0x00;
 }
 
-/*int16_t Swap16(int16_t x) {
-    uint16_t ux = (uint16_t)x;
-    ux = (ux << 8) | (ux >> 8);
-    return (int16_t)ux;
-}*/
+int16_t SwapShort(int16_t x) {
+  uint16_t ux = (uint16_t)x;
+  ux = (ux << 8) | (ux >> 8);
+  return (int16_t)ux;
+}
 
 int SwapInt(int x) {
   uint32_t ux = (uint32_t)x;
@@ -122,6 +262,9 @@ uint64_t SwapUint64t(uint64_t x) {
 
 struct Memory* InitializeMemory(void* data, void* type, size_t size) {
   struct Memory* memory_ptr = (struct Memory*)malloc(sizeof(struct Memory));
+  if (memory_ptr == NULL) {
+    return NULL;
+  }
 
   memory_ptr->data = data;
   memory_ptr->type = type;
@@ -132,6 +275,362 @@ struct Memory* InitializeMemory(void* data, void* type, size_t size) {
 
 void FreeMemory(struct Memory* memory_ptr) { free(memory_ptr); }
 
+struct VM* InitializeVM(struct Memory* memory, struct LinkedList* name_table,
+                        void* run_code, void* end) {
+  struct VM* vm = (struct VM*)malloc(sizeof(struct VM));
+  if (vm == NULL) {
+    return NULL;
+  }
+
+  vm->program = NULL;
+  vm->memory = memory;
+  vm->mapped_memory = false;
+  vm->heap.prev = &vm->heap;
+  vm->heap.next = &vm->heap;
+  vm->mapped_files = NULL;
+  vm->name_table = name_table;
+  vm->is_big_endian = IsBigEndian();
+  vm->output = stdout;
+  vm->argc = 0;
+  vm->argv = NULL;
+  vm->run_code = run_code;
+  vm->end = end;
+  vm->pc = run_code;
+  vm->spawned = NULL;
+  vm->root = vm;
+  vm->scheduler = NULL;
+  vm->schedule_policy = AQ_SCHEDULE_ROUND_ROBIN;
+  vm->schedule_budget = 1024;
+  vm->blocked = false;
+  vm->deadline = 0;
+  vm->wait_fd = -1;
+  vm->wait_events = 0;
+  vm->ring = NULL;
+  vm->request = NULL;
+  vm->slice_budget = 0;
+  vm->slice_time = 0;
+  vm->slice_remaining = 0;
+  vm->slice_deadline = 0;
+  vm->slice_ticks = 0;
+  vm->green_remaining = 0;
+  vm->executing = NULL;
+
+  return vm;
+}
+
+void* AllocateHeap(struct VM* vm, size_t size) {
+  struct HeapBlock* block =
+      (struct HeapBlock*)malloc(sizeof(struct HeapBlock) + size);
+  if (block == NULL) {
+    return NULL;
+  }
+  block->prev = &vm->heap;
+  block->next = vm->heap.next;
+  vm->heap.next->prev = block;
+  vm->heap.next = block;
+  return block + 1;
+}
+
+void FreeHeap(void* ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  struct HeapBlock* block = (struct HeapBlock*)ptr - 1;
+  block->prev->next = block->next;
+  block->next->prev = block->prev;
+  free(block);
+}
+
+void FreeAllHeap(struct VM* vm) {
+  while (vm->heap.next != &vm->heap) {
+    FreeHeap(vm->heap.next + 1);
+  }
+}
+
+struct MappedFile {
+  void* data;
+  size_t size;
+  struct MappedFile* next;
+};
+
+void UnmapFiles(struct VM* vm) {
+  while (vm->mapped_files != NULL) {
+    struct MappedFile* file = vm->mapped_files;
+    vm->mapped_files = file->next;
+#ifdef AQ_MAPPED_FILES
+    munmap(file->data, file->size);
+#endif
+    free(file);
+  }
+}
+
+void FreeVM(struct VM* vm) {
+  JoinSpawnedTasks(vm);
+  FreeRing(vm->ring);
+  free(vm->request);
+  FreeAllHeap(vm);
+  UnmapFiles(vm);
+  FreeMemory(vm->memory);
+  free(vm);
+}
+
+#ifdef AQ_NUMA
+#define AQ_MAX_NODES 64
+#define AQ_MPOL_PREFERRED 1
+#define AQ_MPOL_MF_MOVE (1 << 1)
+
+// NUMA placement. When enabled, pool workers are pinned to CPUs spread across
+// the nodes, and instance memory is bound to the node of the thread that
+// creates the VM. VMs of batch jobs and parallel loops are created on the
+// worker that runs them, so their memory ends up local to that worker.
+bool placement_enabled = false;
+pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+int cpu_nodes[CPU_SETSIZE];
+size_t node_count = 1;
+// Usable CPUs ordered so that consecutive entries alternate between nodes.
+int placement_cpus[CPU_SETSIZE];
+size_t placement_cpu_count = 0;
+atomic_size_t node_instances[AQ_MAX_NODES];
+
+// Parses a sysfs CPU list such as "0-3,8-11" into |cpus|.
+void ParseCpuList(const char* list, cpu_set_t* cpus) {
+  CPU_ZERO(cpus);
+  while (true) {
+    char* end;
+    long first = strtol(list, &end, 10);
+    if (end == list) {
+      break;
+    }
+    long last = first;
+    if (*end == '-') {
+      last = strtol(end + 1, &end, 10);
+    }
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, cpus);
+    }
+    if (*end != ',') {
+      break;
+    }
+    list = end + 1;
+  }
+}
+
+void LoadTopology() {
+  for (size_t i = 0; i < CPU_SETSIZE; i++) {
+    cpu_nodes[i] = 0;
+  }
+  size_t nodes = 0;
+  for (size_t node = 0; node < AQ_MAX_NODES; node++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist",
+             node);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+      continue;
+    }
+    char list[4096];
+    if (fgets(list, sizeof(list), file) != NULL) {
+      cpu_set_t cpus;
+      ParseCpuList(list, &cpus);
+      for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpus)) {
+          cpu_nodes[cpu] = (int)node;
+        }
+      }
+    }
+    fclose(file);
+    nodes = node + 1;
+  }
+  node_count = nodes > 0 ? nodes : 1;
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return;
+  }
+  // Take one CPU of each node in turn.
+  bool taken[CPU_SETSIZE] = {false};
+  bool found = true;
+  while (found) {
+    found = false;
+    for (size_t node = 0; node < node_count; node++) {
+      for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!taken[cpu] && CPU_ISSET(cpu, &allowed) &&
+            cpu_nodes[cpu] == (int)node) {
+          taken[cpu] = true;
+          placement_cpus[placement_cpu_count++] = (int)cpu;
+          found = true;
+          break;
+        }
+      }
+    }
+  }
+}
+
+// Sets the affinity of the worker created with |attributes| and returns its
+// CPU, or -1.
+int PlaceWorker(size_t index, pthread_attr_t* attributes) {
+  if (!placement_enabled) {
+    return -1;
+  }
+  pthread_once(&topology_once, LoadTopology);
+  if (placement_cpu_count == 0) {
+    return -1;
+  }
+  int cpu = placement_cpus[index % placement_cpu_count];
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  if (pthread_attr_setaffinity_np(attributes, sizeof(cpus), &cpus) != 0) {
+    return -1;
+  }
+  return cpu;
+}
+
+int CurrentNode() {
+  int cpu = sched_getcpu();
+  return cpu >= 0 && cpu < CPU_SETSIZE ? cpu_nodes[cpu] : 0;
+}
+
+// Binds the pages of |data| to the local node, moving pages that were already
+// touched elsewhere. Pages not yet touched are allocated there on first use.
+void PlaceMemory(void* data, size_t size) {
+  if (!placement_enabled) {
+    return;
+  }
+  pthread_once(&topology_once, LoadTopology);
+  int node = CurrentNode();
+  atomic_fetch_add(&node_instances[node % AQ_MAX_NODES], 1);
+  if (node_count < 2) {
+    return;
+  }
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t begin = ((uintptr_t)data + page - 1) & ~(page - 1);
+  uintptr_t end = ((uintptr_t)data + size) & ~(page - 1);
+  if (begin < end) {
+    unsigned long mask[AQ_MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+    mask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, (void*)begin, end - begin, AQ_MPOL_PREFERRED, mask,
+            AQ_MAX_NODES + 1, AQ_MPOL_MF_MOVE);
+  }
+}
+#else
+#ifdef AQ_THREADS
+int PlaceWorker(size_t index, pthread_attr_t* attributes) { return -1; }
+#endif
+void PlaceMemory(void* data, size_t size) {}
+#endif
+
+// Instances start from a copy of the program's data segment. Segments of at
+// least a page are mapped copy-on-write from a template shared by every
+// instance of the program, so an instance only pays for the pages it writes.
+// Smaller segments are cheaper to copy than to map.
+void CreateMemoryTemplate(struct Program* program) {
+  program->template_fd = -1;
+#ifdef AQ_COPY_ON_WRITE
+  if (program->memory_size < (size_t)sysconf(_SC_PAGESIZE)) {
+    return;
+  }
+  int fd = memfd_create("aq-template", MFD_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  size_t written = 0;
+  while (written < program->memory_size) {
+    ssize_t count = write(fd, (char*)program->data + written,
+                          program->memory_size - written);
+    if (count <= 0) {
+      close(fd);
+      return;
+    }
+    written += count;
+  }
+  program->template_fd = fd;
+#endif
+}
+
+void FreeMemoryTemplate(struct Program* program) {
+#ifdef AQ_COPY_ON_WRITE
+  if (program->template_fd >= 0) {
+    close(program->template_fd);
+  }
+#endif
+}
+
+void* CreateInstanceMemory(const struct Program* program, bool* mapped) {
+#ifdef AQ_COPY_ON_WRITE
+  if (program->template_fd >= 0) {
+    void* data = mmap(NULL, program->memory_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, program->template_fd, 0);
+    if (data != MAP_FAILED) {
+      *mapped = true;
+      return data;
+    }
+  }
+#endif
+  *mapped = false;
+  void* data = malloc(program->memory_size);
+  if (data != NULL) {
+    memcpy(data, program->data, program->memory_size);
+  }
+  return data;
+}
+
+// Restores the memory of |vm| to the program's initial data. Mapped memory
+// drops its private pages by mapping the template over them again.
+void ResetInstanceMemory(struct VM* vm) {
+#ifdef AQ_COPY_ON_WRITE
+  if (vm->mapped_memory &&
+      mmap(vm->memory->data, vm->program->memory_size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, vm->program->template_fd,
+           0) != MAP_FAILED) {
+    return;
+  }
+#endif
+  memcpy(vm->memory->data, vm->program->data, vm->program->memory_size);
+}
+
+void FreeInstanceMemory(struct VM* vm) {
+#ifdef AQ_COPY_ON_WRITE
+  if (vm->mapped_memory) {
+    munmap(vm->memory->data, vm->memory->size);
+    return;
+  }
+#endif
+  free(vm->memory->data);
+}
+
+// Creates a VM with its own instance memory for |program|, or returns NULL if
+// memory runs out.
+struct VM* CreateProgramVM(const struct Program* program) {
+  bool mapped;
+  void* data = CreateInstanceMemory(program, &mapped);
+  if (data == NULL) {
+    return NULL;
+  }
+  struct Memory* memory =
+      InitializeMemory(data, program->type, program->memory_size);
+  struct VM* vm =
+      memory != NULL
+          ? InitializeVM(memory, name_table, program->run_code, program->end)
+          : NULL;
+  if (vm == NULL) {
+    free(memory);
+#ifdef AQ_COPY_ON_WRITE
+    if (mapped) {
+      munmap(data, program->memory_size);
+      return NULL;
+    }
+#endif
+    free(data);
+    return NULL;
+  }
+  vm->program = program;
+  vm->mapped_memory = mapped;
+  PlaceMemory(data, program->memory_size);
+  return vm;
+}
+
 int SetType(const struct Memory* memory, size_t index, uint8_t type) {
   if (index % 2 != 0) {
     return memory->type[index / 2] & 0x0F;
@@ -158,274 +657,799 @@ uint8_t GetType(const struct Memory* memory, size_t index) {
   }
 }
 
-void* GetPtrData(size_t index) {
-  switch (GetType(memory, index)) {
+bool IsUnsignedType(uint8_t type) { return type >= 0x07 && type <= 0x0A; }
+
+// Reads a short or unsigned slot. Unsigned values are zero-extended and
+// shorts sign-extended.
+uint64_t GetExtendedInteger(struct VM* vm, size_t index) {
+  void* slot = (void*)((uintptr_t)vm->memory->data + index);
+  switch (GetType(vm->memory, index)) {
+    case 0x06:
+    case 0x08: {
+      int16_t value;
+      memcpy(&value, slot, sizeof(value));
+      value = vm->is_big_endian ? value : SwapShort(value);
+      return GetType(vm->memory, index) == 0x06 ? (uint64_t)(int64_t)value
+                                                : (uint16_t)value;
+    }
+    case 0x07:
+      return *(uint8_t*)slot;
+    case 0x09: {
+      int value;
+      memcpy(&value, slot, sizeof(value));
+      return (uint32_t)(vm->is_big_endian ? value : SwapInt(value));
+    }
+    case 0x0A: {
+      uint64_t value;
+      memcpy(&value, slot, sizeof(value));
+      return vm->is_big_endian ? value : SwapUint64t(value);
+    }
+    default:
+      return 0;
+  }
+}
+
+double GetExtendedDouble(struct VM* vm, size_t index) {
+  uint64_t value = GetExtendedInteger(vm, index);
+  return GetType(vm->memory, index) == 0x06 ? (double)(int64_t)value
+                                            : (double)value;
+}
+
+// Stores the low bits of |value| in a short or unsigned slot.
+void SetExtendedInteger(struct VM* vm, size_t index, uint64_t value) {
+  void* slot = (void*)((uintptr_t)vm->memory->data + index);
+  switch (GetType(vm->memory, index)) {
+    case 0x06:
+    case 0x08: {
+      int16_t bits = (int16_t)value;
+      bits = vm->is_big_endian ? bits : SwapShort(bits);
+      memcpy(slot, &bits, sizeof(bits));
+      break;
+    }
+    case 0x07:
+      *(uint8_t*)slot = (uint8_t)value;
+      break;
+    case 0x09: {
+      int bits = (int)(uint32_t)value;
+      bits = vm->is_big_endian ? bits : SwapInt(bits);
+      memcpy(slot, &bits, sizeof(bits));
+      break;
+    }
+    case 0x0A:
+      value = vm->is_big_endian ? value : SwapUint64t(value);
+      memcpy(slot, &value, sizeof(value));
+      break;
+    default:
+      break;
+  }
+}
+
+// Converts like a C cast to the slot's type, so values up to 2^64 reach
+// unsigned long slots.
+uint64_t DoubleToInteger(double value) {
+  return value >= 9223372036854775808.0 ? (uint64_t)value
+                                        : (uint64_t)(int64_t)value;
+}
+
+void* GetPtrData(struct VM* vm, size_t index) {
+  switch (GetType(vm->memory, index)) {
     /*case 0x01:
-      return (void*)(*(int8_t*)((uintptr_t)memory->data + index));
+      return (void*)(*(int8_t*)((uintptr_t)vm->memory->data + index));
     case 0x02:
-      return (void*)(*(int*)((uintptr_t)memory->data + index));
+      return (void*)(*(int*)((uintptr_t)vm->memory->data + index));
     case 0x03:
-      return (void*)(*(long*)((uintptr_t)memory->data + index));*/
+      return (void*)(*(long*)((uintptr_t)vm->memory->data + index));*/
     default:
-      return *(void**)((uintptr_t)memory->data + index);
+      return *(void**)((uintptr_t)vm->memory->data + index);
   }
 }
 
-int8_t GetByteData(size_t index) {
-  switch (GetType(memory, index)) {
+int8_t GetByteData(struct VM* vm, size_t index) {
+  switch (GetType(vm->memory, index)) {
     case 0x01:
-      return *(int8_t*)((uintptr_t)memory->data + index);
+      return *(int8_t*)((uintptr_t)vm->memory->data + index);
     case 0x02:
-      return *(int*)((uintptr_t)memory->data + index);
+      return *(int*)((uintptr_t)vm->memory->data + index);
     case 0x03:
-      return *(long*)((uintptr_t)memory->data + index);
+      return *(long*)((uintptr_t)vm->memory->data + index);
     case 0x04:
-      return *(float*)((uintptr_t)memory->data + index);
+      return *(float*)((uintptr_t)vm->memory->data + index);
     case 0x05:
-      return *(double*)((uintptr_t)memory->data + index);
+      return *(double*)((uintptr_t)vm->memory->data + index);
+    case 0x06:
+    case 0x07:
+    case 0x08:
+    case 0x09:
+    case 0x0A:
+      return (int8_t)GetExtendedInteger(vm, index);
     default:
       return 0;
   }
 }
 
-int GetIntData(size_t index) {
-  switch (GetType(memory, index)) {
+int GetIntData(struct VM* vm, size_t index) {
+  switch (GetType(vm->memory, index)) {
     case 0x01:
-      return *(int8_t*)((uintptr_t)memory->data + index);
+      return *(int8_t*)((uintptr_t)vm->memory->data + index);
     case 0x02:
-      return is_big_endian ? *(int*)((uintptr_t)memory->data + index)
-                           : SwapInt(*(int*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(int*)((uintptr_t)vm->memory->data + index)
+                 : SwapInt(*(int*)((uintptr_t)vm->memory->data + index));
     case 0x03:
-      return is_big_endian
-                 ? *(long*)((uintptr_t)memory->data + index)
-                 : SwapLong(*(long*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(long*)((uintptr_t)vm->memory->data + index)
+                 : SwapLong(*(long*)((uintptr_t)vm->memory->data + index));
     case 0x04:
-      return is_big_endian
-                 ? *(float*)((uintptr_t)memory->data + index)
-                 : SwapFloat(*(float*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(float*)((uintptr_t)vm->memory->data + index)
+                 : SwapFloat(*(float*)((uintptr_t)vm->memory->data + index));
     case 0x05:
-      return is_big_endian
-                 ? *(double*)((uintptr_t)memory->data + index)
-                 : SwapDouble(*(double*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(double*)((uintptr_t)vm->memory->data + index)
+                 : SwapDouble(*(double*)((uintptr_t)vm->memory->data + index));
+    case 0x06:
+    case 0x07:
+    case 0x08:
+    case 0x09:
+    case 0x0A:
+      return (int)GetExtendedInteger(vm, index);
     default:
       return 0;
   }
 }
 
-long GetLongData(size_t index) {
-  switch (GetType(memory, index)) {
+long GetLongData(struct VM* vm, size_t index) {
+  switch (GetType(vm->memory, index)) {
     case 0x01:
-      return *(int8_t*)((uintptr_t)memory->data + index);
+      return *(int8_t*)((uintptr_t)vm->memory->data + index);
     case 0x02:
-      return is_big_endian ? *(int*)((uintptr_t)memory->data + index)
-                           : SwapInt(*(int*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(int*)((uintptr_t)vm->memory->data + index)
+                 : SwapInt(*(int*)((uintptr_t)vm->memory->data + index));
     case 0x03:
-      return is_big_endian
-                 ? *(long*)((uintptr_t)memory->data + index)
-                 : SwapLong(*(long*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(long*)((uintptr_t)vm->memory->data + index)
+                 : SwapLong(*(long*)((uintptr_t)vm->memory->data + index));
     case 0x04:
-      return is_big_endian
-                 ? *(float*)((uintptr_t)memory->data + index)
-                 : SwapFloat(*(float*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(float*)((uintptr_t)vm->memory->data + index)
+                 : SwapFloat(*(float*)((uintptr_t)vm->memory->data + index));
     case 0x05:
-      return is_big_endian
-                 ? *(double*)((uintptr_t)memory->data + index)
-                 : SwapDouble(*(double*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(double*)((uintptr_t)vm->memory->data + index)
+                 : SwapDouble(*(double*)((uintptr_t)vm->memory->data + index));
+    case 0x06:
+    case 0x07:
+    case 0x08:
+    case 0x09:
+    case 0x0A:
+      return (long)GetExtendedInteger(vm, index);
     default:
       return 0;
   }
 }
 
-float GetFloatData(size_t index) {
-  switch (GetType(memory, index)) {
+float GetFloatData(struct VM* vm, size_t index) {
+  switch (GetType(vm->memory, index)) {
     case 0x01:
-      return *(int8_t*)((uintptr_t)memory->data + index);
+      return *(int8_t*)((uintptr_t)vm->memory->data + index);
     case 0x02:
-      return is_big_endian ? *(int*)((uintptr_t)memory->data + index)
-                           : SwapInt(*(int*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(int*)((uintptr_t)vm->memory->data + index)
+                 : SwapInt(*(int*)((uintptr_t)vm->memory->data + index));
     case 0x03:
-      return is_big_endian
-                 ? *(long*)((uintptr_t)memory->data + index)
-                 : SwapLong(*(long*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(long*)((uintptr_t)vm->memory->data + index)
+                 : SwapLong(*(long*)((uintptr_t)vm->memory->data + index));
     case 0x04:
-      return is_big_endian
-                 ? *(float*)((uintptr_t)memory->data + index)
-                 : SwapFloat(*(float*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(float*)((uintptr_t)vm->memory->data + index)
+                 : SwapFloat(*(float*)((uintptr_t)vm->memory->data + index));
     case 0x05:
-      return is_big_endian
-                 ? *(double*)((uintptr_t)memory->data + index)
-                 : SwapDouble(*(double*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(double*)((uintptr_t)vm->memory->data + index)
+                 : SwapDouble(*(double*)((uintptr_t)vm->memory->data + index));
+    case 0x06:
+    case 0x07:
+    case 0x08:
+    case 0x09:
+    case 0x0A:
+      return (float)GetExtendedDouble(vm, index);
     default:
       return 0;
   }
 }
 
-double GetDoubleData(size_t index) {
-  switch (GetType(memory, index)) {
+double GetDoubleData(struct VM* vm, size_t index) {
+  switch (GetType(vm->memory, index)) {
     case 0x01:
-      return *(int8_t*)((uintptr_t)memory->data + index);
+      return *(int8_t*)((uintptr_t)vm->memory->data + index);
     case 0x02:
-      return is_big_endian ? *(int*)((uintptr_t)memory->data + index)
-                           : SwapInt(*(int*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(int*)((uintptr_t)vm->memory->data + index)
+                 : SwapInt(*(int*)((uintptr_t)vm->memory->data + index));
     case 0x03:
-      return is_big_endian
-                 ? *(long*)((uintptr_t)memory->data + index)
-                 : SwapLong(*(long*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(long*)((uintptr_t)vm->memory->data + index)
+                 : SwapLong(*(long*)((uintptr_t)vm->memory->data + index));
     case 0x04:
-      return is_big_endian
-                 ? *(float*)((uintptr_t)memory->data + index)
-                 : SwapFloat(*(float*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(float*)((uintptr_t)vm->memory->data + index)
+                 : SwapFloat(*(float*)((uintptr_t)vm->memory->data + index));
     case 0x05:
-      return is_big_endian
-                 ? *(double*)((uintptr_t)memory->data + index)
-                 : SwapDouble(*(double*)((uintptr_t)memory->data + index));
+      return vm->is_big_endian
+                 ? *(double*)((uintptr_t)vm->memory->data + index)
+                 : SwapDouble(*(double*)((uintptr_t)vm->memory->data + index));
+    case 0x06:
+    case 0x07:
+    case 0x08:
+    case 0x09:
+    case 0x0A:
+      return GetExtendedDouble(vm, index);
     default:
       return 0;
   }
 }
 
-void SetPtrData(size_t index, void* ptr) {
-  switch (GetType(memory, index)) {
+void SetPtrData(struct VM* vm, size_t index, void* ptr) {
+  switch (GetType(vm->memory, index)) {
     /*case 0x01:
-      *(int8_t*)((uintptr_t)memory->data + index) = ptr;
+      *(int8_t*)((uintptr_t)vm->memory->data + index) = ptr;
       break;
     case 0x02:
-      *(int*)((uintptr_t)memory->data + index) = ptr;
+      *(int*)((uintptr_t)vm->memory->data + index) = ptr;
       break;
     case 0x03:
-      *(long*)((uintptr_t)memory->data + index) = ptr;
+      *(long*)((uintptr_t)vm->memory->data + index) = ptr;
       break;*/
     default:
-      *(void**)((uintptr_t)memory->data + index) = ptr;
+      *(void**)((uintptr_t)vm->memory->data + index) = ptr;
   }
 }
 
-void SetByteData(size_t index, int8_t value) {
-  switch (GetType(memory, index)) {
+void SetByteData(struct VM* vm, size_t index, int8_t value) {
+  switch (GetType(vm->memory, index)) {
     case 0x01:
-      *(int8_t*)((uintptr_t)memory->data + index) = value;
+      *(int8_t*)((uintptr_t)vm->memory->data + index) = value;
       break;
     case 0x02:
-      *(int*)((uintptr_t)memory->data + index) = value;
+      *(int*)((uintptr_t)vm->memory->data + index) = value;
       break;
     case 0x03:
-      *(long*)((uintptr_t)memory->data + index) = value;
+      *(long*)((uintptr_t)vm->memory->data + index) = value;
       break;
     case 0x04:
-      *(float*)((uintptr_t)memory->data + index) = value;
+      *(float*)((uintptr_t)vm->memory->data + index) = value;
       break;
     case 0x05:
-      *(double*)((uintptr_t)memory->data + index) = value;
+      *(double*)((uintptr_t)vm->memory->data + index) = value;
+      break;
+    case 0x06:
+    case 0x07:
+    case 0x08:
+    case 0x09:
+    case 0x0A:
+      SetExtendedInteger(vm, index, (uint64_t)(int64_t)value);
       break;
     default:
       break;
   }
 }
 
-void SetIntData(size_t index, int value) {
-  switch (GetType(memory, index)) {
+void SetIntData(struct VM* vm, size_t index, int value) {
+  switch (GetType(vm->memory, index)) {
     case 0x01:
-      *(int8_t*)((uintptr_t)memory->data + index) = value;
+      *(int8_t*)((uintptr_t)vm->memory->data + index) = value;
       break;
     case 0x02:
-      *(int*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapInt(value);
+      *(int*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? value : SwapInt(value);
       break;
     case 0x03:
-      *(long*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapLong(value);
+      *(long*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? value : SwapLong(value);
       break;
     case 0x04:
-      *(float*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapFloat(value);
+      *(float*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? value : SwapFloat(value);
       break;
     case 0x05:
-      *(double*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapDouble(value);
+      *(double*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? value : SwapDouble(value);
+      break;
+    case 0x06:
+    case 0x07:
+    case 0x08:
+    case 0x09:
+    case 0x0A:
+      SetExtendedInteger(vm, index, (uint64_t)(int64_t)value);
       break;
     default:
       break;
   }
 }
 
-void SetLongData(size_t index, long value) {
-  switch (GetType(memory, index)) {
+void SetLongData(struct VM* vm, size_t index, long value) {
+  switch (GetType(vm->memory, index)) {
     case 0x01:
-      *(int8_t*)((uintptr_t)memory->data + index) = value;
+      *(int8_t*)((uintptr_t)vm->memory->data + index) = value;
       break;
     case 0x02:
-      *(int*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapInt(value);
+      *(int*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? value : SwapInt(value);
       break;
     case 0x03:
-      *(long*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapLong(value);
+      *(long*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? value : SwapLong(value);
       break;
     case 0x04:
-      *(float*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapFloat(value);
+      *(float*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? value : SwapFloat(value);
       break;
     case 0x05:
-      *(double*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapDouble(value);
+      *(double*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? value : SwapDouble(value);
+      break;
+    case 0x06:
+    case 0x07:
+    case 0x08:
+    case 0x09:
+    case 0x0A:
+      SetExtendedInteger(vm, index, (uint64_t)(int64_t)value);
       break;
     default:
       break;
   }
 }
 
-void SetFloatData(size_t index, float value) {
-  switch (GetType(memory, index)) {
+void SetFloatData(struct VM* vm, size_t index, float value) {
+  switch (GetType(vm->memory, index)) {
     case 0x01:
-      *(int8_t*)((uintptr_t)memory->data + index) = value;
+      *(int8_t*)((uintptr_t)vm->memory->data + index) = value;
       break;
     case 0x02:
-      *(int*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapInt(value);
+      *(int*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? (int)value : SwapInt(value);
       break;
     case 0x03:
-      *(long*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapLong(value);
+      *(long*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? (long)value : SwapLong(value);
       break;
     case 0x04:
-      *(float*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapFloat(value);
+      *(float*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? value : SwapFloat(value);
       break;
     case 0x05:
-      *(double*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapDouble(value);
+      *(double*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? value : SwapDouble(value);
+      break;
+    case 0x06:
+    case 0x07:
+    case 0x08:
+    case 0x09:
+    case 0x0A:
+      SetExtendedInteger(vm, index, DoubleToInteger(value));
       break;
     default:
       break;
   }
 }
 
-void SetDoubleData(size_t index, double value) {
-  switch (GetType(memory, index)) {
+void SetDoubleData(struct VM* vm, size_t index, double value) {
+  switch (GetType(vm->memory, index)) {
     case 0x01:
-      *(int8_t*)((uintptr_t)memory->data + index) = value;
+      *(int8_t*)((uintptr_t)vm->memory->data + index) = value;
       break;
     case 0x02:
-      *(int*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapInt(value);
+      *(int*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? (int)value : SwapInt(value);
       break;
     case 0x03:
-      *(long*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapLong(value);
+      *(long*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? (long)value : SwapLong(value);
       break;
     case 0x04:
-      *(float*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapFloat(value);
+      *(float*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? value : SwapFloat(value);
       break;
     case 0x05:
-      *(double*)((uintptr_t)memory->data + index) =
-          is_big_endian ? value : SwapDouble(value);
+      *(double*)((uintptr_t)vm->memory->data + index) =
+          vm->is_big_endian ? value : SwapDouble(value);
+      break;
+    case 0x06:
+    case 0x07:
+    case 0x08:
+    case 0x09:
+    case 0x0A:
+      SetExtendedInteger(vm, index, DoubleToInteger(value));
       break;
     default:
       break;
   }
 }
 
+struct TaskGroup {
+#ifdef AQ_THREADS
+  atomic_size_t pending;
+#else
+  size_t pending;
+#endif
+};
+
+// Embedded as the first member of whatever a task needs, so submitting work
+// does not allocate.
+struct PoolTask {
+  void (*run)(struct PoolTask* task);
+  struct TaskGroup* group;
+};
+
+#ifdef AQ_THREADS
+struct DequeArray {
+  long capacity;
+  // Arrays replaced by a grow stay alive until the deque is freed, because a
+  // thief may still be reading from them.
+  struct DequeArray* previous;
+  _Atomic(struct PoolTask*) tasks[];
+};
+
+// Chase-Lev work-stealing deque. The owning thread pushes and pops at the
+// bottom without locks; other threads steal from the top with a CAS.
+struct WorkDeque {
+  atomic_long top;
+  atomic_long bottom;
+  _Atomic(struct DequeArray*) array;
+};
+
+struct Worker {
+  struct ThreadPool* pool;
+  size_t index;
+  pthread_t thread;
+  // CPU the worker is pinned to, or -1.
+  int cpu;
+};
+
+struct ThreadPool {
+  size_t size;
+  struct Worker* workers;
+  // One deque per worker plus a shared one for threads outside the pool,
+  // whose owner side is serialized by |external_lock|.
+  struct WorkDeque* deques;
+  pthread_mutex_t external_lock;
+  atomic_size_t queued;
+  atomic_size_t sleeping;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  bool stop;
+};
+
+_Thread_local struct ThreadPool* current_pool = NULL;
+_Thread_local size_t current_worker = 0;
+
+struct DequeArray* CreateDequeArray(long capacity) {
+  struct DequeArray* array = (struct DequeArray*)malloc(
+      sizeof(struct DequeArray) + capacity * sizeof(struct PoolTask*));
+  array->capacity = capacity;
+  array->previous = NULL;
+  return array;
+}
+
+void InitializeWorkDeque(struct WorkDeque* deque) {
+  atomic_init(&deque->top, 0);
+  atomic_init(&deque->bottom, 0);
+  atomic_init(&deque->array, CreateDequeArray(64));
+}
+
+struct DequeArray* GrowWorkDeque(struct WorkDeque* deque,
+                                 struct DequeArray* array, long top,
+                                 long bottom) {
+  struct DequeArray* grown = CreateDequeArray(2 * array->capacity);
+  for (long i = top; i < bottom; i++) {
+    atomic_store_explicit(
+        &grown->tasks[i % grown->capacity],
+        atomic_load_explicit(&array->tasks[i % array->capacity],
+                             memory_order_relaxed),
+        memory_order_relaxed);
+  }
+  grown->previous = array;
+  atomic_store_explicit(&deque->array, grown, memory_order_release);
+  return grown;
+}
+
+void PushWorkDeque(struct WorkDeque* deque, struct PoolTask* task) {
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  struct DequeArray* array =
+      atomic_load_explicit(&deque->array, memory_order_relaxed);
+  if (bottom - top > array->capacity - 1) {
+    array = GrowWorkDeque(deque, array, top, bottom);
+  }
+  atomic_store_explicit(&array->tasks[bottom % array->capacity], task,
+                        memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+}
+
+struct PoolTask* PopWorkDeque(struct WorkDeque* deque) {
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  struct DequeArray* array =
+      atomic_load_explicit(&deque->array, memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+  if (top > bottom) {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return NULL;
+  }
+  struct PoolTask* task = atomic_load_explicit(
+      &array->tasks[bottom % array->capacity], memory_order_relaxed);
+  if (top == bottom) {
+    // Last element: race the thieves for it.
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+      task = NULL;
+    }
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  }
+  return task;
+}
+
+struct PoolTask* StealWorkDeque(struct WorkDeque* deque) {
+  long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  if (top >= bottom) {
+    return NULL;
+  }
+  struct DequeArray* array =
+      atomic_load_explicit(&deque->array, memory_order_acquire);
+  struct PoolTask* task = atomic_load_explicit(
+      &array->tasks[top % array->capacity], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed)) {
+    return NULL;
+  }
+  return task;
+}
+
+void FreeWorkDeque(struct WorkDeque* deque) {
+  struct DequeArray* array = atomic_load(&deque->array);
+  while (array != NULL) {
+    struct DequeArray* previous = array->previous;
+    free(array);
+    array = previous;
+  }
+}
+
+struct PoolTask* FindTask(struct ThreadPool* pool, size_t self) {
+  if (atomic_load(&pool->queued) == 0) {
+    return NULL;
+  }
+  struct PoolTask* task;
+  if (self == pool->size) {
+    pthread_mutex_lock(&pool->external_lock);
+    task = PopWorkDeque(&pool->deques[self]);
+    pthread_mutex_unlock(&pool->external_lock);
+  } else {
+    task = PopWorkDeque(&pool->deques[self]);
+  }
+  for (size_t i = 1; task == NULL && i <= pool->size; i++) {
+    task = StealWorkDeque(&pool->deques[(self + i) % (pool->size + 1)]);
+  }
+  if (task != NULL) {
+    atomic_fetch_sub(&pool->queued, 1);
+  }
+  return task;
+}
+
+void WakeThreads(struct ThreadPool* pool, bool all) {
+  if (atomic_load(&pool->sleeping) == 0) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  if (all) {
+    pthread_cond_broadcast(&pool->wake);
+  } else {
+    pthread_cond_signal(&pool->wake);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void RunPoolTask(struct ThreadPool* pool, struct PoolTask* task) {
+  // The task may be freed as soon as its group drops to zero.
+  struct TaskGroup* group = task->group;
+  task->run(task);
+  if (atomic_fetch_sub(&group->pending, 1) == 1) {
+    WakeThreads(pool, true);
+  }
+}
+
+void* WorkerMain(void* arg) {
+  struct Worker* worker = (struct Worker*)arg;
+  struct ThreadPool* pool = worker->pool;
+  current_pool = pool;
+  current_worker = worker->index;
+
+  while (true) {
+    struct PoolTask* task = FindTask(pool, worker->index);
+    if (task != NULL) {
+      RunPoolTask(pool, task);
+      continue;
+    }
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->sleeping, 1);
+    while (atomic_load(&pool->queued) == 0 && !pool->stop) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    atomic_fetch_sub(&pool->sleeping, 1);
+    bool stop = pool->stop;
+    pthread_mutex_unlock(&pool->lock);
+    if (stop) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+struct ThreadPool* CreateThreadPool(size_t size) {
+  struct ThreadPool* pool =
+      (struct ThreadPool*)malloc(sizeof(struct ThreadPool));
+  pool->size = size;
+  pool->workers = (struct Worker*)malloc(size * sizeof(struct Worker));
+  pool->deques =
+      (struct WorkDeque*)malloc((size + 1) * sizeof(struct WorkDeque));
+  for (size_t i = 0; i <= size; i++) {
+    InitializeWorkDeque(&pool->deques[i]);
+  }
+  pthread_mutex_init(&pool->external_lock, NULL);
+  atomic_init(&pool->queued, 0);
+  atomic_init(&pool->sleeping, 0);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pool->stop = false;
+  for (size_t i = 0; i < size; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pool->workers[i].cpu = PlaceWorker(i, &attributes);
+    pthread_create(&pool->workers[i].thread, &attributes, WorkerMain,
+                   &pool->workers[i]);
+    pthread_attr_destroy(&attributes);
+  }
+  return pool;
+}
+
+void FreeThreadPool(struct ThreadPool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 0; i < pool->size; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+  for (size_t i = 0; i <= pool->size; i++) {
+    FreeWorkDeque(&pool->deques[i]);
+  }
+  pthread_mutex_destroy(&pool->external_lock);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  free(pool->deques);
+  free(pool->workers);
+  free(pool);
+}
+
+size_t CurrentWorker(struct ThreadPool* pool) {
+  return current_pool == pool ? current_worker : pool->size;
+}
+
+bool PoolIsHungry(struct ThreadPool* pool) {
+  return pool->size > 0 && atomic_load(&pool->queued) == 0;
+}
+
+void SubmitTask(struct ThreadPool* pool, struct TaskGroup* group,
+                struct PoolTask* task) {
+  task->group = group;
+  atomic_fetch_add(&group->pending, 1);
+  atomic_fetch_add(&pool->queued, 1);
+  size_t self = CurrentWorker(pool);
+  if (self == pool->size) {
+    pthread_mutex_lock(&pool->external_lock);
+    PushWorkDeque(&pool->deques[self], task);
+    pthread_mutex_unlock(&pool->external_lock);
+  } else {
+    PushWorkDeque(&pool->deques[self], task);
+  }
+  WakeThreads(pool, false);
+}
+
+// Runs queued tasks on the calling thread until every task of |group| has
+// finished, so waiting inside a task cannot deadlock the pool.
+void WaitTaskGroup(struct ThreadPool* pool, struct TaskGroup* group) {
+  size_t self = CurrentWorker(pool);
+  while (atomic_load(&group->pending) > 0) {
+    struct PoolTask* task = FindTask(pool, self);
+    if (task != NULL) {
+      RunPoolTask(pool, task);
+      continue;
+    }
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->sleeping, 1);
+    if (atomic_load(&group->pending) > 0 && atomic_load(&pool->queued) == 0) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    atomic_fetch_sub(&pool->sleeping, 1);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+_Atomic(struct ThreadPool*) thread_pool = NULL;
+pthread_mutex_t thread_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+size_t thread_count = 0;
+
+struct ThreadPool* GetThreadPool() {
+  struct ThreadPool* pool = atomic_load(&thread_pool);
+  if (pool != NULL) {
+    return pool;
+  }
+  pthread_mutex_lock(&thread_pool_lock);
+  pool = atomic_load(&thread_pool);
+  if (pool == NULL) {
+    size_t count = thread_count;
+    if (count == 0) {
+      long online = sysconf(_SC_NPROCESSORS_ONLN);
+      count = online > 0 ? (size_t)online : 1;
+    }
+    // The thread that waits on a task group helps running it, so the pool
+    // itself needs one thread less than the requested parallelism.
+    pool = CreateThreadPool(count - 1);
+    atomic_store(&thread_pool, pool);
+  }
+  pthread_mutex_unlock(&thread_pool_lock);
+  return pool;
+}
+
+void FreeGlobalThreadPool() {
+  pthread_mutex_lock(&thread_pool_lock);
+  struct ThreadPool* pool = atomic_exchange(&thread_pool, NULL);
+  if (pool != NULL) {
+    FreeThreadPool(pool);
+  }
+  pthread_mutex_unlock(&thread_pool_lock);
+}
+#else
+struct ThreadPool {
+  size_t size;
+};
+
+struct ThreadPool serial_pool = {0};
+size_t thread_count = 0;
+
+struct ThreadPool* GetThreadPool() { return &serial_pool; }
+
+size_t CurrentWorker(struct ThreadPool* pool) { return 0; }
+
+bool PoolIsHungry(struct ThreadPool* pool) { return false; }
+
+void FreeGlobalThreadPool() {}
+
+void SubmitTask(struct ThreadPool* pool, struct TaskGroup* group,
+                struct PoolTask* task) {
+  task->group = group;
+  task->run(task);
+}
+
+void WaitTaskGroup(struct ThreadPool* pool, struct TaskGroup* group) {}
+#endif
+
+void InitializeTaskGroup(struct TaskGroup* group) {
+#ifdef AQ_THREADS
+  atomic_init(&group->pending, 0);
+#else
+  group->pending = 0;
+#endif
+}
+
 void* Get1Parament(void* ptr, size_t* first) {
   int state = 0;
   int size = 0;
@@ -543,9 +1567,11 @@ void* Get4Parament(void* ptr, size_t* first, size_t* second, size_t* third,
   return ptr;
 }
 
-int INVOKE(size_t* func, size_t return_value, InternalObject args);
+int INVOKE(struct VM* vm, size_t* func, size_t return_value,
+           InternalObject args);
 
-void* GetUnknownCountParamentAndINVOKE(void* ptr, size_t* return_value,
+void* GetUnknownCountParamentAndINVOKE(struct VM* vm, void* ptr,
+                                       size_t* return_value,
                                        size_t* arg_count) {
   int state = 0;
   int size = 0;
@@ -602,7 +1628,7 @@ void* GetUnknownCountParamentAndINVOKE(void* ptr, size_t* return_value,
 
   args_obj.index = args;
 
-  INVOKE(&func, *return_value, args_obj);
+  INVOKE(vm, &func, *return_value, args_obj);
 
   free(args);
 
@@ -610,163 +1636,467 @@ void* GetUnknownCountParamentAndINVOKE(void* ptr, size_t* return_value,
 }
 
 int NOP() { return 0; }
-int LOAD(size_t ptr, size_t operand) {
-  WriteData(memory, operand, (void*)((uintptr_t)memory->data + ptr),
-            GET_SIZE(GetType(memory, operand)));
+int LOAD(struct VM* vm, size_t ptr, size_t operand) {
+  WriteData(vm->memory, operand, (void*)((uintptr_t)vm->memory->data + ptr),
+            GET_SIZE(GetType(vm->memory, operand)));
   return 0;
 }
-int STORE(size_t ptr, size_t operand) {
-  memcpy(*((void**)((uintptr_t)memory->data + ptr)),
-         (void*)((uintptr_t)memory->data + operand),
-         GET_SIZE(GetType(memory, operand)));
+int STORE(struct VM* vm, size_t ptr, size_t operand) {
+  memcpy(*((void**)((uintptr_t)vm->memory->data + ptr)),
+         (void*)((uintptr_t)vm->memory->data + operand),
+         GET_SIZE(GetType(vm->memory, operand)));
   return 0;
 }
-int NEW(size_t ptr, size_t size) {
-  size_t size_value = GetLongData(size);
-  void* data = malloc(size_value);
-  WriteData(memory, ptr, &data, sizeof(data));
+int NEW(struct VM* vm, size_t ptr, size_t size) {
+  size_t size_value = GetLongData(vm, size);
+  void* data = AllocateHeap(vm, size_value);
+  WriteData(vm->memory, ptr, &data, sizeof(data));
   return 0;
 }
-int FREE(size_t ptr) {
+int FREE(struct VM* vm, size_t ptr) {
   void* free_ptr;
-  switch (GetType(memory, ptr)) {
+  switch (GetType(vm->memory, ptr)) {
     /*case 0x01:
-      free_ptr = (void*)(*(int8_t*)((uintptr_t)memory->data + ptr));
+      free_ptr = (void*)(*(int8_t*)((uintptr_t)vm->memory->data + ptr));
       break;
     case 0x02:
-      free_ptr = (void*)(*(int*)((uintptr_t)memory->data + ptr));
+      free_ptr = (void*)(*(int*)((uintptr_t)vm->memory->data + ptr));
       break;
     case 0x03:
-      free_ptr = (void*)(*(long*)((uintptr_t)memory->data + ptr));
+      free_ptr = (void*)(*(long*)((uintptr_t)vm->memory->data + ptr));
       break;*/
     default:
-      free_ptr = *(void**)((uintptr_t)memory->data + ptr);
+      free_ptr = *(void**)((uintptr_t)vm->memory->data + ptr);
       break;
   }
-  free(free_ptr);
+  FreeHeap(free_ptr);
   return 0;
 }
-int PTR(size_t index, size_t ptr) {
-  SetPtrData(ptr, (void*)((uintptr_t)memory->data + index));
+int PTR(struct VM* vm, size_t index, size_t ptr) {
+  SetPtrData(vm, ptr, (void*)((uintptr_t)vm->memory->data + index));
   return 0;
 }
-int ADD(size_t result, size_t operand1, size_t operand2) {
-  if (GetType(memory, result) == 0x05 || GetType(memory, operand1) == 0x05 ||
-      GetType(memory, operand2) == 0x05) {
-    switch (GetType(memory, result)) {
-      case 0x01:
-        SetByteData(result, GetByteData(operand1) + GetByteData(operand2));
-        break;
-      case 0x02:
-        SetIntData(result, GetIntData(operand1) + GetIntData(operand2));
-        break;
-      case 0x03:
-        SetLongData(result, GetLongData(operand1) + GetLongData(operand2));
-        break;
-      case 0x04:
-        SetFloatData(result, GetFloatData(operand1) + GetFloatData(operand2));
-        break;
-      case 0x05:
-        SetDoubleData(result,
-                      GetDoubleData(operand1) + GetDoubleData(operand2));
-        break;
-      default:
-        break;
-    }
-  } else if (GetType(memory, result) == 0x04 ||
-             GetType(memory, operand1) == 0x04 ||
-             GetType(memory, operand2) == 0x04) {
-    switch (GetType(memory, result)) {
-      case 0x01:
-        SetByteData(result, GetFloatData(operand1) + GetFloatData(operand2));
-        break;
-      case 0x02:
-        SetIntData(result, GetFloatData(operand1) + GetFloatData(operand2));
-        break;
-      case 0x03:
-        SetLongData(result, GetFloatData(operand1) + GetFloatData(operand2));
-        break;
+
+int CountTrailingZeros(uint64_t bits);
+
+// Divides like C, truncating toward zero. Divisors that are powers of two,
+// often bucket counts and strides, are handled with a shift instead of a
+// hardware divide.
+int64_t DivideInteger(int64_t numerator, int64_t divisor) {
+  uint64_t magnitude =
+      divisor < 0 ? 0 - (uint64_t)divisor : (uint64_t)divisor;
+  if (magnitude == 0 || (magnitude & (magnitude - 1)) != 0) {
+    return numerator / divisor;
+  }
+  // Negative numerators are biased by magnitude - 1 so that the arithmetic
+  // shift rounds toward zero.
+  uint64_t bias = (uint64_t)(numerator >> 63) & (magnitude - 1);
+  int64_t quotient = (int64_t)((uint64_t)numerator + bias) >>
+                     CountTrailingZeros(magnitude);
+  return divisor < 0 ? (int64_t)(0 - (uint64_t)quotient) : quotient;
+}
+
+// Whether the result and operands are all bytes, all ints or all longs, which
+// DIV and REM divide in 64 bits ahead of their type ladders. Mixed types keep
+// the conversions of the ladders.
+bool HasSameIntegerType(struct VM* vm, size_t result, size_t operand1,
+                        size_t operand2) {
+  uint8_t type = GetType(vm->memory, result);
+  return type >= 0x01 && type <= 0x03 &&
+         GetType(vm->memory, operand1) == type &&
+         GetType(vm->memory, operand2) == type;
+}
+
+bool HasExtendedType(struct VM* vm, size_t result, size_t operand1,
+                     size_t operand2) {
+  return GetType(vm->memory, result) >= 0x06 ||
+         GetType(vm->memory, operand1) >= 0x06 ||
+         GetType(vm->memory, operand2) >= 0x06;
+}
+
+int GetIntegerWidth(uint8_t type) {
+  switch (type) {
+    case 0x01:
+    case 0x07:
+      return 8;
+    case 0x06:
+    case 0x08:
+      return 16;
+    case 0x02:
+    case 0x09:
+      return 32;
+    case 0x03:
+    case 0x0A:
+      return 64;
+    default:
+      return 0;
+  }
+}
+
+// Type in which an operation involving a short or unsigned slot is computed,
+// following C's usual arithmetic conversions: double or float if any slot has
+// that type, otherwise the widest integer type promoted to at least int,
+// unsigned if an unsigned slot has that width. Returns the width for integers,
+// -1 for float and -2 for double. Integer-only operations ignore
+// floating-point slots.
+int GetCommonWidth(struct VM* vm, size_t result, size_t operand1,
+                   size_t operand2, bool integer_only, bool* is_unsigned) {
+  uint8_t types[3] = {GetType(vm->memory, result),
+                      GetType(vm->memory, operand1),
+                      GetType(vm->memory, operand2)};
+  int width = 0;
+  *is_unsigned = false;
+  for (int i = 0; i < 3; i++) {
+    if (!integer_only && types[i] == 0x05) {
+      return -2;
+    }
+    if (!integer_only && types[i] == 0x04) {
+      width = -1;
+    }
+  }
+  if (width == -1) {
+    return -1;
+  }
+  for (int i = 0; i < 3; i++) {
+    int type_width = GetIntegerWidth(types[i]);
+    if (type_width > width) {
+      width = type_width;
+      *is_unsigned = IsUnsignedType(types[i]);
+    } else if (type_width == width && IsUnsignedType(types[i])) {
+      *is_unsigned = true;
+    }
+  }
+  if (width < 32) {
+    width = 32;
+    *is_unsigned = false;
+  }
+  return width;
+}
+
+// Reduces |value| to |width| bits, sign-extending it unless |is_unsigned|.
+uint64_t NormalizeInteger(uint64_t value, int width, bool is_unsigned) {
+  if (width == 64) {
+    return value;
+  }
+  uint64_t mask = ((uint64_t)1 << width) - 1;
+  value &= mask;
+  if (!is_unsigned && (value >> (width - 1)) != 0) {
+    value |= ~mask;
+  }
+  return value;
+}
+
+uint64_t GetIntegerData(struct VM* vm, size_t index) {
+  return GetType(vm->memory, index) >= 0x06
+             ? GetExtendedInteger(vm, index)
+             : (uint64_t)(int64_t)GetLongData(vm, index);
+}
+
+void SetIntegerData(struct VM* vm, size_t index, uint64_t value,
+                    bool is_unsigned) {
+  switch (GetType(vm->memory, index)) {
+    case 0x04:
+    case 0x05:
+      SetDoubleData(vm, index,
+                    is_unsigned ? (double)value : (double)(int64_t)value);
+      break;
+    case 0x06:
+    case 0x07:
+    case 0x08:
+    case 0x09:
+    case 0x0A:
+      SetExtendedInteger(vm, index, value);
+      break;
+    default:
+      SetLongData(vm, index, (long)(int64_t)value);
+      break;
+  }
+}
+
+// Computes arithmetic opcodes 0x06 to 0x12 when a short or unsigned slot is
+// involved, with the usual C conversions and wraparound. The original types
+// keep their dedicated paths in the opcode functions.
+int ExtendedArithmetic(struct VM* vm, uint8_t operation, size_t result,
+                       size_t operand1, size_t operand2) {
+  bool integer_only = operation == 0x0A || (operation >= 0x0C &&
+                                            operation != 0x0F);
+  bool is_unsigned;
+  int width = GetCommonWidth(vm, result, operand1, operand2, integer_only,
+                             &is_unsigned);
+  if (width < 0) {
+    double a = GetDoubleData(vm, operand1), b = GetDoubleData(vm, operand2);
+    double value = 0;
+    switch (operation) {
+      case 0x06:
+        value = a + b;
+        break;
+      case 0x07:
+        value = a - b;
+        break;
+      case 0x08:
+        value = a * b;
+        break;
+      case 0x09:
+        value = a / b;
+        break;
+      case 0x0B:
+        value = -a;
+        break;
+      default:
+        break;
+    }
+    if (width == -1) {
+      SetFloatData(vm, result, (float)value);
+    } else {
+      SetDoubleData(vm, result, value);
+    }
+    return 0;
+  }
+
+  uint64_t a = NormalizeInteger(GetIntegerData(vm, operand1), width,
+                                is_unsigned);
+  uint64_t b = NormalizeInteger(GetIntegerData(vm, operand2), width,
+                                is_unsigned);
+  uint64_t value = 0;
+  switch (operation) {
+    case 0x06:
+      value = a + b;
+      break;
+    case 0x07:
+      value = a - b;
+      break;
+    case 0x08:
+      value = a * b;
+      break;
+    case 0x09:
+    case 0x0A:
+      if (!is_unsigned && b == UINT64_MAX) {
+        value = operation == 0x09 ? 0 - a : 0;
+      } else if (is_unsigned && width == 64) {
+        value = operation == 0x09 ? a / b : a % b;
+      } else {
+        value = (uint64_t)DivideInteger((int64_t)a, (int64_t)b);
+        value = operation == 0x09 ? value : a - value * b;
+      }
+      break;
+    case 0x0B:
+      value = 0 - a;
+      break;
+    case 0x0C:
+      value = a << (b & 63);
+      break;
+    case 0x0D:
+      value = NormalizeInteger(a, width, true) >> (b & 63);
+      break;
+    case 0x0E:
+      value = (uint64_t)((int64_t)NormalizeInteger(a, width, false) >>
+                         (b & 63));
+      break;
+    case 0x10:
+      value = a & b;
+      break;
+    case 0x11:
+      value = a | b;
+      break;
+    case 0x12:
+      value = a ^ b;
+      break;
+    default:
+      break;
+  }
+  SetIntegerData(vm, result, NormalizeInteger(value, width, is_unsigned),
+                 is_unsigned);
+  return 0;
+}
+
+// CMP counterpart of ExtendedArithmetic.
+int ExtendedCompare(struct VM* vm, size_t result, uint8_t code,
+                    size_t operand1, size_t operand2) {
+  bool is_unsigned;
+  int width =
+      GetCommonWidth(vm, operand1, operand1, operand2, false, &is_unsigned);
+  int order;
+  if (width < 0) {
+    double a = GetDoubleData(vm, operand1), b = GetDoubleData(vm, operand2);
+    if (a != a || b != b) {
+      SetIntegerData(vm, result, code == 0x01, false);
+      return 0;
+    }
+    order = a < b ? -1 : a > b;
+  } else {
+    uint64_t a = NormalizeInteger(GetIntegerData(vm, operand1), width,
+                                  is_unsigned);
+    uint64_t b = NormalizeInteger(GetIntegerData(vm, operand2), width,
+                                  is_unsigned);
+    if (is_unsigned) {
+      order = a < b ? -1 : a > b;
+    } else {
+      order = (int64_t)a < (int64_t)b ? -1 : (int64_t)a > (int64_t)b;
+    }
+  }
+  bool value = false;
+  switch (code) {
+    case 0x00:
+      value = order == 0;
+      break;
+    case 0x01:
+      value = order != 0;
+      break;
+    case 0x02:
+      value = order < 0;
+      break;
+    case 0x03:
+      value = order <= 0;
+      break;
+    case 0x04:
+      value = order > 0;
+      break;
+    case 0x05:
+      value = order >= 0;
+      break;
+    default:
+      return 0;
+  }
+  SetIntegerData(vm, result, value, false);
+  return 0;
+}
+
+int ADD(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  if (HasExtendedType(vm, result, operand1, operand2)) {
+    return ExtendedArithmetic(vm, 0x06, result, operand1, operand2);
+  }
+  if (GetType(vm->memory, result) == 0x05 ||
+      GetType(vm->memory, operand1) == 0x05 ||
+      GetType(vm->memory, operand2) == 0x05) {
+    switch (GetType(vm->memory, result)) {
+      case 0x01:
+        SetByteData(vm, result,
+                    GetByteData(vm, operand1) + GetByteData(vm, operand2));
+        break;
+      case 0x02:
+        SetIntData(vm, result,
+                   GetIntData(vm, operand1) + GetIntData(vm, operand2));
+        break;
+      case 0x03:
+        SetLongData(vm, result,
+                    GetLongData(vm, operand1) + GetLongData(vm, operand2));
+        break;
+      case 0x04:
+        SetFloatData(vm, result,
+                     GetFloatData(vm, operand1) + GetFloatData(vm, operand2));
+        break;
+      case 0x05:
+        SetDoubleData(
+            vm, result,
+            GetDoubleData(vm, operand1) + GetDoubleData(vm, operand2));
+        break;
+      default:
+        break;
+    }
+  } else if (GetType(vm->memory, result) == 0x04 ||
+             GetType(vm->memory, operand1) == 0x04 ||
+             GetType(vm->memory, operand2) == 0x04) {
+    switch (GetType(vm->memory, result)) {
+      case 0x01:
+        SetByteData(vm, result,
+                    GetFloatData(vm, operand1) + GetFloatData(vm, operand2));
+        break;
+      case 0x02:
+        SetIntData(vm, result,
+                   GetFloatData(vm, operand1) + GetFloatData(vm, operand2));
+        break;
+      case 0x03:
+        SetLongData(vm, result,
+                    GetFloatData(vm, operand1) + GetFloatData(vm, operand2));
+        break;
       case 0x04:
-        SetFloatData(result, GetFloatData(operand1) + GetFloatData(operand2));
+        SetFloatData(vm, result,
+                     GetFloatData(vm, operand1) + GetFloatData(vm, operand2));
         break;
       /*case 0x05:
-        SetDoubleData(result,
-            GetFloatData(operand1) + GetFloatData(operand2));
+        SetDoubleData(vm, result,
+            GetFloatData(vm, operand1) + GetFloatData(vm, operand2));
         break;*/
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x03 ||
-             GetType(memory, operand1) == 0x03 ||
-             GetType(memory, operand2) == 0x03) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x03 ||
+             GetType(vm->memory, operand1) == 0x03 ||
+             GetType(vm->memory, operand2) == 0x03) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetLongData(operand1) + GetLongData(operand2));
+        SetByteData(vm, result,
+                    GetLongData(vm, operand1) + GetLongData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetLongData(operand1) + GetLongData(operand2));
+        SetIntData(vm, result,
+                   GetLongData(vm, operand1) + GetLongData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetLongData(operand1) + GetLongData(operand2));
+        SetLongData(vm, result,
+                    GetLongData(vm, operand1) + GetLongData(vm, operand2));
         break;
       /*case 0x04:
-        SetFloatData(result,
-            GetLongData(operand1) + GetLongData(operand2));
+        SetFloatData(vm, result,
+            GetLongData(vm, operand1) + GetLongData(vm, operand2));
         break;
       case 0x05:
-        SetDoubleData(result,
-            GetLongData(operand1) + GetLongData(operand2));
+        SetDoubleData(vm, result,
+            GetLongData(vm, operand1) + GetLongData(vm, operand2));
         break;*/
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x02 ||
-             GetType(memory, operand1) == 0x02 ||
-             GetType(memory, operand2) == 0x02) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x02 ||
+             GetType(vm->memory, operand1) == 0x02 ||
+             GetType(vm->memory, operand2) == 0x02) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetIntData(operand1) + GetIntData(operand2));
+        SetByteData(vm, result,
+                    GetIntData(vm, operand1) + GetIntData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetIntData(operand1) + GetIntData(operand2));
+        SetIntData(vm, result,
+                   GetIntData(vm, operand1) + GetIntData(vm, operand2));
         break;
       /*case 0x03:
-        SetLongData(result,
-            GetIntData(operand1) + GetIntData(operand2));
+        SetLongData(vm, result,
+            GetIntData(vm, operand1) + GetIntData(vm, operand2));
         break;
       case 0x04:
-        SetFloatData(result,
-            GetIntData(operand1) + GetIntData(operand2));
+        SetFloatData(vm, result,
+            GetIntData(vm, operand1) + GetIntData(vm, operand2));
         break;
       case 0x05:
-        SetDoubleData(result,
-            GetIntData(operand1) + GetIntData(operand2));
+        SetDoubleData(vm, result,
+            GetIntData(vm, operand1) + GetIntData(vm, operand2));
         break;*/
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x01 ||
-             GetType(memory, operand1) == 0x01 ||
-             GetType(memory, operand2) == 0x01) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x01 ||
+             GetType(vm->memory, operand1) == 0x01 ||
+             GetType(vm->memory, operand2) == 0x01) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetByteData(operand1) + GetByteData(operand2));
+        SetByteData(vm, result,
+                    GetByteData(vm, operand1) + GetByteData(vm, operand2));
         break;
       /*case 0x02:
-        SetIntData(result,
-            GetByteData(operand1) + GetByteData(operand2));
+        SetIntData(vm, result,
+            GetByteData(vm, operand1) + GetByteData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result,
-            GetByteData(operand1) + GetByteData(operand2));
+        SetLongData(vm, result,
+            GetByteData(vm, operand1) + GetByteData(vm, operand2));
         break;
       case 0x04:
-        SetFloatData(result,
-            GetByteData(operand1) + GetByteData(operand2));
+        SetFloatData(vm, result,
+            GetByteData(vm, operand1) + GetByteData(vm, operand2));
         break;
       case 0x05:
-        SetDoubleData(result,
-            GetByteData(operand1) + GetByteData(operand2));
+        SetDoubleData(vm, result,
+            GetByteData(vm, operand1) + GetByteData(vm, operand2));
         break;*/
       default:
         break;
@@ -775,83 +2105,102 @@ int ADD(size_t result, size_t operand1, size_t operand2) {
   }
   return 0;
 }
-int SUB(size_t result, size_t operand1, size_t operand2) {
-  if (GetType(memory, result) == 0x05 || GetType(memory, operand1) == 0x05 ||
-      GetType(memory, operand2) == 0x05) {
-    switch (GetType(memory, result)) {
+int SUB(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  if (HasExtendedType(vm, result, operand1, operand2)) {
+    return ExtendedArithmetic(vm, 0x07, result, operand1, operand2);
+  }
+  if (GetType(vm->memory, result) == 0x05 ||
+      GetType(vm->memory, operand1) == 0x05 ||
+      GetType(vm->memory, operand2) == 0x05) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetDoubleData(operand1) - GetDoubleData(operand2));
+        SetByteData(vm, result,
+                    GetDoubleData(vm, operand1) - GetDoubleData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetDoubleData(operand1) - GetDoubleData(operand2));
+        SetIntData(vm, result,
+                   GetDoubleData(vm, operand1) - GetDoubleData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetDoubleData(operand1) - GetDoubleData(operand2));
+        SetLongData(vm, result,
+                    GetDoubleData(vm, operand1) - GetDoubleData(vm, operand2));
         break;
       case 0x04:
-        SetFloatData(result, GetDoubleData(operand1) - GetDoubleData(operand2));
+        SetFloatData(vm, result,
+                     GetDoubleData(vm, operand1) - GetDoubleData(vm, operand2));
         break;
       case 0x05:
-        SetDoubleData(result,
-                      GetDoubleData(operand1) - GetDoubleData(operand2));
+        SetDoubleData(
+            vm, result,
+            GetDoubleData(vm, operand1) - GetDoubleData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x04 ||
-             GetType(memory, operand1) == 0x04 ||
-             GetType(memory, operand2) == 0x04) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x04 ||
+             GetType(vm->memory, operand1) == 0x04 ||
+             GetType(vm->memory, operand2) == 0x04) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetFloatData(operand1) - GetFloatData(operand2));
+        SetByteData(vm, result,
+                    GetFloatData(vm, operand1) - GetFloatData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetFloatData(operand1) - GetFloatData(operand2));
+        SetIntData(vm, result,
+                   GetFloatData(vm, operand1) - GetFloatData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetFloatData(operand1) - GetFloatData(operand2));
+        SetLongData(vm, result,
+                    GetFloatData(vm, operand1) - GetFloatData(vm, operand2));
         break;
       case 0x04:
-        SetFloatData(result, GetFloatData(operand1) - GetFloatData(operand2));
+        SetFloatData(vm, result,
+                     GetFloatData(vm, operand1) - GetFloatData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x03 ||
-             GetType(memory, operand1) == 0x03 ||
-             GetType(memory, operand2) == 0x03) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x03 ||
+             GetType(vm->memory, operand1) == 0x03 ||
+             GetType(vm->memory, operand2) == 0x03) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetLongData(operand1) - GetLongData(operand2));
+        SetByteData(vm, result,
+                    GetLongData(vm, operand1) - GetLongData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetLongData(operand1) - GetLongData(operand2));
+        SetIntData(vm, result,
+                   GetLongData(vm, operand1) - GetLongData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetLongData(operand1) - GetLongData(operand2));
+        SetLongData(vm, result,
+                    GetLongData(vm, operand1) - GetLongData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x02 ||
-             GetType(memory, operand1) == 0x02 ||
-             GetType(memory, operand2) == 0x02) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x02 ||
+             GetType(vm->memory, operand1) == 0x02 ||
+             GetType(vm->memory, operand2) == 0x02) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetIntData(operand1) - GetIntData(operand2));
+        SetByteData(vm, result,
+                    GetIntData(vm, operand1) - GetIntData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetIntData(operand1) - GetIntData(operand2));
+        SetIntData(vm, result,
+                   GetIntData(vm, operand1) - GetIntData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x01 ||
-             GetType(memory, operand1) == 0x01 ||
-             GetType(memory, operand2) == 0x01) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x01 ||
+             GetType(vm->memory, operand1) == 0x01 ||
+             GetType(vm->memory, operand2) == 0x01) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetByteData(operand1) - GetByteData(operand2));
+        SetByteData(vm, result,
+                    GetByteData(vm, operand1) - GetByteData(vm, operand2));
         break;
       default:
         break;
@@ -860,83 +2209,102 @@ int SUB(size_t result, size_t operand1, size_t operand2) {
   }
   return 0;
 }
-int MUL(size_t result, size_t operand1, size_t operand2) {
-  if (GetType(memory, result) == 0x05 || GetType(memory, operand1) == 0x05 ||
-      GetType(memory, operand2) == 0x05) {
-    switch (GetType(memory, result)) {
+int MUL(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  if (HasExtendedType(vm, result, operand1, operand2)) {
+    return ExtendedArithmetic(vm, 0x08, result, operand1, operand2);
+  }
+  if (GetType(vm->memory, result) == 0x05 ||
+      GetType(vm->memory, operand1) == 0x05 ||
+      GetType(vm->memory, operand2) == 0x05) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetDoubleData(operand1) * GetDoubleData(operand2));
+        SetByteData(vm, result,
+                    GetDoubleData(vm, operand1) * GetDoubleData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetDoubleData(operand1) * GetDoubleData(operand2));
+        SetIntData(vm, result,
+                   GetDoubleData(vm, operand1) * GetDoubleData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetDoubleData(operand1) * GetDoubleData(operand2));
+        SetLongData(vm, result,
+                    GetDoubleData(vm, operand1) * GetDoubleData(vm, operand2));
         break;
       case 0x04:
-        SetFloatData(result, GetDoubleData(operand1) * GetDoubleData(operand2));
+        SetFloatData(vm, result,
+                     GetDoubleData(vm, operand1) * GetDoubleData(vm, operand2));
         break;
       case 0x05:
-        SetDoubleData(result,
-                      GetDoubleData(operand1) * GetDoubleData(operand2));
+        SetDoubleData(
+            vm, result,
+            GetDoubleData(vm, operand1) * GetDoubleData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x04 ||
-             GetType(memory, operand1) == 0x04 ||
-             GetType(memory, operand2) == 0x04) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x04 ||
+             GetType(vm->memory, operand1) == 0x04 ||
+             GetType(vm->memory, operand2) == 0x04) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetFloatData(operand1) * GetFloatData(operand2));
+        SetByteData(vm, result,
+                    GetFloatData(vm, operand1) * GetFloatData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetFloatData(operand1) * GetFloatData(operand2));
+        SetIntData(vm, result,
+                   GetFloatData(vm, operand1) * GetFloatData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetFloatData(operand1) * GetFloatData(operand2));
+        SetLongData(vm, result,
+                    GetFloatData(vm, operand1) * GetFloatData(vm, operand2));
         break;
       case 0x04:
-        SetFloatData(result, GetFloatData(operand1) * GetFloatData(operand2));
+        SetFloatData(vm, result,
+                     GetFloatData(vm, operand1) * GetFloatData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x03 ||
-             GetType(memory, operand1) == 0x03 ||
-             GetType(memory, operand2) == 0x03) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x03 ||
+             GetType(vm->memory, operand1) == 0x03 ||
+             GetType(vm->memory, operand2) == 0x03) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetLongData(operand1) * GetLongData(operand2));
+        SetByteData(vm, result,
+                    GetLongData(vm, operand1) * GetLongData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetLongData(operand1) * GetLongData(operand2));
+        SetIntData(vm, result,
+                   GetLongData(vm, operand1) * GetLongData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetLongData(operand1) * GetLongData(operand2));
+        SetLongData(vm, result,
+                    GetLongData(vm, operand1) * GetLongData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x02 ||
-             GetType(memory, operand1) == 0x02 ||
-             GetType(memory, operand2) == 0x02) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x02 ||
+             GetType(vm->memory, operand1) == 0x02 ||
+             GetType(vm->memory, operand2) == 0x02) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetIntData(operand1) * GetIntData(operand2));
+        SetByteData(vm, result,
+                    GetIntData(vm, operand1) * GetIntData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetIntData(operand1) * GetIntData(operand2));
+        SetIntData(vm, result,
+                   GetIntData(vm, operand1) * GetIntData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x01 ||
-             GetType(memory, operand1) == 0x01 ||
-             GetType(memory, operand2) == 0x01) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x01 ||
+             GetType(vm->memory, operand1) == 0x01 ||
+             GetType(vm->memory, operand2) == 0x01) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetByteData(operand1) * GetByteData(operand2));
+        SetByteData(vm, result,
+                    GetByteData(vm, operand1) * GetByteData(vm, operand2));
         break;
       default:
         break;
@@ -945,83 +2313,108 @@ int MUL(size_t result, size_t operand1, size_t operand2) {
   }
   return 0;
 }
-int DIV(size_t result, size_t operand1, size_t operand2) {
-  if (GetType(memory, result) == 0x05 || GetType(memory, operand1) == 0x05 ||
-      GetType(memory, operand2) == 0x05) {
-    switch (GetType(memory, result)) {
+int DIV(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  if (HasSameIntegerType(vm, result, operand1, operand2)) {
+    SetLongData(vm, result,
+                DivideInteger(GetLongData(vm, operand1),
+                              GetLongData(vm, operand2)));
+    return 0;
+  }
+  if (HasExtendedType(vm, result, operand1, operand2)) {
+    return ExtendedArithmetic(vm, 0x09, result, operand1, operand2);
+  }
+  if (GetType(vm->memory, result) == 0x05 ||
+      GetType(vm->memory, operand1) == 0x05 ||
+      GetType(vm->memory, operand2) == 0x05) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetDoubleData(operand1) / GetDoubleData(operand2));
+        SetByteData(vm, result,
+                    GetDoubleData(vm, operand1) / GetDoubleData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetDoubleData(operand1) / GetDoubleData(operand2));
+        SetIntData(vm, result,
+                   GetDoubleData(vm, operand1) / GetDoubleData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetDoubleData(operand1) / GetDoubleData(operand2));
+        SetLongData(vm, result,
+                    GetDoubleData(vm, operand1) / GetDoubleData(vm, operand2));
         break;
       case 0x04:
-        SetFloatData(result, GetDoubleData(operand1) / GetDoubleData(operand2));
+        SetFloatData(vm, result,
+                     GetDoubleData(vm, operand1) / GetDoubleData(vm, operand2));
         break;
       case 0x05:
-        SetDoubleData(result,
-                      GetDoubleData(operand1) / GetDoubleData(operand2));
+        SetDoubleData(
+            vm, result,
+            GetDoubleData(vm, operand1) / GetDoubleData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x04 ||
-             GetType(memory, operand1) == 0x04 ||
-             GetType(memory, operand2) == 0x04) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x04 ||
+             GetType(vm->memory, operand1) == 0x04 ||
+             GetType(vm->memory, operand2) == 0x04) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetFloatData(operand1) / GetFloatData(operand2));
+        SetByteData(vm, result,
+                    GetFloatData(vm, operand1) / GetFloatData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetFloatData(operand1) / GetFloatData(operand2));
+        SetIntData(vm, result,
+                   GetFloatData(vm, operand1) / GetFloatData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetFloatData(operand1) / GetFloatData(operand2));
+        SetLongData(vm, result,
+                    GetFloatData(vm, operand1) / GetFloatData(vm, operand2));
         break;
       case 0x04:
-        SetFloatData(result, GetFloatData(operand1) / GetFloatData(operand2));
+        SetFloatData(vm, result,
+                     GetFloatData(vm, operand1) / GetFloatData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x03 ||
-             GetType(memory, operand1) == 0x03 ||
-             GetType(memory, operand2) == 0x03) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x03 ||
+             GetType(vm->memory, operand1) == 0x03 ||
+             GetType(vm->memory, operand2) == 0x03) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetLongData(operand1) / GetLongData(operand2));
+        SetByteData(vm, result,
+                    GetLongData(vm, operand1) / GetLongData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetLongData(operand1) / GetLongData(operand2));
+        SetIntData(vm, result,
+                   GetLongData(vm, operand1) / GetLongData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetLongData(operand1) / GetLongData(operand2));
+        SetLongData(vm, result,
+                    GetLongData(vm, operand1) / GetLongData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x02 ||
-             GetType(memory, operand1) == 0x02 ||
-             GetType(memory, operand2) == 0x02) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x02 ||
+             GetType(vm->memory, operand1) == 0x02 ||
+             GetType(vm->memory, operand2) == 0x02) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetIntData(operand1) / GetIntData(operand2));
+        SetByteData(vm, result,
+                    GetIntData(vm, operand1) / GetIntData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetIntData(operand1) / GetIntData(operand2));
+        SetIntData(vm, result,
+                   GetIntData(vm, operand1) / GetIntData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x01 ||
-             GetType(memory, operand1) == 0x01 ||
-             GetType(memory, operand2) == 0x01) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x01 ||
+             GetType(vm->memory, operand1) == 0x01 ||
+             GetType(vm->memory, operand2) == 0x01) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetByteData(operand1) / GetByteData(operand2));
+        SetByteData(vm, result,
+                    GetByteData(vm, operand1) / GetByteData(vm, operand2));
         break;
       default:
         break;
@@ -1030,41 +2423,59 @@ int DIV(size_t result, size_t operand1, size_t operand2) {
   }
   return 0;
 }
-int REM(size_t result, size_t operand1, size_t operand2) {
-  if (GetType(memory, result) == 0x03 || GetType(memory, operand1) == 0x03 ||
-      GetType(memory, operand2) == 0x03) {
-    switch (GetType(memory, result)) {
+int REM(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  if (HasSameIntegerType(vm, result, operand1, operand2)) {
+    int64_t numerator = GetLongData(vm, operand1);
+    int64_t divisor = GetLongData(vm, operand2);
+    int64_t quotient = DivideInteger(numerator, divisor);
+    SetLongData(vm, result,
+                (long)((uint64_t)numerator - (uint64_t)quotient * divisor));
+    return 0;
+  }
+  if (HasExtendedType(vm, result, operand1, operand2)) {
+    return ExtendedArithmetic(vm, 0x0A, result, operand1, operand2);
+  }
+  if (GetType(vm->memory, result) == 0x03 ||
+      GetType(vm->memory, operand1) == 0x03 ||
+      GetType(vm->memory, operand2) == 0x03) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetLongData(operand1) % GetLongData(operand2));
+        SetByteData(vm, result,
+                    GetLongData(vm, operand1) % GetLongData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetLongData(operand1) % GetLongData(operand2));
+        SetIntData(vm, result,
+                   GetLongData(vm, operand1) % GetLongData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetLongData(operand1) % GetLongData(operand2));
+        SetLongData(vm, result,
+                    GetLongData(vm, operand1) % GetLongData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x02 ||
-             GetType(memory, operand1) == 0x02 ||
-             GetType(memory, operand2) == 0x02) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x02 ||
+             GetType(vm->memory, operand1) == 0x02 ||
+             GetType(vm->memory, operand2) == 0x02) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetIntData(operand1) % GetIntData(operand2));
+        SetByteData(vm, result,
+                    GetIntData(vm, operand1) % GetIntData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetIntData(operand1) % GetIntData(operand2));
+        SetIntData(vm, result,
+                   GetIntData(vm, operand1) % GetIntData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x01 ||
-             GetType(memory, operand1) == 0x01 ||
-             GetType(memory, operand2) == 0x01) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x01 ||
+             GetType(vm->memory, operand1) == 0x01 ||
+             GetType(vm->memory, operand2) == 0x01) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetByteData(operand1) % GetByteData(operand2));
+        SetByteData(vm, result,
+                    GetByteData(vm, operand1) % GetByteData(vm, operand2));
         break;
       default:
         break;
@@ -1073,77 +2484,81 @@ int REM(size_t result, size_t operand1, size_t operand2) {
   }
   return 0;
 }
-int NEG(size_t result, size_t operand1) {
-  if (GetType(memory, result) == 0x05 || GetType(memory, operand1) == 0x05) {
-    switch (GetType(memory, result)) {
+int NEG(struct VM* vm, size_t result, size_t operand1) {
+  if (HasExtendedType(vm, result, operand1, operand1)) {
+    return ExtendedArithmetic(vm, 0x0B, result, operand1, operand1);
+  }
+  if (GetType(vm->memory, result) == 0x05 ||
+      GetType(vm->memory, operand1) == 0x05) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, -GetDoubleData(operand1));
+        SetByteData(vm, result, -GetDoubleData(vm, operand1));
         break;
       case 0x02:
-        SetIntData(result, -GetDoubleData(operand1));
+        SetIntData(vm, result, -GetDoubleData(vm, operand1));
         break;
       case 0x03:
-        SetLongData(result, -GetDoubleData(operand1));
+        SetLongData(vm, result, -GetDoubleData(vm, operand1));
         break;
       case 0x04:
-        SetFloatData(result, -GetDoubleData(operand1));
+        SetFloatData(vm, result, -GetDoubleData(vm, operand1));
         break;
       case 0x05:
-        SetDoubleData(result, -GetDoubleData(operand1));
+        SetDoubleData(vm, result, -GetDoubleData(vm, operand1));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x04 ||
-             GetType(memory, operand1) == 0x04) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x04 ||
+             GetType(vm->memory, operand1) == 0x04) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, -GetFloatData(operand1));
+        SetByteData(vm, result, -GetFloatData(vm, operand1));
         break;
       case 0x02:
-        SetIntData(result, -GetFloatData(operand1));
+        SetIntData(vm, result, -GetFloatData(vm, operand1));
         break;
       case 0x03:
-        SetLongData(result, -GetFloatData(operand1));
+        SetLongData(vm, result, -GetFloatData(vm, operand1));
         break;
       case 0x04:
-        SetFloatData(result, -GetFloatData(operand1));
+        SetFloatData(vm, result, -GetFloatData(vm, operand1));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x03 ||
-             GetType(memory, operand1) == 0x03) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x03 ||
+             GetType(vm->memory, operand1) == 0x03) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, -GetLongData(operand1));
+        SetByteData(vm, result, -GetLongData(vm, operand1));
         break;
       case 0x02:
-        SetIntData(result, -GetLongData(operand1));
+        SetIntData(vm, result, -GetLongData(vm, operand1));
         break;
       case 0x03:
-        SetLongData(result, -GetLongData(operand1));
+        SetLongData(vm, result, -GetLongData(vm, operand1));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x02 ||
-             GetType(memory, operand1) == 0x02) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x02 ||
+             GetType(vm->memory, operand1) == 0x02) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, -GetIntData(operand1));
+        SetByteData(vm, result, -GetIntData(vm, operand1));
         break;
       case 0x02:
-        SetIntData(result, -GetIntData(operand1));
+        SetIntData(vm, result, -GetIntData(vm, operand1));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x01 ||
-             GetType(memory, operand1) == 0x01) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x01 ||
+             GetType(vm->memory, operand1) == 0x01) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, -GetByteData(operand1));
+        SetByteData(vm, result, -GetByteData(vm, operand1));
         break;
       default:
         break;
@@ -1152,41 +2567,51 @@ int NEG(size_t result, size_t operand1) {
   }
   return 0;
 }
-int SHL(size_t result, size_t operand1, size_t operand2) {
-  if (GetType(memory, result) == 0x03 || GetType(memory, operand1) == 0x03 ||
-      GetType(memory, operand2) == 0x03) {
-    switch (GetType(memory, result)) {
+int SHL(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  if (HasExtendedType(vm, result, operand1, operand2)) {
+    return ExtendedArithmetic(vm, 0x0C, result, operand1, operand2);
+  }
+  if (GetType(vm->memory, result) == 0x03 ||
+      GetType(vm->memory, operand1) == 0x03 ||
+      GetType(vm->memory, operand2) == 0x03) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetLongData(operand1) << GetLongData(operand2));
+        SetByteData(vm, result,
+                    GetLongData(vm, operand1) << GetLongData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetLongData(operand1) << GetLongData(operand2));
+        SetIntData(vm, result,
+                   GetLongData(vm, operand1) << GetLongData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetLongData(operand1) << GetLongData(operand2));
+        SetLongData(vm, result,
+                    GetLongData(vm, operand1) << GetLongData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x02 ||
-             GetType(memory, operand1) == 0x02 ||
-             GetType(memory, operand2) == 0x02) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x02 ||
+             GetType(vm->memory, operand1) == 0x02 ||
+             GetType(vm->memory, operand2) == 0x02) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetIntData(operand1) << GetIntData(operand2));
+        SetByteData(vm, result,
+                    GetIntData(vm, operand1) << GetIntData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetIntData(operand1) << GetIntData(operand2));
+        SetIntData(vm, result,
+                   GetIntData(vm, operand1) << GetIntData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x01 ||
-             GetType(memory, operand1) == 0x01 ||
-             GetType(memory, operand2) == 0x01) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x01 ||
+             GetType(vm->memory, operand1) == 0x01 ||
+             GetType(vm->memory, operand2) == 0x01) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetByteData(operand1) << GetByteData(operand2));
+        SetByteData(vm, result,
+                    GetByteData(vm, operand1) << GetByteData(vm, operand2));
         break;
       default:
         break;
@@ -1195,41 +2620,51 @@ int SHL(size_t result, size_t operand1, size_t operand2) {
   }
   return 0;
 }
-int SHR(size_t result, size_t operand1, size_t operand2) {
-  if (GetType(memory, result) == 0x03 || GetType(memory, operand1) == 0x03 ||
-      GetType(memory, operand2) == 0x03) {
-    switch (GetType(memory, result)) {
+int SHR(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  if (HasExtendedType(vm, result, operand1, operand2)) {
+    return ExtendedArithmetic(vm, 0x0D, result, operand1, operand2);
+  }
+  if (GetType(vm->memory, result) == 0x03 ||
+      GetType(vm->memory, operand1) == 0x03 ||
+      GetType(vm->memory, operand2) == 0x03) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetLongData(operand1) >> GetLongData(operand2));
+        SetByteData(vm, result,
+                    GetLongData(vm, operand1) >> GetLongData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetLongData(operand1) >> GetLongData(operand2));
+        SetIntData(vm, result,
+                   GetLongData(vm, operand1) >> GetLongData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetLongData(operand1) >> GetLongData(operand2));
+        SetLongData(vm, result,
+                    GetLongData(vm, operand1) >> GetLongData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x02 ||
-             GetType(memory, operand1) == 0x02 ||
-             GetType(memory, operand2) == 0x02) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x02 ||
+             GetType(vm->memory, operand1) == 0x02 ||
+             GetType(vm->memory, operand2) == 0x02) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetIntData(operand1) >> GetIntData(operand2));
+        SetByteData(vm, result,
+                    GetIntData(vm, operand1) >> GetIntData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetIntData(operand1) >> GetIntData(operand2));
+        SetIntData(vm, result,
+                   GetIntData(vm, operand1) >> GetIntData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x01 ||
-             GetType(memory, operand1) == 0x01 ||
-             GetType(memory, operand2) == 0x01) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x01 ||
+             GetType(vm->memory, operand1) == 0x01 ||
+             GetType(vm->memory, operand2) == 0x01) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetByteData(operand1) >> GetByteData(operand2));
+        SetByteData(vm, result,
+                    GetByteData(vm, operand1) >> GetByteData(vm, operand2));
         break;
       default:
         break;
@@ -1238,41 +2673,51 @@ int SHR(size_t result, size_t operand1, size_t operand2) {
   }
   return 0;
 }
-int SAR(size_t result, size_t operand1, size_t operand2) {
-  if (GetType(memory, result) == 0x03 || GetType(memory, operand1) == 0x03 ||
-      GetType(memory, operand2) == 0x03) {
-    switch (GetType(memory, result)) {
+int SAR(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  if (HasExtendedType(vm, result, operand1, operand2)) {
+    return ExtendedArithmetic(vm, 0x0E, result, operand1, operand2);
+  }
+  if (GetType(vm->memory, result) == 0x03 ||
+      GetType(vm->memory, operand1) == 0x03 ||
+      GetType(vm->memory, operand2) == 0x03) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetLongData(operand1) >> GetLongData(operand2));
+        SetByteData(vm, result,
+                    GetLongData(vm, operand1) >> GetLongData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetLongData(operand1) >> GetLongData(operand2));
+        SetIntData(vm, result,
+                   GetLongData(vm, operand1) >> GetLongData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetLongData(operand1) >> GetLongData(operand2));
+        SetLongData(vm, result,
+                    GetLongData(vm, operand1) >> GetLongData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x02 ||
-             GetType(memory, operand1) == 0x02 ||
-             GetType(memory, operand2) == 0x02) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x02 ||
+             GetType(vm->memory, operand1) == 0x02 ||
+             GetType(vm->memory, operand2) == 0x02) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetIntData(operand1) >> GetIntData(operand2));
+        SetByteData(vm, result,
+                    GetIntData(vm, operand1) >> GetIntData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetIntData(operand1) >> GetIntData(operand2));
+        SetIntData(vm, result,
+                   GetIntData(vm, operand1) >> GetIntData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x01 ||
-             GetType(memory, operand1) == 0x01 ||
-             GetType(memory, operand2) == 0x01) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x01 ||
+             GetType(vm->memory, operand1) == 0x01 ||
+             GetType(vm->memory, operand2) == 0x01) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetByteData(operand1) >> GetByteData(operand2));
+        SetByteData(vm, result,
+                    GetByteData(vm, operand1) >> GetByteData(vm, operand2));
         break;
       default:
         break;
@@ -1281,49 +2726,59 @@ int SAR(size_t result, size_t operand1, size_t operand2) {
   }
   return 0;
 }
-void* IF(void* ptr, size_t condition, size_t true_branche,
+void* IF(struct VM* vm, void* ptr, size_t condition, size_t true_branche,
          size_t false_branche) {
-  if (GetByteData(condition) != 0) {
-    return (void*)((uintptr_t)ptr + GetLongData(true_branche));
+  if (GetByteData(vm, condition) != 0) {
+    return (void*)((uintptr_t)ptr + GetLongData(vm, true_branche));
   } else {
-    return (void*)((uintptr_t)ptr + GetLongData(false_branche));
+    return (void*)((uintptr_t)ptr + GetLongData(vm, false_branche));
   }
 }
-int AND(size_t result, size_t operand1, size_t operand2) {
-  if (GetType(memory, result) == 0x03 || GetType(memory, operand1) == 0x03 ||
-      GetType(memory, operand2) == 0x03) {
-    switch (GetType(memory, result)) {
+int AND(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  if (HasExtendedType(vm, result, operand1, operand2)) {
+    return ExtendedArithmetic(vm, 0x10, result, operand1, operand2);
+  }
+  if (GetType(vm->memory, result) == 0x03 ||
+      GetType(vm->memory, operand1) == 0x03 ||
+      GetType(vm->memory, operand2) == 0x03) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetLongData(operand1) & GetLongData(operand2));
+        SetByteData(vm, result,
+                    GetLongData(vm, operand1) & GetLongData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetLongData(operand1) & GetLongData(operand2));
+        SetIntData(vm, result,
+                   GetLongData(vm, operand1) & GetLongData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetLongData(operand1) & GetLongData(operand2));
+        SetLongData(vm, result,
+                    GetLongData(vm, operand1) & GetLongData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x02 ||
-             GetType(memory, operand1) == 0x02 ||
-             GetType(memory, operand2) == 0x02) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x02 ||
+             GetType(vm->memory, operand1) == 0x02 ||
+             GetType(vm->memory, operand2) == 0x02) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetIntData(operand1) & GetIntData(operand2));
+        SetByteData(vm, result,
+                    GetIntData(vm, operand1) & GetIntData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetIntData(operand1) & GetIntData(operand2));
+        SetIntData(vm, result,
+                   GetIntData(vm, operand1) & GetIntData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x01 ||
-             GetType(memory, operand1) == 0x01 ||
-             GetType(memory, operand2) == 0x01) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x01 ||
+             GetType(vm->memory, operand1) == 0x01 ||
+             GetType(vm->memory, operand2) == 0x01) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetByteData(operand1) & GetByteData(operand2));
+        SetByteData(vm, result,
+                    GetByteData(vm, operand1) & GetByteData(vm, operand2));
         break;
       default:
         break;
@@ -1332,41 +2787,51 @@ int AND(size_t result, size_t operand1, size_t operand2) {
   }
   return 0;
 }
-int OR(size_t result, size_t operand1, size_t operand2) {
-  if (GetType(memory, result) == 0x03 || GetType(memory, operand1) == 0x03 ||
-      GetType(memory, operand2) == 0x03) {
-    switch (GetType(memory, result)) {
+int OR(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  if (HasExtendedType(vm, result, operand1, operand2)) {
+    return ExtendedArithmetic(vm, 0x11, result, operand1, operand2);
+  }
+  if (GetType(vm->memory, result) == 0x03 ||
+      GetType(vm->memory, operand1) == 0x03 ||
+      GetType(vm->memory, operand2) == 0x03) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetLongData(operand1) | GetLongData(operand2));
+        SetByteData(vm, result,
+                    GetLongData(vm, operand1) | GetLongData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetLongData(operand1) | GetLongData(operand2));
+        SetIntData(vm, result,
+                   GetLongData(vm, operand1) | GetLongData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetLongData(operand1) | GetLongData(operand2));
+        SetLongData(vm, result,
+                    GetLongData(vm, operand1) | GetLongData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x02 ||
-             GetType(memory, operand1) == 0x02 ||
-             GetType(memory, operand2) == 0x02) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x02 ||
+             GetType(vm->memory, operand1) == 0x02 ||
+             GetType(vm->memory, operand2) == 0x02) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetIntData(operand1) | GetIntData(operand2));
+        SetByteData(vm, result,
+                    GetIntData(vm, operand1) | GetIntData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetIntData(operand1) | GetIntData(operand2));
+        SetIntData(vm, result,
+                   GetIntData(vm, operand1) | GetIntData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x01 ||
-             GetType(memory, operand1) == 0x01 ||
-             GetType(memory, operand2) == 0x01) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x01 ||
+             GetType(vm->memory, operand1) == 0x01 ||
+             GetType(vm->memory, operand2) == 0x01) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetByteData(operand1) | GetByteData(operand2));
+        SetByteData(vm, result,
+                    GetByteData(vm, operand1) | GetByteData(vm, operand2));
         break;
       default:
         break;
@@ -1375,41 +2840,51 @@ int OR(size_t result, size_t operand1, size_t operand2) {
   }
   return 0;
 }
-int XOR(size_t result, size_t operand1, size_t operand2) {
-  if (GetType(memory, result) == 0x03 || GetType(memory, operand1) == 0x03 ||
-      GetType(memory, operand2) == 0x03) {
-    switch (GetType(memory, result)) {
+int XOR(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  if (HasExtendedType(vm, result, operand1, operand2)) {
+    return ExtendedArithmetic(vm, 0x12, result, operand1, operand2);
+  }
+  if (GetType(vm->memory, result) == 0x03 ||
+      GetType(vm->memory, operand1) == 0x03 ||
+      GetType(vm->memory, operand2) == 0x03) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetLongData(operand1) ^ GetLongData(operand2));
+        SetByteData(vm, result,
+                    GetLongData(vm, operand1) ^ GetLongData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetLongData(operand1) ^ GetLongData(operand2));
+        SetIntData(vm, result,
+                   GetLongData(vm, operand1) ^ GetLongData(vm, operand2));
         break;
       case 0x03:
-        SetLongData(result, GetLongData(operand1) ^ GetLongData(operand2));
+        SetLongData(vm, result,
+                    GetLongData(vm, operand1) ^ GetLongData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x02 ||
-             GetType(memory, operand1) == 0x02 ||
-             GetType(memory, operand2) == 0x02) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x02 ||
+             GetType(vm->memory, operand1) == 0x02 ||
+             GetType(vm->memory, operand2) == 0x02) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetIntData(operand1) ^ GetIntData(operand2));
+        SetByteData(vm, result,
+                    GetIntData(vm, operand1) ^ GetIntData(vm, operand2));
         break;
       case 0x02:
-        SetIntData(result, GetIntData(operand1) ^ GetIntData(operand2));
+        SetIntData(vm, result,
+                   GetIntData(vm, operand1) ^ GetIntData(vm, operand2));
         break;
       default:
         break;
     }
-  } else if (GetType(memory, result) == 0x01 ||
-             GetType(memory, operand1) == 0x01 ||
-             GetType(memory, operand2) == 0x01) {
-    switch (GetType(memory, result)) {
+  } else if (GetType(vm->memory, result) == 0x01 ||
+             GetType(vm->memory, operand1) == 0x01 ||
+             GetType(vm->memory, operand2) == 0x01) {
+    switch (GetType(vm->memory, result)) {
       case 0x01:
-        SetByteData(result, GetByteData(operand1) ^ GetByteData(operand2));
+        SetByteData(vm, result,
+                    GetByteData(vm, operand1) ^ GetByteData(vm, operand2));
         break;
       default:
         break;
@@ -1418,94 +2893,114 @@ int XOR(size_t result, size_t operand1, size_t operand2) {
   }
   return 0;
 }
-int CMP(size_t result, size_t opcode, size_t operand1, size_t operand2) {
-  switch (GetByteData(opcode)) {
+int CMP(struct VM* vm, size_t result, size_t opcode, size_t operand1,
+        size_t operand2) {
+  if (HasExtendedType(vm, result, operand1, operand2)) {
+    return ExtendedCompare(vm, result, GetByteData(vm, opcode), operand1,
+                           operand2);
+  }
+  switch (GetByteData(vm, opcode)) {
     case 0x00:
-      if (GetType(memory, result) == 0x05 ||
-          GetType(memory, operand1) == 0x05 ||
-          GetType(memory, operand2) == 0x05) {
-        switch (GetType(memory, result)) {
+      if (GetType(vm->memory, result) == 0x05 ||
+          GetType(vm->memory, operand1) == 0x05 ||
+          GetType(vm->memory, operand2) == 0x05) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result,
-                        GetDoubleData(operand1) == GetDoubleData(operand2));
+            SetByteData(
+                vm, result,
+                GetDoubleData(vm, operand1) == GetDoubleData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result,
-                       GetDoubleData(operand1) == GetDoubleData(operand2));
+            SetIntData(
+                vm, result,
+                GetDoubleData(vm, operand1) == GetDoubleData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result,
-                        GetDoubleData(operand1) == GetDoubleData(operand2));
+            SetLongData(
+                vm, result,
+                GetDoubleData(vm, operand1) == GetDoubleData(vm, operand2));
             break;
           case 0x04:
-            SetFloatData(result,
-                         GetDoubleData(operand1) == GetDoubleData(operand2));
+            SetFloatData(
+                vm, result,
+                GetDoubleData(vm, operand1) == GetDoubleData(vm, operand2));
             break;
           case 0x05:
-            SetDoubleData(result,
-                          GetDoubleData(operand1) == GetDoubleData(operand2));
+            SetDoubleData(
+                vm, result,
+                GetDoubleData(vm, operand1) == GetDoubleData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x04 ||
-                 GetType(memory, operand1) == 0x04 ||
-                 GetType(memory, operand2) == 0x04) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x04 ||
+                 GetType(vm->memory, operand1) == 0x04 ||
+                 GetType(vm->memory, operand2) == 0x04) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result,
-                        GetFloatData(operand1) == GetFloatData(operand2));
+            SetByteData(
+                vm, result,
+                GetFloatData(vm, operand1) == GetFloatData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result,
-                       GetFloatData(operand1) == GetFloatData(operand2));
+            SetIntData(
+                vm, result,
+                GetFloatData(vm, operand1) == GetFloatData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result,
-                        GetFloatData(operand1) == GetFloatData(operand2));
+            SetLongData(
+                vm, result,
+                GetFloatData(vm, operand1) == GetFloatData(vm, operand2));
             break;
           case 0x04:
-            SetFloatData(result,
-                         GetFloatData(operand1) == GetFloatData(operand2));
+            SetFloatData(
+                vm, result,
+                GetFloatData(vm, operand1) == GetFloatData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x03 ||
-                 GetType(memory, operand1) == 0x03 ||
-                 GetType(memory, operand2) == 0x03) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x03 ||
+                 GetType(vm->memory, operand1) == 0x03 ||
+                 GetType(vm->memory, operand2) == 0x03) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetLongData(operand1) == GetLongData(operand2));
+            SetByteData(vm, result,
+                        GetLongData(vm, operand1) == GetLongData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetLongData(operand1) == GetLongData(operand2));
+            SetIntData(vm, result,
+                       GetLongData(vm, operand1) == GetLongData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result, GetLongData(operand1) == GetLongData(operand2));
+            SetLongData(vm, result,
+                        GetLongData(vm, operand1) == GetLongData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x02 ||
-                 GetType(memory, operand1) == 0x02 ||
-                 GetType(memory, operand2) == 0x02) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x02 ||
+                 GetType(vm->memory, operand1) == 0x02 ||
+                 GetType(vm->memory, operand2) == 0x02) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetIntData(operand1) == GetIntData(operand2));
+            SetByteData(vm, result,
+                        GetIntData(vm, operand1) == GetIntData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetIntData(operand1) == GetIntData(operand2));
+            SetIntData(vm, result,
+                       GetIntData(vm, operand1) == GetIntData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x01 ||
-                 GetType(memory, operand1) == 0x01 ||
-                 GetType(memory, operand2) == 0x01) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x01 ||
+                 GetType(vm->memory, operand1) == 0x01 ||
+                 GetType(vm->memory, operand2) == 0x01) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetByteData(operand1) == GetByteData(operand2));
+            SetByteData(vm, result,
+                        GetByteData(vm, operand1) == GetByteData(vm, operand2));
             break;
           default:
             break;
@@ -1514,91 +3009,106 @@ int CMP(size_t result, size_t opcode, size_t operand1, size_t operand2) {
       }
       break;
     case 0x01:
-      if (GetType(memory, result) == 0x05 ||
-          GetType(memory, operand1) == 0x05 ||
-          GetType(memory, operand2) == 0x05) {
-        switch (GetType(memory, result)) {
+      if (GetType(vm->memory, result) == 0x05 ||
+          GetType(vm->memory, operand1) == 0x05 ||
+          GetType(vm->memory, operand2) == 0x05) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result,
-                        GetDoubleData(operand1) != GetDoubleData(operand2));
+            SetByteData(
+                vm, result,
+                GetDoubleData(vm, operand1) != GetDoubleData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result,
-                       GetDoubleData(operand1) != GetDoubleData(operand2));
+            SetIntData(
+                vm, result,
+                GetDoubleData(vm, operand1) != GetDoubleData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result,
-                        GetDoubleData(operand1) != GetDoubleData(operand2));
+            SetLongData(
+                vm, result,
+                GetDoubleData(vm, operand1) != GetDoubleData(vm, operand2));
             break;
           case 0x04:
-            SetFloatData(result,
-                         GetDoubleData(operand1) != GetDoubleData(operand2));
+            SetFloatData(
+                vm, result,
+                GetDoubleData(vm, operand1) != GetDoubleData(vm, operand2));
             break;
           case 0x05:
-            SetDoubleData(result,
-                          GetDoubleData(operand1) != GetDoubleData(operand2));
+            SetDoubleData(
+                vm, result,
+                GetDoubleData(vm, operand1) != GetDoubleData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x04 ||
-                 GetType(memory, operand1) == 0x04 ||
-                 GetType(memory, operand2) == 0x04) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x04 ||
+                 GetType(vm->memory, operand1) == 0x04 ||
+                 GetType(vm->memory, operand2) == 0x04) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result,
-                        GetFloatData(operand1) != GetFloatData(operand2));
+            SetByteData(
+                vm, result,
+                GetFloatData(vm, operand1) != GetFloatData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result,
-                       GetFloatData(operand1) != GetFloatData(operand2));
+            SetIntData(
+                vm, result,
+                GetFloatData(vm, operand1) != GetFloatData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result,
-                        GetFloatData(operand1) != GetFloatData(operand2));
+            SetLongData(
+                vm, result,
+                GetFloatData(vm, operand1) != GetFloatData(vm, operand2));
             break;
           case 0x04:
-            SetFloatData(result,
-                         GetFloatData(operand1) != GetFloatData(operand2));
+            SetFloatData(
+                vm, result,
+                GetFloatData(vm, operand1) != GetFloatData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x03 ||
-                 GetType(memory, operand1) == 0x03 ||
-                 GetType(memory, operand2) == 0x03) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x03 ||
+                 GetType(vm->memory, operand1) == 0x03 ||
+                 GetType(vm->memory, operand2) == 0x03) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetLongData(operand1) != GetLongData(operand2));
+            SetByteData(vm, result,
+                        GetLongData(vm, operand1) != GetLongData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetLongData(operand1) != GetLongData(operand2));
+            SetIntData(vm, result,
+                       GetLongData(vm, operand1) != GetLongData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result, GetLongData(operand1) != GetLongData(operand2));
+            SetLongData(vm, result,
+                        GetLongData(vm, operand1) != GetLongData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x02 ||
-                 GetType(memory, operand1) == 0x02 ||
-                 GetType(memory, operand2) == 0x02) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x02 ||
+                 GetType(vm->memory, operand1) == 0x02 ||
+                 GetType(vm->memory, operand2) == 0x02) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetIntData(operand1) != GetIntData(operand2));
+            SetByteData(vm, result,
+                        GetIntData(vm, operand1) != GetIntData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetIntData(operand1) != GetIntData(operand2));
+            SetIntData(vm, result,
+                       GetIntData(vm, operand1) != GetIntData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x01 ||
-                 GetType(memory, operand1) == 0x01 ||
-                 GetType(memory, operand2) == 0x01) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x01 ||
+                 GetType(vm->memory, operand1) == 0x01 ||
+                 GetType(vm->memory, operand2) == 0x01) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetByteData(operand1) != GetByteData(operand2));
+            SetByteData(vm, result,
+                        GetByteData(vm, operand1) != GetByteData(vm, operand2));
             break;
           default:
             break;
@@ -1607,90 +3117,105 @@ int CMP(size_t result, size_t opcode, size_t operand1, size_t operand2) {
       }
       break;
     case 0x02:
-      if (GetType(memory, result) == 0x05 ||
-          GetType(memory, operand1) == 0x05 ||
-          GetType(memory, operand2) == 0x05) {
-        switch (GetType(memory, result)) {
+      if (GetType(vm->memory, result) == 0x05 ||
+          GetType(vm->memory, operand1) == 0x05 ||
+          GetType(vm->memory, operand2) == 0x05) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result,
-                        GetDoubleData(operand1) < GetDoubleData(operand2));
+            SetByteData(
+                vm, result,
+                GetDoubleData(vm, operand1) < GetDoubleData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result,
-                       GetDoubleData(operand1) < GetDoubleData(operand2));
+            SetIntData(
+                vm, result,
+                GetDoubleData(vm, operand1) < GetDoubleData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result,
-                        GetDoubleData(operand1) < GetDoubleData(operand2));
+            SetLongData(
+                vm, result,
+                GetDoubleData(vm, operand1) < GetDoubleData(vm, operand2));
             break;
           case 0x04:
-            SetFloatData(result,
-                         GetDoubleData(operand1) < GetDoubleData(operand2));
+            SetFloatData(
+                vm, result,
+                GetDoubleData(vm, operand1) < GetDoubleData(vm, operand2));
             break;
           case 0x05:
-            SetDoubleData(result,
-                          GetDoubleData(operand1) < GetDoubleData(operand2));
+            SetDoubleData(
+                vm, result,
+                GetDoubleData(vm, operand1) < GetDoubleData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x04 ||
-                 GetType(memory, operand1) == 0x04 ||
-                 GetType(memory, operand2) == 0x04) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x04 ||
+                 GetType(vm->memory, operand1) == 0x04 ||
+                 GetType(vm->memory, operand2) == 0x04) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result,
-                        GetFloatData(operand1) < GetFloatData(operand2));
+            SetByteData(
+                vm, result,
+                GetFloatData(vm, operand1) < GetFloatData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetFloatData(operand1) < GetFloatData(operand2));
+            SetIntData(vm, result,
+                       GetFloatData(vm, operand1) < GetFloatData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result,
-                        GetFloatData(operand1) < GetFloatData(operand2));
+            SetLongData(
+                vm, result,
+                GetFloatData(vm, operand1) < GetFloatData(vm, operand2));
             break;
           case 0x04:
-            SetFloatData(result,
-                         GetFloatData(operand1) < GetFloatData(operand2));
+            SetFloatData(
+                vm, result,
+                GetFloatData(vm, operand1) < GetFloatData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x03 ||
-                 GetType(memory, operand1) == 0x03 ||
-                 GetType(memory, operand2) == 0x03) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x03 ||
+                 GetType(vm->memory, operand1) == 0x03 ||
+                 GetType(vm->memory, operand2) == 0x03) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetLongData(operand1) < GetLongData(operand2));
+            SetByteData(vm, result,
+                        GetLongData(vm, operand1) < GetLongData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetLongData(operand1) < GetLongData(operand2));
+            SetIntData(vm, result,
+                       GetLongData(vm, operand1) < GetLongData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result, GetLongData(operand1) < GetLongData(operand2));
+            SetLongData(vm, result,
+                        GetLongData(vm, operand1) < GetLongData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x02 ||
-                 GetType(memory, operand1) == 0x02 ||
-                 GetType(memory, operand2) == 0x02) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x02 ||
+                 GetType(vm->memory, operand1) == 0x02 ||
+                 GetType(vm->memory, operand2) == 0x02) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetIntData(operand1) < GetIntData(operand2));
+            SetByteData(vm, result,
+                        GetIntData(vm, operand1) < GetIntData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetIntData(operand1) < GetIntData(operand2));
+            SetIntData(vm, result,
+                       GetIntData(vm, operand1) < GetIntData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x01 ||
-                 GetType(memory, operand1) == 0x01 ||
-                 GetType(memory, operand2) == 0x01) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x01 ||
+                 GetType(vm->memory, operand1) == 0x01 ||
+                 GetType(vm->memory, operand2) == 0x01) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetByteData(operand1) < GetByteData(operand2));
+            SetByteData(vm, result,
+                        GetByteData(vm, operand1) < GetByteData(vm, operand2));
             break;
           default:
             break;
@@ -1699,91 +3224,106 @@ int CMP(size_t result, size_t opcode, size_t operand1, size_t operand2) {
       }
       break;
     case 0x03:
-      if (GetType(memory, result) == 0x05 ||
-          GetType(memory, operand1) == 0x05 ||
-          GetType(memory, operand2) == 0x05) {
-        switch (GetType(memory, result)) {
+      if (GetType(vm->memory, result) == 0x05 ||
+          GetType(vm->memory, operand1) == 0x05 ||
+          GetType(vm->memory, operand2) == 0x05) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result,
-                        GetDoubleData(operand1) <= GetDoubleData(operand2));
+            SetByteData(
+                vm, result,
+                GetDoubleData(vm, operand1) <= GetDoubleData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result,
-                       GetDoubleData(operand1) <= GetDoubleData(operand2));
+            SetIntData(
+                vm, result,
+                GetDoubleData(vm, operand1) <= GetDoubleData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result,
-                        GetDoubleData(operand1) <= GetDoubleData(operand2));
+            SetLongData(
+                vm, result,
+                GetDoubleData(vm, operand1) <= GetDoubleData(vm, operand2));
             break;
           case 0x04:
-            SetFloatData(result,
-                         GetDoubleData(operand1) <= GetDoubleData(operand2));
+            SetFloatData(
+                vm, result,
+                GetDoubleData(vm, operand1) <= GetDoubleData(vm, operand2));
             break;
           case 0x05:
-            SetDoubleData(result,
-                          GetDoubleData(operand1) <= GetDoubleData(operand2));
+            SetDoubleData(
+                vm, result,
+                GetDoubleData(vm, operand1) <= GetDoubleData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x04 ||
-                 GetType(memory, operand1) == 0x04 ||
-                 GetType(memory, operand2) == 0x04) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x04 ||
+                 GetType(vm->memory, operand1) == 0x04 ||
+                 GetType(vm->memory, operand2) == 0x04) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result,
-                        GetFloatData(operand1) <= GetFloatData(operand2));
+            SetByteData(
+                vm, result,
+                GetFloatData(vm, operand1) <= GetFloatData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result,
-                       GetFloatData(operand1) <= GetFloatData(operand2));
+            SetIntData(
+                vm, result,
+                GetFloatData(vm, operand1) <= GetFloatData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result,
-                        GetFloatData(operand1) <= GetFloatData(operand2));
+            SetLongData(
+                vm, result,
+                GetFloatData(vm, operand1) <= GetFloatData(vm, operand2));
             break;
           case 0x04:
-            SetFloatData(result,
-                         GetFloatData(operand1) <= GetFloatData(operand2));
+            SetFloatData(
+                vm, result,
+                GetFloatData(vm, operand1) <= GetFloatData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x03 ||
-                 GetType(memory, operand1) == 0x03 ||
-                 GetType(memory, operand2) == 0x03) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x03 ||
+                 GetType(vm->memory, operand1) == 0x03 ||
+                 GetType(vm->memory, operand2) == 0x03) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetLongData(operand1) <= GetLongData(operand2));
+            SetByteData(vm, result,
+                        GetLongData(vm, operand1) <= GetLongData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetLongData(operand1) <= GetLongData(operand2));
+            SetIntData(vm, result,
+                       GetLongData(vm, operand1) <= GetLongData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result, GetLongData(operand1) <= GetLongData(operand2));
+            SetLongData(vm, result,
+                        GetLongData(vm, operand1) <= GetLongData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x02 ||
-                 GetType(memory, operand1) == 0x02 ||
-                 GetType(memory, operand2) == 0x02) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x02 ||
+                 GetType(vm->memory, operand1) == 0x02 ||
+                 GetType(vm->memory, operand2) == 0x02) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetIntData(operand1) <= GetIntData(operand2));
+            SetByteData(vm, result,
+                        GetIntData(vm, operand1) <= GetIntData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetIntData(operand1) <= GetIntData(operand2));
+            SetIntData(vm, result,
+                       GetIntData(vm, operand1) <= GetIntData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x01 ||
-                 GetType(memory, operand1) == 0x01 ||
-                 GetType(memory, operand2) == 0x01) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x01 ||
+                 GetType(vm->memory, operand1) == 0x01 ||
+                 GetType(vm->memory, operand2) == 0x01) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetByteData(operand1) <= GetByteData(operand2));
+            SetByteData(vm, result,
+                        GetByteData(vm, operand1) <= GetByteData(vm, operand2));
             break;
           default:
             break;
@@ -1792,90 +3332,105 @@ int CMP(size_t result, size_t opcode, size_t operand1, size_t operand2) {
       }
       break;
     case 0x04:
-      if (GetType(memory, result) == 0x05 ||
-          GetType(memory, operand1) == 0x05 ||
-          GetType(memory, operand2) == 0x05) {
-        switch (GetType(memory, result)) {
+      if (GetType(vm->memory, result) == 0x05 ||
+          GetType(vm->memory, operand1) == 0x05 ||
+          GetType(vm->memory, operand2) == 0x05) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result,
-                        GetDoubleData(operand1) > GetDoubleData(operand2));
+            SetByteData(
+                vm, result,
+                GetDoubleData(vm, operand1) > GetDoubleData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result,
-                       GetDoubleData(operand1) > GetDoubleData(operand2));
+            SetIntData(
+                vm, result,
+                GetDoubleData(vm, operand1) > GetDoubleData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result,
-                        GetDoubleData(operand1) > GetDoubleData(operand2));
+            SetLongData(
+                vm, result,
+                GetDoubleData(vm, operand1) > GetDoubleData(vm, operand2));
             break;
           case 0x04:
-            SetFloatData(result,
-                         GetDoubleData(operand1) > GetDoubleData(operand2));
+            SetFloatData(
+                vm, result,
+                GetDoubleData(vm, operand1) > GetDoubleData(vm, operand2));
             break;
           case 0x05:
-            SetDoubleData(result,
-                          GetDoubleData(operand1) > GetDoubleData(operand2));
+            SetDoubleData(
+                vm, result,
+                GetDoubleData(vm, operand1) > GetDoubleData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x04 ||
-                 GetType(memory, operand1) == 0x04 ||
-                 GetType(memory, operand2) == 0x04) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x04 ||
+                 GetType(vm->memory, operand1) == 0x04 ||
+                 GetType(vm->memory, operand2) == 0x04) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result,
-                        GetFloatData(operand1) > GetFloatData(operand2));
+            SetByteData(
+                vm, result,
+                GetFloatData(vm, operand1) > GetFloatData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetFloatData(operand1) > GetFloatData(operand2));
+            SetIntData(vm, result,
+                       GetFloatData(vm, operand1) > GetFloatData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result,
-                        GetFloatData(operand1) > GetFloatData(operand2));
+            SetLongData(
+                vm, result,
+                GetFloatData(vm, operand1) > GetFloatData(vm, operand2));
             break;
           case 0x04:
-            SetFloatData(result,
-                         GetFloatData(operand1) > GetFloatData(operand2));
+            SetFloatData(
+                vm, result,
+                GetFloatData(vm, operand1) > GetFloatData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x03 ||
-                 GetType(memory, operand1) == 0x03 ||
-                 GetType(memory, operand2) == 0x03) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x03 ||
+                 GetType(vm->memory, operand1) == 0x03 ||
+                 GetType(vm->memory, operand2) == 0x03) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetLongData(operand1) > GetLongData(operand2));
+            SetByteData(vm, result,
+                        GetLongData(vm, operand1) > GetLongData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetLongData(operand1) > GetLongData(operand2));
+            SetIntData(vm, result,
+                       GetLongData(vm, operand1) > GetLongData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result, GetLongData(operand1) > GetLongData(operand2));
+            SetLongData(vm, result,
+                        GetLongData(vm, operand1) > GetLongData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x02 ||
-                 GetType(memory, operand1) == 0x02 ||
-                 GetType(memory, operand2) == 0x02) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x02 ||
+                 GetType(vm->memory, operand1) == 0x02 ||
+                 GetType(vm->memory, operand2) == 0x02) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetIntData(operand1) > GetIntData(operand2));
+            SetByteData(vm, result,
+                        GetIntData(vm, operand1) > GetIntData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetIntData(operand1) > GetIntData(operand2));
+            SetIntData(vm, result,
+                       GetIntData(vm, operand1) > GetIntData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x01 ||
-                 GetType(memory, operand1) == 0x01 ||
-                 GetType(memory, operand2) == 0x01) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x01 ||
+                 GetType(vm->memory, operand1) == 0x01 ||
+                 GetType(vm->memory, operand2) == 0x01) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetByteData(operand1) > GetByteData(operand2));
+            SetByteData(vm, result,
+                        GetByteData(vm, operand1) > GetByteData(vm, operand2));
             break;
           default:
             break;
@@ -1884,91 +3439,106 @@ int CMP(size_t result, size_t opcode, size_t operand1, size_t operand2) {
       }
       break;
     case 0x05:
-      if (GetType(memory, result) == 0x05 ||
-          GetType(memory, operand1) == 0x05 ||
-          GetType(memory, operand2) == 0x05) {
-        switch (GetType(memory, result)) {
+      if (GetType(vm->memory, result) == 0x05 ||
+          GetType(vm->memory, operand1) == 0x05 ||
+          GetType(vm->memory, operand2) == 0x05) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result,
-                        GetDoubleData(operand1) >= GetDoubleData(operand2));
+            SetByteData(
+                vm, result,
+                GetDoubleData(vm, operand1) >= GetDoubleData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result,
-                       GetDoubleData(operand1) >= GetDoubleData(operand2));
+            SetIntData(
+                vm, result,
+                GetDoubleData(vm, operand1) >= GetDoubleData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result,
-                        GetDoubleData(operand1) >= GetDoubleData(operand2));
+            SetLongData(
+                vm, result,
+                GetDoubleData(vm, operand1) >= GetDoubleData(vm, operand2));
             break;
           case 0x04:
-            SetFloatData(result,
-                         GetDoubleData(operand1) >= GetDoubleData(operand2));
+            SetFloatData(
+                vm, result,
+                GetDoubleData(vm, operand1) >= GetDoubleData(vm, operand2));
             break;
           case 0x05:
-            SetDoubleData(result,
-                          GetDoubleData(operand1) >= GetDoubleData(operand2));
+            SetDoubleData(
+                vm, result,
+                GetDoubleData(vm, operand1) >= GetDoubleData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x04 ||
-                 GetType(memory, operand1) == 0x04 ||
-                 GetType(memory, operand2) == 0x04) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x04 ||
+                 GetType(vm->memory, operand1) == 0x04 ||
+                 GetType(vm->memory, operand2) == 0x04) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result,
-                        GetFloatData(operand1) >= GetFloatData(operand2));
+            SetByteData(
+                vm, result,
+                GetFloatData(vm, operand1) >= GetFloatData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result,
-                       GetFloatData(operand1) >= GetFloatData(operand2));
+            SetIntData(
+                vm, result,
+                GetFloatData(vm, operand1) >= GetFloatData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result,
-                        GetFloatData(operand1) >= GetFloatData(operand2));
+            SetLongData(
+                vm, result,
+                GetFloatData(vm, operand1) >= GetFloatData(vm, operand2));
             break;
           case 0x04:
-            SetFloatData(result,
-                         GetFloatData(operand1) >= GetFloatData(operand2));
+            SetFloatData(
+                vm, result,
+                GetFloatData(vm, operand1) >= GetFloatData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x03 ||
-                 GetType(memory, operand1) == 0x03 ||
-                 GetType(memory, operand2) == 0x03) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x03 ||
+                 GetType(vm->memory, operand1) == 0x03 ||
+                 GetType(vm->memory, operand2) == 0x03) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetLongData(operand1) >= GetLongData(operand2));
+            SetByteData(vm, result,
+                        GetLongData(vm, operand1) >= GetLongData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetLongData(operand1) >= GetLongData(operand2));
+            SetIntData(vm, result,
+                       GetLongData(vm, operand1) >= GetLongData(vm, operand2));
             break;
           case 0x03:
-            SetLongData(result, GetLongData(operand1) >= GetLongData(operand2));
+            SetLongData(vm, result,
+                        GetLongData(vm, operand1) >= GetLongData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x02 ||
-                 GetType(memory, operand1) == 0x02 ||
-                 GetType(memory, operand2) == 0x02) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x02 ||
+                 GetType(vm->memory, operand1) == 0x02 ||
+                 GetType(vm->memory, operand2) == 0x02) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetIntData(operand1) >= GetIntData(operand2));
+            SetByteData(vm, result,
+                        GetIntData(vm, operand1) >= GetIntData(vm, operand2));
             break;
           case 0x02:
-            SetIntData(result, GetIntData(operand1) >= GetIntData(operand2));
+            SetIntData(vm, result,
+                       GetIntData(vm, operand1) >= GetIntData(vm, operand2));
             break;
           default:
             break;
         }
-      } else if (GetType(memory, result) == 0x01 ||
-                 GetType(memory, operand1) == 0x01 ||
-                 GetType(memory, operand2) == 0x01) {
-        switch (GetType(memory, result)) {
+      } else if (GetType(vm->memory, result) == 0x01 ||
+                 GetType(vm->memory, operand1) == 0x01 ||
+                 GetType(vm->memory, operand2) == 0x01) {
+        switch (GetType(vm->memory, result)) {
           case 0x01:
-            SetByteData(result, GetByteData(operand1) >= GetByteData(operand2));
+            SetByteData(vm, result,
+                        GetByteData(vm, operand1) >= GetByteData(vm, operand2));
             break;
           default:
             break;
@@ -1981,277 +3551,5755 @@ int CMP(size_t result, size_t opcode, size_t operand1, size_t operand2) {
   }
   return 0;
 }
-int INVOKE(size_t* func, size_t return_value, InternalObject args) {
-  func_ptr invoke_func = GetFunction((char*)GetPtrData(*func));
-  invoke_func(args, return_value);
-  return 0;
+#ifdef AQ_PROFILER
+// The sampling profiler. Every RunVM() pushes a frame on a per-thread chain
+// and INVOKE records the native it calls in the frame of its VM. On SIGPROF
+// the handler walks the chain of the interrupted thread and counts the stack
+// in a fixed table, as it cannot allocate or lock.
+#define PROFILE_DEPTH 16
+#define PROFILE_STACKS 4096
+#define PROFILE_FREQUENCY 997
+
+struct ProfileFrame {
+  struct VM* vm;
+  func_ptr native;
+  struct ProfileFrame* parent;
+};
+
+struct ProfileStack {
+  _Atomic(uint64_t) hash;
+  atomic_size_t count;
+  // Frames from the innermost RunVM() outwards.
+  size_t depth;
+  size_t offsets[PROFILE_DEPTH];
+  uint8_t opcodes[PROFILE_DEPTH];
+  func_ptr natives[PROFILE_DEPTH];
+};
+
+_Thread_local struct ProfileFrame* profile_frame = NULL;
+struct ProfileStack* profile_stacks = NULL;
+atomic_size_t profile_dropped;
+atomic_bool profile_running;
+struct sigaction profile_previous;
+
+// Indexed by opcode.
+const char* const kOpcodeNames[] = {
+    "NOP", "LOAD", "STORE", "NEW", "FREE", "PTR", "ADD", "SUB", "MUL", "DIV",
+    "REM", "NEG", "SHL", "SHR", "SAR", "IF", "AND", "OR", "XOR", "CMP",
+    "INVOKE", "RETURN", "GOTO", "THROW", "PARFOR", "SPAWN", "JOIN", "GREEN",
+    "YIELD", "ATOMIC_ADD", "CAS", "XCHG", "LOAD_ACQUIRE", "STORE_RELEASE",
+    "FENCE", "POPCNT", "CLZ", "CTZ", "BSWAP", "ROTL", "ROTR", "FMA", "SQRT",
+    "MIN", "MAX", "ABS", "FLOOR", "CEIL", "ADD_CHECKED", "SUB_CHECKED",
+    "MUL_CHECKED"};
+
+const char* GetOpcodeName(uint8_t opcode) {
+  if (opcode < sizeof(kOpcodeNames) / sizeof(kOpcodeNames[0])) {
+    return kOpcodeNames[opcode];
+  }
+  return opcode == 0xFF ? "WIDE" : "UNKNOWN";
 }
-int RETURN() { return 0; }
-void* GOTO(void* ptr, size_t offset) {
-  return (void*)((uintptr_t)ptr + GetLongData(offset));
+
+const char* GetFunctionName(const struct LinkedList* list, func_ptr func) {
+  for (size_t i = 0; i < 1024; i++) {
+    for (const struct LinkedList* table = &list[i];
+         table != NULL && table->pair.first != NULL; table = table->next) {
+      if (table->pair.second == func) {
+        return table->pair.first;
+      }
+    }
+  }
+  return "native";
 }
-int THROW() { return 0; }
-int WIDE() { return 0; }
 
-void print(InternalObject args, size_t return_value) {
-  SetIntData(return_value, printf((char*)GetPtrData(*args.index)));
+void PushProfileFrame(struct ProfileFrame* frame, struct VM* vm) {
+  frame->vm = vm;
+  frame->native = NULL;
+  frame->parent = profile_frame;
+  // The frame must be complete before a signal handler can see it.
+  atomic_signal_fence(memory_order_seq_cst);
+  profile_frame = frame;
 }
 
-unsigned int hash(const char* str) {
-  unsigned long hash = 5381;
-  int c;
-  while (c = *str++) {
-    hash = ((hash << 5) + hash) + c;
+void PopProfileFrame(struct ProfileFrame* frame) {
+  profile_frame = frame->parent;
+}
+
+void RecordProfileSample(int signal_number) {
+  (void)signal_number;
+  struct ProfileStack* stacks = profile_stacks;
+  if (stacks == NULL) {
+    return;
   }
-  return hash % 1024;
+  size_t offsets[PROFILE_DEPTH];
+  uint8_t opcodes[PROFILE_DEPTH];
+  func_ptr natives[PROFILE_DEPTH];
+  size_t depth = 0;
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (struct ProfileFrame* frame = profile_frame;
+       frame != NULL && depth < PROFILE_DEPTH; frame = frame->parent) {
+    uint8_t* pc = (uint8_t*)frame->vm->executing;
+    if (pc == NULL) {
+      continue;
+    }
+    offsets[depth] = (size_t)(pc - (uint8_t*)frame->vm->run_code);
+    opcodes[depth] = *pc;
+    natives[depth] = frame->native;
+    hash = (hash ^ offsets[depth]) * 0x100000001b3ull;
+    hash = (hash ^ opcodes[depth]) * 0x100000001b3ull;
+    hash = (hash ^ (uint64_t)(uintptr_t)natives[depth]) * 0x100000001b3ull;
+    depth++;
+  }
+  if (depth == 0) {
+    return;
+  }
+  hash = hash == 0 ? 1 : hash;
+
+  for (size_t i = 0; i < PROFILE_STACKS; i++) {
+    struct ProfileStack* stack = &stacks[(hash + i) % PROFILE_STACKS];
+    uint64_t current = atomic_load(&stack->hash);
+    if (current == 0 &&
+        atomic_compare_exchange_strong(&stack->hash, &current, hash)) {
+      stack->depth = depth;
+      for (size_t j = 0; j < depth; j++) {
+        stack->offsets[j] = offsets[j];
+        stack->opcodes[j] = opcodes[j];
+        stack->natives[j] = natives[j];
+      }
+      current = hash;
+    }
+    if (current == hash) {
+      atomic_fetch_add(&stack->count, 1);
+      return;
+    }
+  }
+  atomic_fetch_add(&profile_dropped, 1);
 }
 
-void InitializeNameTable(struct LinkedList* list) {
-  unsigned int name_hash = hash("print");
-  struct LinkedList* table = &list[name_hash];
-  while (table->next != NULL) {
-    table = table->next;
+int AqStartProfiler(int frequency) {
+  if (atomic_load(&profile_running)) {
+    return AQ_ERROR_INVALID;
   }
-  table->pair.first = "print";
-  table->pair.second = print;
-  table->next = (struct LinkedList*)malloc(sizeof(struct LinkedList));
-  table->next->next = NULL;
-  table->next->pair.first = NULL;
-  table->next->pair.second = NULL;
+  if (profile_stacks == NULL) {
+    profile_stacks = (struct ProfileStack*)calloc(PROFILE_STACKS,
+                                                  sizeof(struct ProfileStack));
+    if (profile_stacks == NULL) {
+      return AQ_ERROR_MEMORY;
+    }
+  } else {
+    memset(profile_stacks, 0, PROFILE_STACKS * sizeof(struct ProfileStack));
+  }
+  atomic_store(&profile_dropped, 0);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = RecordProfileSample;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, &profile_previous) != 0) {
+    return AQ_ERROR_INVALID;
+  }
+  long interval = 1000000 / (frequency > 0 ? frequency : PROFILE_FREQUENCY);
+  struct itimerval timer;
+  timer.it_interval.tv_sec = interval / 1000000;
+  timer.it_interval.tv_usec = interval > 0 ? interval % 1000000 : 1;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+    sigaction(SIGPROF, &profile_previous, NULL);
+    return AQ_ERROR_INVALID;
+  }
+  atomic_store(&profile_running, true);
+  return AQ_OK;
 }
 
-func_ptr GetFunction(const char* name) {
-  unsigned int name_hash = hash(name);
-  struct LinkedList* table = &name_table[name_hash];
-  while (table != NULL) {
-    if (strcmp(table->pair.first, name) == 0) {
-      return table->pair.second;
+void AqStopProfiler(void) {
+  if (!atomic_load(&profile_running)) {
+    return;
+  }
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  sigaction(SIGPROF, &profile_previous, NULL);
+  atomic_store(&profile_running, false);
+}
+
+void WriteProfileFrame(FILE* output, const struct ProfileStack* stack,
+                       size_t frame) {
+  fprintf(output, "%s@0x%zx", GetOpcodeName(stack->opcodes[frame]),
+          stack->offsets[frame]);
+  if (stack->natives[frame] != NULL) {
+    fprintf(output, ";%s",
+            GetFunctionName(name_table, stack->natives[frame]));
+  }
+}
+
+void AqWriteProfile(FILE* output) {
+  if (profile_stacks == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < PROFILE_STACKS; i++) {
+    const struct ProfileStack* stack = &profile_stacks[i];
+    size_t count = atomic_load(&stack->count);
+    if (count == 0) {
+      continue;
     }
-    table = table->next;
+    for (size_t frame = stack->depth; frame-- > 0;) {
+      WriteProfileFrame(output, stack, frame);
+      fputc(frame > 0 ? ';' : ' ', output);
+    }
+    fprintf(output, "%zu\n", count);
   }
-  return (func_ptr)NULL;
 }
 
-void DeinitializeNameTable(struct LinkedList* list) {
-  unsigned int name_hash = hash("print");
-  struct LinkedList* table = list[name_hash].next;
-  struct LinkedList* next;
-  while (table != NULL) {
-    next = table->next;
-    free(table);
-    table = next;
+struct ProfileEntry {
+  size_t offset;
+  uint8_t opcode;
+  size_t self;
+  size_t total;
+};
+
+int CompareProfileOffsets(const void* a, const void* b) {
+  const struct ProfileEntry* first = (const struct ProfileEntry*)a;
+  const struct ProfileEntry* second = (const struct ProfileEntry*)b;
+  if (first->offset != second->offset) {
+    return first->offset < second->offset ? -1 : 1;
+  }
+  return (int)first->opcode - (int)second->opcode;
+}
+
+int CompareProfileSamples(const void* a, const void* b) {
+  const struct ProfileEntry* first = (const struct ProfileEntry*)a;
+  const struct ProfileEntry* second = (const struct ProfileEntry*)b;
+  if (first->self != second->self) {
+    return first->self > second->self ? -1 : 1;
+  }
+  if (first->total != second->total) {
+    return first->total > second->total ? -1 : 1;
+  }
+  return CompareProfileOffsets(a, b);
+}
+
+void AqWriteProfileTable(FILE* output) {
+  if (profile_stacks == NULL) {
+    return;
+  }
+  struct ProfileEntry* entries = (struct ProfileEntry*)malloc(
+      PROFILE_STACKS * PROFILE_DEPTH * sizeof(struct ProfileEntry));
+  if (entries == NULL) {
+    return;
+  }
+  size_t count = 0;
+  size_t samples = 0;
+  for (size_t i = 0; i < PROFILE_STACKS; i++) {
+    const struct ProfileStack* stack = &profile_stacks[i];
+    size_t stack_count = atomic_load(&stack->count);
+    if (stack_count == 0) {
+      continue;
+    }
+    samples += stack_count;
+    for (size_t frame = 0; frame < stack->depth; frame++) {
+      // An instruction on the stack more than once is counted once in its
+      // total.
+      bool repeated = false;
+      for (size_t inner = 0; inner < frame; inner++) {
+        repeated = repeated || stack->offsets[inner] == stack->offsets[frame];
+      }
+      if (repeated) {
+        continue;
+      }
+      entries[count].offset = stack->offsets[frame];
+      entries[count].opcode = stack->opcodes[frame];
+      entries[count].self = frame == 0 ? stack_count : 0;
+      entries[count].total = stack_count;
+      count++;
+    }
+  }
+
+  qsort(entries, count, sizeof(struct ProfileEntry), CompareProfileOffsets);
+  size_t merged = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (merged > 0 && entries[merged - 1].offset == entries[i].offset &&
+        entries[merged - 1].opcode == entries[i].opcode) {
+      entries[merged - 1].self += entries[i].self;
+      entries[merged - 1].total += entries[i].total;
+    } else {
+      entries[merged++] = entries[i];
+    }
+  }
+  qsort(entries, merged, sizeof(struct ProfileEntry), CompareProfileSamples);
+
+  fprintf(output, "%zu samples, %zu dropped\n", samples,
+          atomic_load(&profile_dropped));
+  fprintf(output, "%10s %7s %10s %7s  %-10s %s\n", "self", "self%", "total",
+          "total%", "offset", "opcode");
+  for (size_t i = 0; i < merged; i++) {
+    fprintf(output, "%10zu %6.2f%% %10zu %6.2f%%  0x%-8zx %s\n",
+            entries[i].self, 100.0 * entries[i].self / samples,
+            entries[i].total, 100.0 * entries[i].total / samples,
+            entries[i].offset, GetOpcodeName(entries[i].opcode));
   }
+  free(entries);
+}
+
+void FreeProfile(void) {
+  AqStopProfiler();
+  free(profile_stacks);
+  profile_stacks = NULL;
 }
+#else
+int AqStartProfiler(int frequency) { return AQ_ERROR_INVALID; }
+
+void AqStopProfiler(void) {}
 
-int main(int argc, char* argv[]) {
-  /*LARGE_INTEGER frequency;
-  LARGE_INTEGER start, end;
-  double elapsedTime;
-  QueryPerformanceFrequency(&frequency);
-  QueryPerformanceCounter(&start);*/
+void AqWriteProfile(FILE* output) {}
 
-  if (argc < 2) {
-    printf("Usage: %s <filename>\n", argv[0]);
+void AqWriteProfileTable(FILE* output) {}
+#endif
+
+int INVOKE(struct VM* vm, size_t* func, size_t return_value,
+           InternalObject args) {
+  func_ptr invoke_func =
+      GetFunction(vm->name_table, (char*)GetPtrData(vm, *func));
+  if (invoke_func == NULL) {
     return -1;
   }
+#ifdef AQ_PROFILER
+  struct ProfileFrame* frame = profile_frame;
+  if (frame != NULL) {
+    frame->native = invoke_func;
+  }
+  invoke_func(vm, args, return_value);
+  if (frame != NULL) {
+    frame->native = NULL;
+  }
+#else
+  invoke_func(vm, args, return_value);
+#endif
+  return 0;
+}
+int RETURN() { return 0; }
+void* GOTO(struct VM* vm, void* ptr, size_t offset) {
+  return (void*)((uintptr_t)ptr + GetLongData(vm, offset));
+}
+int THROW() { return 0; }
+int WIDE() { return 0; }
+
+// Returned by RunVM() when the green thread running on |vm| was switched out.
+// vm->pc holds the instruction to resume at.
+#define VM_YIELDED 2
+#define VM_PREEMPTED AQ_PREEMPTED
+
+int RunVM(struct VM* vm);
+int RunVMThreads(struct VM* vm);
+
+// Gives |context| the program, output, arguments and scheduling settings of
+// |parent|.
+void InheritContext(struct VM* context, const struct VM* parent) {
+  context->program = parent->program;
+  context->root = parent->root;
+  context->output = parent->output;
+  context->argc = parent->argc;
+  context->argv = parent->argv;
+  context->schedule_policy = parent->schedule_policy;
+  context->schedule_budget = parent->schedule_budget;
+}
+
+// Creates a context working on |data|, or returns NULL if memory runs out.
+struct VM* CreateContextWithData(struct VM* parent, void* data) {
+  struct Memory* memory =
+      InitializeMemory(data, parent->memory->type, parent->memory->size);
+  if (memory == NULL) {
+    return NULL;
+  }
+  struct VM* context =
+      InitializeVM(memory, parent->name_table, parent->run_code, parent->end);
+  if (context == NULL) {
+    FreeMemory(memory);
+    return NULL;
+  }
+  InheritContext(context, parent);
+  return context;
+}
 
-  FILE* bytecode = fopen(argv[1], "rb");
-  if (bytecode == NULL) {
-    printf("Error: Could not open file %s\n", argv[1]);
-    return -2;
+// Creates a context with a private copy of |parent|'s memory, or returns NULL
+// if memory runs out.
+struct VM* CreateContext(struct VM* parent) {
+  size_t size = parent->memory->size;
+  void* data = malloc(size);
+  if (data == NULL) {
+    return NULL;
+  }
+  memcpy(data, parent->memory->data, size);
+  struct VM* context = CreateContextWithData(parent, data);
+  if (context == NULL) {
+    free(data);
+  }
+  return context;
+}
+
+// Hands the blocks a context allocated with NEW over to |parent| and frees
+// the context.
+void MergeContext(struct VM* parent, struct VM* context) {
+  JoinSpawnedTasks(context);
+  if (context->heap.next != &context->heap) {
+    context->heap.next->prev = &parent->heap;
+    context->heap.prev->next = parent->heap.next;
+    parent->heap.next->prev = context->heap.prev;
+    parent->heap.next = context->heap.next;
+    context->heap.next = &context->heap;
+    context->heap.prev = &context->heap;
   }
+  while (context->mapped_files != NULL) {
+    struct MappedFile* file = context->mapped_files;
+    context->mapped_files = file->next;
+    file->next = parent->mapped_files;
+    parent->mapped_files = file;
+  }
+  FreeInstanceMemory(context);
+  FreeVM(context);
+}
 
-  IsBigEndian();
+struct ParallelFor {
+  struct VM* vm;
+  struct ThreadPool* pool;
+  struct TaskGroup group;
+  size_t induction;
+  void* body;
+  long grain;
+  // One private context per pool thread, created by that thread on first use.
+  struct VM** contexts;
+#ifdef AQ_THREADS
+  atomic_bool* busy;
+#else
+  bool* busy;
+#endif
+  struct VM** extra_contexts;
+  size_t extra_count;
+  // Ranges no context could be created for, run serially by PARFOR.
+  struct ParallelForRange* failed;
+#ifdef AQ_THREADS
+  pthread_mutex_t lock;
+#endif
+};
 
-  fseek(bytecode, 0, SEEK_END);
-  size_t bytecode_size = ftell(bytecode);
-  void* bytecode_file = malloc(bytecode_size);
-  void* bytecode_begin = bytecode_file;
-  void* bytecode_end = (void*)((uintptr_t)bytecode_file + bytecode_size);
-  fseek(bytecode, 0, SEEK_SET);
-  fread(bytecode_file, 1, bytecode_size, bytecode);
-  fclose(bytecode);
+struct ParallelForRange {
+  struct PoolTask task;
+  struct ParallelFor* loop;
+  long begin;
+  long end;
+  struct ParallelForRange* next;
+};
 
-  if (((char*)bytecode_file)[0] != 0x41 || ((char*)bytecode_file)[1] != 0x51 ||
-      ((char*)bytecode_file)[2] != 0x42 || ((char*)bytecode_file)[3] != 0x43) {
-    printf("Error: Invalid bytecode file\n");
-    return -3;
+void ReleaseLoopContext(struct ParallelFor* loop, size_t slot) {
+  if (slot == (size_t)-1) {
+    return;
   }
+#ifdef AQ_THREADS
+  atomic_store(&loop->busy[slot], false);
+#else
+  loop->busy[slot] = false;
+#endif
+}
 
-  bytecode_file = (void*)((uintptr_t)bytecode_file + 8);
+// Returns the private context of the calling thread. A thread that re-enters
+// the same loop through a nested wait gets a fresh context instead. Returns
+// NULL if memory runs out.
+struct VM* AcquireLoopContext(struct ParallelFor* loop, size_t* slot) {
+  *slot = CurrentWorker(loop->pool);
+#ifdef AQ_THREADS
+  bool busy = atomic_exchange(&loop->busy[*slot], true);
+#else
+  bool busy = loop->busy[*slot];
+  loop->busy[*slot] = true;
+#endif
+  if (!busy) {
+    if (loop->contexts[*slot] == NULL) {
+      loop->contexts[*slot] = CreateContext(loop->vm);
+    }
+    if (loop->contexts[*slot] == NULL) {
+      ReleaseLoopContext(loop, *slot);
+      *slot = (size_t)-1;
+      return NULL;
+    }
+    return loop->contexts[*slot];
+  }
 
-  uint64_t temp;
-  memcpy(&temp, bytecode_file, sizeof(uint64_t));
-  temp = SwapUint64t(temp);
-  size_t memory_size = temp;
-  // fprintf(stderr, "Memory size: %zu\n", memory_size);
-  bytecode_file = (void*)((uintptr_t)bytecode_file + 8);
-  void* data = bytecode_file;
-  bytecode_file = (void*)((uintptr_t)bytecode_file + memory_size);
-  void* type = bytecode_file;
-  // fprintf(stderr, "0x%02x%02x%02x%02x%02x%02x%02x%02x",
-  // *(int8_t*)bytecode_file, *((int8_t*)bytecode_file + 1),
-  // *((int8_t*)bytecode_file + 2), *((int8_t*)bytecode_file + 3),
-  // *((int8_t*)bytecode_file + 4), *((int8_t*)bytecode_file + 5),
-  // *((int8_t*)bytecode_file + 6), *((int8_t*)bytecode_file + 7));
-  bytecode_file = (void*)((uintptr_t)bytecode_file + memory_size / 2 + 1);
-  memory = InitializeMemory(data, type, memory_size);
-  void* run_code = bytecode_file;
-
-  InitializeNameTable(name_table);
-  printf("\nProgram started.\n");
+  *slot = (size_t)-1;
+  struct VM* context = CreateContext(loop->vm);
+  if (context == NULL) {
+    return NULL;
+  }
+#ifdef AQ_THREADS
+  pthread_mutex_lock(&loop->lock);
+#endif
+  struct VM** contexts = (struct VM**)realloc(
+      loop->extra_contexts, (loop->extra_count + 1) * sizeof(struct VM*));
+  if (contexts != NULL) {
+    loop->extra_contexts = contexts;
+    loop->extra_contexts[loop->extra_count++] = context;
+  }
+#ifdef AQ_THREADS
+  pthread_mutex_unlock(&loop->lock);
+#endif
+  if (contexts == NULL) {
+    FreeInstanceMemory(context);
+    FreeVM(context);
+    return NULL;
+  }
+  return context;
+}
+
+void RunParallelForRange(struct PoolTask* task);
+
+// Returns false if memory runs out.
+bool SubmitParallelForRange(struct ParallelFor* loop, long begin, long end) {
+  struct ParallelForRange* range =
+      (struct ParallelForRange*)malloc(sizeof(struct ParallelForRange));
+  if (range == NULL) {
+    return false;
+  }
+  range->loop = loop;
+  range->begin = begin;
+  range->end = end;
+  range->task.run = RunParallelForRange;
+  SubmitTask(loop->pool, &loop->group, &range->task);
+  return true;
+}
+
+// Runs a range of iterations in chunks of |grain|. Between chunks, half of
+// the remaining range is split off whenever no queued work is left for idle
+// threads to steal, so chunks stay large while every thread is busy.
+void RunParallelForRange(struct PoolTask* task) {
+  struct ParallelForRange* range = (struct ParallelForRange*)task;
+  struct ParallelFor* loop = range->loop;
+  size_t slot;
+  struct VM* context = AcquireLoopContext(loop, &slot);
+  if (context == NULL) {
+#ifdef AQ_THREADS
+    pthread_mutex_lock(&loop->lock);
+#endif
+    range->next = loop->failed;
+    loop->failed = range;
+#ifdef AQ_THREADS
+    pthread_mutex_unlock(&loop->lock);
+#endif
+    return;
+  }
+  long i = range->begin;
+  long end = range->end;
+  free(range);
+
+  while (i < end) {
+    long middle = i + (end - i) / 2;
+    if (end - i > loop->grain && PoolIsHungry(loop->pool) &&
+        SubmitParallelForRange(loop, middle, end)) {
+      end = middle;
+    }
+    long stop = end - i > loop->grain ? i + loop->grain : end;
+    for (; i < stop; i++) {
+      SetLongData(context, loop->induction, i);
+      context->pc = loop->body;
+      RunVMThreads(context);
+    }
+  }
+  ReleaseLoopContext(loop, slot);
+}
+
+// Runs iterations [begin, end) one after another when memory ran out before
+// they could be handed to the pool. Uses a context the loop already created
+// or, if there is none, one that works on the memory of the VM running
+// PARFOR. Returns false if not even that can be created.
+bool RunParallelForSerially(struct ParallelFor* loop, long begin, long end) {
+  struct VM* context = NULL;
+  for (size_t i = 0;
+       loop->contexts != NULL && context == NULL && i <= loop->pool->size;
+       i++) {
+    context = loop->contexts[i];
+  }
+  if (context == NULL && loop->extra_count > 0) {
+    context = loop->extra_contexts[0];
+  }
+  bool borrowed = context == NULL;
+  if (borrowed) {
+    context = CreateContextWithData(loop->vm, loop->vm->memory->data);
+    if (context == NULL) {
+      return false;
+    }
+  }
+  for (long i = begin; i < end; i++) {
+    SetLongData(context, loop->induction, i);
+    context->pc = loop->body;
+    RunVMThreads(context);
+  }
+  if (borrowed) {
+    context->memory->data = NULL;
+    MergeContext(loop->vm, context);
+  }
+  return true;
+}
+
+int PARFOR(struct VM* vm, size_t induction, size_t begin, size_t end,
+           size_t body) {
+  long begin_value = GetLongData(vm, begin);
+  long end_value = GetLongData(vm, end);
+  if (begin_value >= end_value) {
+    return 0;
+  }
+
+  struct ParallelFor loop;
+  loop.vm = vm;
+  loop.pool = GetThreadPool();
+  InitializeTaskGroup(&loop.group);
+  loop.induction = induction;
+  loop.body = (void*)((uintptr_t)vm->run_code + GetLongData(vm, body));
+  loop.grain = (end_value - begin_value) / (8 * (long)(loop.pool->size + 1));
+  if (loop.grain < 1) {
+    loop.grain = 1;
+  }
+  loop.contexts =
+      (struct VM**)calloc(loop.pool->size + 1, sizeof(struct VM*));
+  loop.busy = calloc(loop.pool->size + 1, sizeof(*loop.busy));
+  loop.extra_contexts = NULL;
+  loop.extra_count = 0;
+  loop.failed = NULL;
+#ifdef AQ_THREADS
+  pthread_mutex_init(&loop.lock, NULL);
+#endif
+
+  int status = 0;
+  if (loop.contexts == NULL || loop.busy == NULL ||
+      !SubmitParallelForRange(&loop, begin_value, end_value)) {
+    free(loop.contexts);
+    loop.contexts = NULL;
+    if (!RunParallelForSerially(&loop, begin_value, end_value)) {
+      status = -1;
+    }
+  } else {
+    WaitTaskGroup(loop.pool, &loop.group);
+  }
+  while (loop.failed != NULL) {
+    struct ParallelForRange* range = loop.failed;
+    loop.failed = range->next;
+    if (!RunParallelForSerially(&loop, range->begin, range->end)) {
+      status = -1;
+    }
+    free(range);
+  }
+
+  for (size_t i = 0; loop.contexts != NULL && i <= loop.pool->size; i++) {
+    if (loop.contexts[i] != NULL) {
+      MergeContext(vm, loop.contexts[i]);
+    }
+  }
+  for (size_t i = 0; i < loop.extra_count; i++) {
+    MergeContext(vm, loop.extra_contexts[i]);
+  }
+#ifdef AQ_THREADS
+  pthread_mutex_destroy(&loop.lock);
+#endif
+  free(loop.contexts);
+  free(loop.busy);
+  free(loop.extra_contexts);
+  return status;
+}
+
+// Reads a count followed by that many slot operands. The caller frees |list|.
+void* GetParamentList(void* ptr, size_t* count, size_t** list) {
+  ptr = Get1Parament(ptr, count);
+  *list = (size_t*)malloc(*count * sizeof(size_t));
+  for (size_t i = 0; i < *count; i++) {
+    ptr = Get1Parament(ptr, *list + i);
+  }
+  return ptr;
+}
+
+// A task started by SPAWN. It runs a bytecode block on its own context, which
+// starts from the program's initial memory plus the argument slots copied from
+// the spawning VM.
+struct SpawnedTask {
+  struct PoolTask task;
+  struct TaskGroup group;
+  struct VM* context;
+  void* body;
+  // Links the tasks that the spawning VM has not joined yet.
+  struct SpawnedTask* prev;
+  struct SpawnedTask* next;
+};
+
+// Returns the number of bytes of the slot at |index|, treating untyped slots
+// as pointers.
+size_t GetSlotSize(const struct Memory* memory, size_t index) {
+  if (index >= memory->size) {
+    return 0;
+  }
+  uint8_t type = GetType(memory, index);
+  size_t size = type == 0x00 ? sizeof(void*) : GET_SIZE(type);
+  return size < memory->size - index ? size : memory->size - index;
+}
+
+// Copies slot |index| of |from| to the same slot of |to|.
+void CopySlot(struct VM* to, const struct VM* from, size_t index) {
+  size_t size = GetSlotSize(from->memory, index);
+  memcpy((void*)((uintptr_t)to->memory->data + index),
+         (void*)((uintptr_t)from->memory->data + index), size);
+}
+
+void RunSpawnedTask(struct PoolTask* task) {
+  struct SpawnedTask* spawned = (struct SpawnedTask*)task;
+  spawned->context->pc = spawned->body;
+  RunVMThreads(spawned->context);
+}
+
+// Creates a context that starts from the program's initial memory with the
+// |args| slots copied from |vm|, or returns NULL if memory runs out.
+struct VM* CreateTaskContext(struct VM* vm, size_t arg_count, size_t* args) {
+  struct VM* context = vm->program != NULL ? CreateProgramVM(vm->program)
+                                           : CreateContext(vm);
+  if (context == NULL) {
+    return NULL;
+  }
+  InheritContext(context, vm);
+  for (size_t i = 0; i < arg_count; i++) {
+    CopySlot(context, vm, args[i]);
+  }
+  return context;
+}
+
+// Stores a null handle, which JOIN rejects, if the task cannot be allocated.
+int SPAWN(struct VM* vm, size_t handle, size_t body, size_t arg_count,
+          size_t* args) {
+  struct VM* context = CreateTaskContext(vm, arg_count, args);
+  struct SpawnedTask* spawned =
+      context != NULL
+          ? (struct SpawnedTask*)malloc(sizeof(struct SpawnedTask))
+          : NULL;
+  if (spawned == NULL) {
+    if (context != NULL) {
+      FreeInstanceMemory(context);
+      FreeVM(context);
+    }
+    SetPtrData(vm, handle, NULL);
+    return -1;
+  }
+  spawned->task.run = RunSpawnedTask;
+  InitializeTaskGroup(&spawned->group);
+  spawned->context = context;
+  spawned->body = (void*)((uintptr_t)vm->run_code + GetLongData(vm, body));
+  spawned->prev = NULL;
+  spawned->next = vm->spawned;
+  if (vm->spawned != NULL) {
+    vm->spawned->prev = spawned;
+  }
+  vm->spawned = spawned;
+  SetPtrData(vm, handle, spawned);
+
+  SubmitTask(GetThreadPool(), &spawned->group, &spawned->task);
+  return 0;
+}
+
+// Waits for |spawned|, copies |result_count| result slots back to |vm| and
+// hands the blocks the task allocated over to |vm|.
+void JoinSpawnedTask(struct VM* vm, struct SpawnedTask* spawned,
+                     size_t result_count, size_t* results) {
+  WaitTaskGroup(GetThreadPool(), &spawned->group);
+  for (size_t i = 0; i < result_count; i++) {
+    CopySlot(vm, spawned->context, results[i]);
+  }
+  if (spawned->prev != NULL) {
+    spawned->prev->next = spawned->next;
+  } else {
+    vm->spawned = spawned->next;
+  }
+  if (spawned->next != NULL) {
+    spawned->next->prev = spawned->prev;
+  }
+  MergeContext(vm, spawned->context);
+  free(spawned);
+}
+
+void JoinSpawnedTasks(struct VM* vm) {
+  while (vm->spawned != NULL) {
+    JoinSpawnedTask(vm, vm->spawned, 0, NULL);
+  }
+}
+
+int JOIN(struct VM* vm, size_t handle, size_t result_count, size_t* results) {
+  struct SpawnedTask* spawned = (struct SpawnedTask*)GetPtrData(vm, handle);
+  if (spawned == NULL) {
+    return -1;
+  }
+  JoinSpawnedTask(vm, spawned, result_count, results);
+  SetPtrData(vm, handle, NULL);
+  return 0;
+}
+
+// A green thread multiplexed onto the OS thread that runs its scheduler. It
+// has its own context and program counter; the scheduler switches threads
+// when one exhausts its instruction budget, executes YIELD or blocks in a
+// native.
+struct GreenThread {
+  struct VM* context;
+  long priority;
+  // Orders threads of equal priority first-in, first-out.
+  size_t sequence;
+};
+
+struct Scheduler {
+  struct VM* owner;
+  // Whether the owner is scheduled like the other threads, which is the case
+  // once it first yielded.
+  bool started;
+  int policy;
+  size_t budget;
+  size_t sequence;
+  // Binary heap of runnable threads; the top runs next.
+  struct GreenThread* threads;
+  size_t count;
+  size_t capacity;
+  // Threads waiting for a descriptor are parked in the event loop instead,
+  // which is created the first time one is needed.
+  struct ParkedThread** parked;
+  size_t parked_count;
+  size_t parked_capacity;
+  int epoll_fd;
+  int timer_fd;
+  // Whether the owner's ring is registered with the event loop.
+  bool ring_registered;
+};
+
+// Nanoseconds on a clock that never jumps, so deadlines survive changes to
+// the system time.
+long long CurrentTime() {
+  struct timespec time;
+#ifdef CLOCK_MONOTONIC
+  clock_gettime(CLOCK_MONOTONIC, &time);
+#else
+  timespec_get(&time, TIME_UTC);
+#endif
+  return (long long)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+void SleepUntil(long long deadline) {
+#ifdef AQ_THREADS
+  long long now = CurrentTime();
+  if (deadline > now) {
+    struct timespec duration = {(deadline - now) / 1000000000,
+                                (deadline - now) % 1000000000};
+    nanosleep(&duration, NULL);
+  }
+#else
+  while (CurrentTime() < deadline) {
+  }
+#endif
+}
+
+bool RunsBefore(const struct Scheduler* scheduler, const struct GreenThread* a,
+                const struct GreenThread* b) {
+  if (scheduler->policy == AQ_SCHEDULE_PRIORITY && a->priority != b->priority) {
+    return a->priority > b->priority;
+  }
+  return a->sequence < b->sequence;
+}
+
+// Makes room for |count| threads in the heap. Returns false if memory runs
+// out.
+bool ReserveGreenThreads(struct Scheduler* scheduler, size_t count) {
+  if (count <= scheduler->capacity) {
+    return true;
+  }
+  size_t capacity = scheduler->capacity == 0 ? 16 : 2 * scheduler->capacity;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+  struct GreenThread* threads = (struct GreenThread*)realloc(
+      scheduler->threads, capacity * sizeof(struct GreenThread));
+  if (threads == NULL) {
+    return false;
+  }
+  scheduler->threads = threads;
+  scheduler->capacity = capacity;
+  return true;
+}
+
+// The heap must have room for the thread; GREEN reserves it for every thread
+// the scheduler can hold at once.
+void PushGreenThread(struct Scheduler* scheduler, struct VM* context,
+                     long priority) {
+  struct GreenThread thread = {context, priority, scheduler->sequence++};
+  size_t i = scheduler->count++;
+  while (i > 0 &&
+         RunsBefore(scheduler, &thread, &scheduler->threads[(i - 1) / 2])) {
+    scheduler->threads[i] = scheduler->threads[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  scheduler->threads[i] = thread;
+}
+
+struct GreenThread PopGreenThread(struct Scheduler* scheduler) {
+  struct GreenThread top = scheduler->threads[0];
+  struct GreenThread last = scheduler->threads[--scheduler->count];
+  size_t i = 0;
+  while (2 * i + 1 < scheduler->count) {
+    size_t child = 2 * i + 1;
+    if (child + 1 < scheduler->count &&
+        RunsBefore(scheduler, &scheduler->threads[child + 1],
+                   &scheduler->threads[child])) {
+      child++;
+    }
+    if (!RunsBefore(scheduler, &scheduler->threads[child], &last)) {
+      break;
+    }
+    scheduler->threads[i] = scheduler->threads[child];
+    i = child;
+  }
+  scheduler->threads[i] = last;
+  return top;
+}
+
+// Marks the green thread running |vm| as blocked. The native that called it
+// returns without a result and is invoked again the next time the thread is
+// scheduled. Returns false when |vm| does not run on a scheduler, in which
+// case the native has to wait by itself.
+bool BlockGreenThread(struct VM* vm, long long deadline) {
+  if (vm->scheduler == NULL) {
+    return false;
+  }
+  vm->blocked = true;
+  vm->deadline = deadline;
+  return true;
+}
+
+// Called by a native whose operation on |fd| would block. Suspends the green
+// thread running |vm| until |fd| is ready for the poll |events| and returns
+// true, in which case the native returns and is invoked again. Otherwise
+// waits on the calling thread and returns false so the native retries
+// directly.
+bool WaitForDescriptor(struct VM* vm, int fd, short events) {
+  vm->wait_fd = fd;
+  vm->wait_events = events;
+  if (BlockGreenThread(vm, 0)) {
+    return true;
+  }
+#ifdef AQ_EVENTS
+  struct pollfd descriptor = {fd, events, 0};
+  poll(&descriptor, 1, -1);
+#endif
+  return false;
+}
+
+#ifdef AQ_IO_URING
+#define AQ_RING_ENTRIES 256
+#define AQ_RING_BUFFER_COUNT 16
+#define AQ_RING_BUFFER_SIZE 65536
+
+// A request submitted to a ring. It lives until the native that started it
+// has read the result, which is a negated errno on failure.
+struct RingRequest {
+  int result;
+  bool done;
+  // The green thread parked on the request, if any.
+  struct ParkedThread* parked;
+  size_t iovec_count;
+  struct iovec iovecs[];
+};
+
+// An io_uring driven without liburing. Requests are only queued by the
+// natives; the ring is entered once per batch, when a native or the event
+// loop has to wait for a completion. Without io_uring support |fd| is -1 and
+// the natives fall back to synchronous system calls.
+struct Ring {
+  int fd;
+  bool current_position;
+  _Atomic(unsigned)* sq_head;
+  _Atomic(unsigned)* sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe* sqes;
+  _Atomic(unsigned)* cq_head;
+  _Atomic(unsigned)* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  void* sq_map;
+  size_t sq_map_size;
+  void* cq_map;
+  size_t cq_map_size;
+  // Queued but not yet submitted, and submitted or queued but not completed.
+  unsigned queued;
+  size_t inflight;
+  // Fixed-size buffers for file_buffer(), registered with the ring when
+  // possible so reads and writes into them skip the page pinning.
+  char* buffers;
+  bool registered;
+  bool buffer_used[AQ_RING_BUFFER_COUNT];
+};
+
+int EnterRing(struct Ring* ring, unsigned wait) {
+  while (true) {
+    int submitted = (int)syscall(__NR_io_uring_enter, ring->fd, ring->queued,
+                                 wait, wait != 0 ? IORING_ENTER_GETEVENTS : 0,
+                                 NULL, 0);
+    if (submitted >= 0) {
+      ring->queued -= (unsigned)submitted;
+      return 0;
+    }
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+}
+
+// Returns whether the kernel supports every operation the file natives use.
+bool ProbeRing(int fd) {
+  static const uint8_t required[] = {
+      IORING_OP_OPENAT, IORING_OP_READ,        IORING_OP_WRITE,
+      IORING_OP_READV,  IORING_OP_READ_FIXED,  IORING_OP_WRITE_FIXED,
+      IORING_OP_FSYNC,  IORING_OP_CLOSE};
+  size_t size = sizeof(struct io_uring_probe) +
+                256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, size);
+  bool supported =
+      syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) ==
+      0;
+  for (size_t i = 0; supported && i < sizeof(required); i++) {
+    supported = required[i] <= probe->last_op &&
+                (probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return supported;
+}
+
+struct Ring* CreateRing() {
+  struct Ring* ring = (struct Ring*)calloc(1, sizeof(struct Ring));
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = (int)syscall(__NR_io_uring_setup, AQ_RING_ENTRIES, &params);
+  if (ring->fd < 0) {
+    ring->fd = -1;
+    return ring;
+  }
+  if (!ProbeRing(ring->fd)) {
+    close(ring->fd);
+    ring->fd = -1;
+    return ring;
+  }
+  ring->current_position = (params.features & IORING_FEAT_RW_CUR_POS) != 0;
+
+  ring->sq_map_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_map_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) &&
+      ring->cq_map_size > ring->sq_map_size) {
+    ring->sq_map_size = ring->cq_map_size;
+  }
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_map = ring->sq_map;
+  if (ring->sq_map != MAP_FAILED &&
+      !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    ring->cq_map =
+        mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes = (struct io_uring_sqe*)mmap(
+      NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+      IORING_OFF_SQES);
+  if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    if (ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+      munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map != MAP_FAILED) {
+      munmap(ring->sq_map, ring->sq_map_size);
+    }
+    close(ring->fd);
+    ring->fd = -1;
+    return ring;
+  }
+
+  char* sq = (char*)ring->sq_map;
+  ring->sq_head = (_Atomic(unsigned)*)(sq + params.sq_off.head);
+  ring->sq_tail = (_Atomic(unsigned)*)(sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  unsigned* array = (unsigned*)(sq + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; i++) {
+    array[i] = i;
+  }
+  char* cq = (char*)ring->cq_map;
+  ring->cq_head = (_Atomic(unsigned)*)(cq + params.cq_off.head);
+  ring->cq_tail = (_Atomic(unsigned)*)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  return ring;
+}
+
+// Returns the ring the file natives of |vm| use. Green threads share the ring
+// of the VM that runs their scheduler.
+struct Ring* GetRing(struct VM* vm) {
+  if (vm->scheduler != NULL) {
+    vm = vm->scheduler->owner;
+  }
+  if (vm->ring == NULL) {
+    vm->ring = CreateRing();
+  }
+  return vm->ring;
+}
+
+// Returns a free submission queue entry, or NULL if |ring| is not backed by
+// io_uring.
+struct io_uring_sqe* GetRingEntry(struct Ring* ring) {
+  if (ring->fd < 0) {
+    return NULL;
+  }
+  unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+  if (tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) ==
+          ring->sq_entries &&
+      EnterRing(ring, 0) != 0) {
+    return NULL;
+  }
+  return &ring->sqes[tail & ring->sq_mask];
+}
+
+// Returns the index of the registered buffer holding |size| bytes at
+// |address|, or -1.
+int GetRingBuffer(const struct Ring* ring, uint64_t address, size_t size) {
+  uintptr_t start = (uintptr_t)ring->buffers;
+  if (!ring->registered || address < start ||
+      address + size > start + AQ_RING_BUFFER_COUNT * AQ_RING_BUFFER_SIZE) {
+    return -1;
+  }
+  int index = (int)((address - start) / AQ_RING_BUFFER_SIZE);
+  return address + size <= start + (index + 1) * (size_t)AQ_RING_BUFFER_SIZE
+             ? index
+             : -1;
+}
+
+// Runs |entry| with the equivalent system call, for kernels without io_uring.
+int RunRingEntry(const struct io_uring_sqe* entry) {
+  void* address = (void*)(uintptr_t)entry->addr;
+  bool position = entry->off == (uint64_t)-1;
+  long result = -1;
+  switch (entry->opcode) {
+    case IORING_OP_OPENAT:
+      result = openat(entry->fd, (char*)address, entry->open_flags, entry->len);
+      break;
+    case IORING_OP_READ:
+      result = position ? read(entry->fd, address, entry->len)
+                        : pread(entry->fd, address, entry->len, entry->off);
+      break;
+    case IORING_OP_WRITE:
+      result = position ? write(entry->fd, address, entry->len)
+                        : pwrite(entry->fd, address, entry->len, entry->off);
+      break;
+    case IORING_OP_READV:
+      result = position ? readv(entry->fd, (struct iovec*)address, entry->len)
+                        : preadv(entry->fd, (struct iovec*)address, entry->len,
+                                 entry->off);
+      break;
+    case IORING_OP_FSYNC:
+      result = fsync(entry->fd);
+      break;
+    case IORING_OP_CLOSE:
+      result = close(entry->fd);
+      break;
+  }
+  return result < 0 ? -errno : (int)result;
+}
+
+// Starts the file operation |entry| for |vm| with |iovecs| copied into the
+// request. The operation is queued on the VM's ring, using a registered
+// buffer when the data lies in one, or run right away without io_uring.
+void StartRequest(struct VM* vm, struct io_uring_sqe* entry,
+                  const struct iovec* iovecs, size_t iovec_count) {
+  struct RingRequest* request = (struct RingRequest*)malloc(
+      sizeof(struct RingRequest) + iovec_count * sizeof(struct iovec));
+  request->done = false;
+  request->parked = NULL;
+  request->iovec_count = iovec_count;
+  if (iovec_count > 0) {
+    memcpy(request->iovecs, iovecs, iovec_count * sizeof(struct iovec));
+    entry->addr = (uintptr_t)request->iovecs;
+    entry->len = (unsigned)iovec_count;
+  }
+  vm->request = request;
+
+  struct Ring* ring = GetRing(vm);
+  bool position = entry->off == (uint64_t)-1 &&
+                  entry->opcode != IORING_OP_OPENAT &&
+                  entry->opcode != IORING_OP_FSYNC &&
+                  entry->opcode != IORING_OP_CLOSE;
+  struct io_uring_sqe* slot =
+      !position || ring->current_position ? GetRingEntry(ring) : NULL;
+  if (slot == NULL) {
+    request->result = RunRingEntry(entry);
+    request->done = true;
+    return;
+  }
+  if (entry->opcode == IORING_OP_READ || entry->opcode == IORING_OP_WRITE) {
+    int index = GetRingBuffer(ring, entry->addr, entry->len);
+    if (index >= 0) {
+      entry->opcode = entry->opcode == IORING_OP_READ ? IORING_OP_READ_FIXED
+                                                      : IORING_OP_WRITE_FIXED;
+      entry->buf_index = (uint16_t)index;
+    }
+  }
+  *slot = *entry;
+  slot->user_data = (uint64_t)(uintptr_t)request;
+  ring->queued++;
+  ring->inflight++;
+  atomic_store_explicit(
+      ring->sq_tail,
+      atomic_load_explicit(ring->sq_tail, memory_order_relaxed) + 1,
+      memory_order_release);
+}
+#endif
+
+#ifdef AQ_EVENTS
+struct ParkedThread {
+  struct GreenThread thread;
+  // The descriptor registered with epoll: the one waited for, or a duplicate
+  // of it when another thread already waits for the same one. -1 for a thread
+  // waiting for a ring request.
+  int fd;
+  size_t index;
+};
+
+void AddParkedThread(struct Scheduler* scheduler,
+                     struct ParkedThread* parked) {
+  if (scheduler->parked_count == scheduler->parked_capacity) {
+    scheduler->parked_capacity =
+        scheduler->parked_capacity == 0 ? 16 : 2 * scheduler->parked_capacity;
+    scheduler->parked = (struct ParkedThread**)realloc(
+        scheduler->parked,
+        scheduler->parked_capacity * sizeof(struct ParkedThread*));
+  }
+  parked->index = scheduler->parked_count;
+  scheduler->parked[scheduler->parked_count++] = parked;
+}
+
+// Moves the blocked |thread| out of the run queue into the event loop, if it
+// waits for a descriptor or a ring request. Returns false otherwise, leaving
+// the thread to be retried like any other blocked thread.
+bool ParkGreenThread(struct Scheduler* scheduler, struct GreenThread thread) {
+  struct VM* context = thread.context;
+  bool request = false;
+#ifdef AQ_IO_URING
+  request = context->request != NULL && !context->request->done;
+#endif
+  if (context->wait_fd < 0 && !request) {
+    return false;
+  }
+  if (scheduler->epoll_fd < 0) {
+    scheduler->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (scheduler->epoll_fd < 0) {
+      return false;
+    }
+  }
+  struct ParkedThread* parked =
+      (struct ParkedThread*)malloc(sizeof(struct ParkedThread));
+  parked->thread = thread;
+  parked->fd = -1;
+  struct epoll_event event;
+#ifdef AQ_IO_URING
+  if (request) {
+    struct Ring* ring = scheduler->owner->ring;
+    event.events = EPOLLIN;
+    event.data.ptr = ring;
+    if (!scheduler->ring_registered &&
+        epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_ADD, ring->fd, &event) != 0) {
+      free(parked);
+      return false;
+    }
+    scheduler->ring_registered = true;
+    context->request->parked = parked;
+    AddParkedThread(scheduler, parked);
+    return true;
+  }
+#endif
+
+  parked->fd = context->wait_fd;
+  event.events = ((context->wait_events & POLLIN) ? EPOLLIN : 0) |
+                 ((context->wait_events & POLLOUT) ? EPOLLOUT : 0);
+  event.data.ptr = parked;
+  int status = epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_ADD, parked->fd,
+                         &event);
+  if (status != 0 && errno == EEXIST) {
+    parked->fd = fcntl(context->wait_fd, F_DUPFD_CLOEXEC, 0);
+    status = parked->fd < 0 ? -1
+                            : epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_ADD,
+                                        parked->fd, &event);
+  }
+  if (status != 0) {
+    if (parked->fd >= 0 && parked->fd != context->wait_fd) {
+      close(parked->fd);
+    }
+    free(parked);
+    return false;
+  }
+  AddParkedThread(scheduler, parked);
+  return true;
+}
+
+void UnparkGreenThread(struct Scheduler* scheduler,
+                       struct ParkedThread* parked) {
+  if (parked->fd >= 0) {
+    epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_DEL, parked->fd, NULL);
+    if (parked->fd != parked->thread.context->wait_fd) {
+      close(parked->fd);
+    }
+  }
+  struct ParkedThread* last = scheduler->parked[--scheduler->parked_count];
+  last->index = parked->index;
+  scheduler->parked[parked->index] = last;
+  PushGreenThread(scheduler, parked->thread.context, parked->thread.priority);
+  free(parked);
+}
+
+#endif
+#ifdef AQ_IO_URING
+// Stores the results of completed requests and wakes the green threads parked
+// on them when |scheduler| is given.
+void ReapRing(struct Ring* ring, struct Scheduler* scheduler) {
+  unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+  for (; head != tail; head++) {
+    struct io_uring_cqe* completion = &ring->cqes[head & ring->cq_mask];
+    struct RingRequest* request =
+        (struct RingRequest*)(uintptr_t)completion->user_data;
+    request->result = completion->res;
+    request->done = true;
+    ring->inflight--;
+    if (request->parked != NULL && scheduler != NULL) {
+      UnparkGreenThread(scheduler, request->parked);
+    }
+    request->parked = NULL;
+  }
+  atomic_store_explicit(ring->cq_head, head, memory_order_release);
+}
+
+// Waits for the request of |vm| and stores its result, or -1 on failure, in
+// |return_value|. On a green thread the thread is suspended instead and the
+// native invoked again once the request completed.
+void FinishRequest(struct VM* vm, size_t return_value) {
+  struct Ring* ring = GetRing(vm);
+  while (!vm->request->done) {
+    if (BlockGreenThread(vm, 0)) {
+      return;
+    }
+    if (EnterRing(ring, 1) != 0) {
+      vm->request->result = -errno;
+      break;
+    }
+    ReapRing(ring, NULL);
+  }
+  long result = vm->request->result;
+  free(vm->request);
+  vm->request = NULL;
+  SetLongData(vm, return_value, result < 0 ? -1 : result);
+}
+
+// Returns one of the ring's fixed-size buffers, registering them with the
+// kernel on first use, or NULL if |size| does not fit or none is free.
+void* AllocateRingBuffer(struct Ring* ring, size_t size) {
+  if (size > AQ_RING_BUFFER_SIZE) {
+    return NULL;
+  }
+  if (ring->buffers == NULL) {
+    void* buffers = mmap(NULL, AQ_RING_BUFFER_COUNT * AQ_RING_BUFFER_SIZE,
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+    if (buffers == MAP_FAILED) {
+      return NULL;
+    }
+    ring->buffers = (char*)buffers;
+    struct iovec iovecs[AQ_RING_BUFFER_COUNT];
+    for (size_t i = 0; i < AQ_RING_BUFFER_COUNT; i++) {
+      iovecs[i].iov_base = ring->buffers + i * AQ_RING_BUFFER_SIZE;
+      iovecs[i].iov_len = AQ_RING_BUFFER_SIZE;
+    }
+    ring->registered =
+        ring->fd >= 0 &&
+        syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+                iovecs, AQ_RING_BUFFER_COUNT) == 0;
+  }
+  for (size_t i = 0; i < AQ_RING_BUFFER_COUNT; i++) {
+    if (!ring->buffer_used[i]) {
+      ring->buffer_used[i] = true;
+      return ring->buffers + i * AQ_RING_BUFFER_SIZE;
+    }
+  }
+  return NULL;
+}
+
+void FreeRingBuffer(struct Ring* ring, void* buffer) {
+  uintptr_t offset = (uintptr_t)buffer - (uintptr_t)ring->buffers;
+  if (ring->buffers != NULL &&
+      offset < AQ_RING_BUFFER_COUNT * AQ_RING_BUFFER_SIZE) {
+    ring->buffer_used[offset / AQ_RING_BUFFER_SIZE] = false;
+  }
+}
+
+// Waits until the kernel no longer uses memory of requests in flight.
+void DrainRing(struct Ring* ring) {
+  if (ring == NULL || ring->fd < 0) {
+    return;
+  }
+  while (ring->inflight > 0 && EnterRing(ring, 1) == 0) {
+    ReapRing(ring, NULL);
+  }
+}
+
+void FreeRing(struct Ring* ring) {
+  if (ring == NULL) {
+    return;
+  }
+  DrainRing(ring);
+  if (ring->fd >= 0) {
+    munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_map != ring->sq_map) {
+      munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+  }
+  if (ring->buffers != NULL) {
+    munmap(ring->buffers, AQ_RING_BUFFER_COUNT * AQ_RING_BUFFER_SIZE);
+  }
+  free(ring);
+}
+
+// Prepares the ring of |vm| for another run: waits for requests in flight and
+// releases the buffers.
+void ResetRing(struct VM* vm) {
+  DrainRing(vm->ring);
+  free(vm->request);
+  vm->request = NULL;
+  if (vm->ring != NULL) {
+    memset(vm->ring->buffer_used, 0, sizeof(vm->ring->buffer_used));
+  }
+}
+#else
+void DrainRing(struct Ring* ring) {}
+void FreeRing(struct Ring* ring) {}
+void ResetRing(struct VM* vm) {}
+#endif
+
+#ifdef AQ_EVENTS
+// Waits until a parked thread's descriptor or request is ready or |deadline|
+// has passed and makes the ready threads runnable. Queued ring requests are
+// submitted first, in one batch. A |deadline| of 0 only polls, -1
+// waits without limit. Deadlines are armed on a timerfd so they keep their
+// nanosecond resolution.
+void WaitEvents(struct Scheduler* scheduler, long long deadline) {
+  if (scheduler->epoll_fd < 0) {
+    if (deadline > 0) {
+      SleepUntil(deadline);
+    }
+    return;
+  }
+  struct Ring* ring = scheduler->owner->ring;
+#ifdef AQ_IO_URING
+  if (ring != NULL && ring->queued > 0) {
+    EnterRing(ring, 0);
+  }
+#endif
+  int timeout = deadline == 0 ? 0 : -1;
+  if (deadline > 0 && scheduler->timer_fd < 0) {
+    scheduler->timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (scheduler->timer_fd >= 0 &&
+        epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_ADD, scheduler->timer_fd,
+                  &event) != 0) {
+      close(scheduler->timer_fd);
+      scheduler->timer_fd = -1;
+    }
+  }
+  if (deadline > 0 && scheduler->timer_fd >= 0) {
+    struct itimerspec timer = {{0, 0},
+                               {deadline / 1000000000, deadline % 1000000000}};
+    timerfd_settime(scheduler->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+  } else if (deadline > 0) {
+    long long now = CurrentTime();
+    timeout = deadline > now ? (int)((deadline - now + 999999) / 1000000) : 0;
+  }
+
+  struct epoll_event events[64];
+  int count = epoll_wait(scheduler->epoll_fd, events, 64, timeout);
+  for (int i = 0; i < count; i++) {
+    if (events[i].data.ptr == NULL) {
+      uint64_t expirations;
+      read(scheduler->timer_fd, &expirations, sizeof(expirations));
+    } else if (events[i].data.ptr == ring) {
+#ifdef AQ_IO_URING
+      ReapRing(ring, scheduler);
+#endif
+    } else {
+      UnparkGreenThread(scheduler, (struct ParkedThread*)events[i].data.ptr);
+    }
+  }
+}
+
+void CloseEvents(struct Scheduler* scheduler) {
+  for (size_t i = 0; i < scheduler->parked_count; i++) {
+    struct ParkedThread* parked = scheduler->parked[i];
+    if (parked->fd >= 0 && parked->fd != parked->thread.context->wait_fd) {
+      close(parked->fd);
+    }
+    free(parked);
+  }
+  free(scheduler->parked);
+  if (scheduler->timer_fd >= 0) {
+    close(scheduler->timer_fd);
+  }
+  if (scheduler->epoll_fd >= 0) {
+    close(scheduler->epoll_fd);
+  }
+}
+#else
+bool ParkGreenThread(struct Scheduler* scheduler, struct GreenThread thread) {
+  return false;
+}
+
+void WaitEvents(struct Scheduler* scheduler, long long deadline) {
+  if (deadline > 0) {
+    SleepUntil(deadline);
+  }
+}
+
+void CloseEvents(struct Scheduler* scheduler) {}
+#endif
+
+void FreeScheduler(struct Scheduler* scheduler) {
+  CloseEvents(scheduler);
+  free(scheduler->threads);
+  free(scheduler);
+}
+
+// Returns the VM whose time slice |vm| runs on. Green threads share the
+// slice of the VM that started them, so every thread's ticks count against
+// the same AqRunVM() call.
+struct VM* GetSliceOwner(struct VM* vm) {
+  return vm->scheduler != NULL ? vm->scheduler->owner : vm;
+}
+
+// Returns how many ticks may pass before EndSlice() has to look at the green
+// thread budget, the slice budget and the deadline. The clock is only read
+// every 1024 ticks.
+size_t StartSlice(struct VM* vm) {
+  struct VM* owner = GetSliceOwner(vm);
+  size_t ticks = SIZE_MAX;
+  if (vm->scheduler != NULL && vm->green_remaining < ticks) {
+    ticks = vm->green_remaining;
+  }
+  if (owner->slice_budget != 0 && owner->slice_remaining < ticks) {
+    ticks = owner->slice_remaining;
+  }
+  if (owner->slice_deadline != 0 && ticks > 1024) {
+    ticks = 1024;
+  }
+  vm->slice_ticks = ticks;
+  return ticks;
+}
+
+// Charges the ticks used since StartSlice(), |ticks| being the ones left, to
+// the slice. Called whenever RunVM() stops before the ticks are used up.
+void ChargeSlice(struct VM* vm, size_t ticks) {
+  struct VM* owner = GetSliceOwner(vm);
+  if (owner->slice_budget != 0) {
+    owner->slice_remaining -= vm->slice_ticks - ticks;
+  }
+  vm->slice_ticks = ticks;
+}
+
+// Accounts for the ticks used since StartSlice() when the limits change in the
+// middle of a slice, and starts a new one.
+size_t ResumeSlice(struct VM* vm, size_t ticks) {
+  ChargeSlice(vm, ticks);
+  return StartSlice(vm);
+}
+
+// Returns whether the budget or the time of the slice of |vm| ran out.
+bool IsSliceOver(struct VM* vm) {
+  struct VM* owner = GetSliceOwner(vm);
+  return (owner->slice_budget != 0 && owner->slice_remaining == 0) ||
+         (owner->slice_deadline != 0 && CurrentTime() >= owner->slice_deadline);
+}
+
+// Called when the ticks of a slice are used up. Returns the status RunVM()
+// stops with, or 0 to continue.
+int EndSlice(struct VM* vm) {
+  if (vm->scheduler != NULL) {
+    vm->green_remaining -= vm->slice_ticks;
+  }
+  ChargeSlice(vm, 0);
+  if (IsSliceOver(vm)) {
+    return VM_PREEMPTED;
+  }
+  if (vm->scheduler != NULL && vm->green_remaining == 0) {
+    return VM_YIELDED;
+  }
+  return 0;
+}
+
+// Frees the green threads of |vm| that have not finished, for a VM that was
+// preempted and is not resumed.
+void DiscardGreenThreads(struct VM* vm) {
+  struct Scheduler* scheduler = vm->scheduler;
+  if (scheduler == NULL || scheduler->owner != vm) {
+    return;
+  }
+  // Requests of discarded threads may still write into their buffers.
+  DrainRing(vm->ring);
+  for (size_t i = 0; i < scheduler->count; i++) {
+    if (scheduler->threads[i].context != vm) {
+      MergeContext(vm, scheduler->threads[i].context);
+    }
+  }
+#ifdef AQ_EVENTS
+  for (size_t i = 0; i < scheduler->parked_count; i++) {
+    if (scheduler->parked[i]->thread.context != vm) {
+      MergeContext(vm, scheduler->parked[i]->thread.context);
+    }
+  }
+#endif
+  FreeScheduler(scheduler);
+  vm->scheduler = NULL;
+}
+
+// Returns -1 without starting the thread if memory runs out.
+int GREEN(struct VM* vm, size_t priority, size_t body, size_t arg_count,
+          size_t* args) {
+  struct Scheduler* scheduler = vm->scheduler;
+  if (scheduler == NULL) {
+    scheduler = (struct Scheduler*)calloc(1, sizeof(struct Scheduler));
+    if (scheduler == NULL) {
+      return -1;
+    }
+    scheduler->owner = vm;
+    scheduler->policy = vm->schedule_policy;
+    scheduler->budget = vm->schedule_budget;
+    scheduler->epoll_fd = -1;
+    scheduler->timer_fd = -1;
+  }
+  // Room for every thread, parked ones included, and the owner.
+  struct VM* context =
+      ReserveGreenThreads(scheduler,
+                          scheduler->count + scheduler->parked_count + 2)
+          ? CreateTaskContext(vm, arg_count, args)
+          : NULL;
+  if (context == NULL) {
+    if (vm->scheduler == NULL) {
+      FreeScheduler(scheduler);
+    }
+    return -1;
+  }
+  vm->scheduler = scheduler;
+  context->scheduler = scheduler;
+  context->pc = (void*)((uintptr_t)vm->run_code + GetLongData(vm, body));
+  PushGreenThread(scheduler, context, GetLongData(vm, priority));
+  return 0;
+}
+
+// Runs |vm| and, if it started green threads, every one of them to
+// completion. |vm| itself takes part in the scheduling as one more thread.
+//
+// With a time slice set, returns VM_PREEMPTED once the slice of |vm| runs out,
+// leaving every thread resumable by the next call.
+int RunVMThreads(struct VM* vm) {
+  vm->slice_remaining = vm->slice_budget;
+  vm->slice_deadline = vm->slice_time != 0 ? CurrentTime() + vm->slice_time : 0;
+  struct Scheduler* scheduler = vm->scheduler;
+  if (scheduler == NULL || !scheduler->started) {
+    int status = RunVM(vm);
+    scheduler = vm->scheduler;
+    if (scheduler == NULL || scheduler->owner != vm) {
+      return status;
+    }
+    scheduler->started = true;
+    if (status != 0) {
+      PushGreenThread(scheduler, vm, 0);
+    }
+    if (status == VM_PREEMPTED) {
+      return status;
+    }
+  }
+
+  // Counts threads in a row that could not make progress, so the scheduler
+  // sleeps instead of spinning once every thread is blocked.
+  size_t stalled = 0;
+  long long wake = 0;
+  // Threads run since the event loop was last polled.
+  size_t turns = 0;
+  while (scheduler->count > 0 || scheduler->parked_count > 0) {
+    if (IsSliceOver(vm)) {
+      return VM_PREEMPTED;
+    }
+    if (scheduler->count == 0) {
+      WaitEvents(scheduler, vm->slice_deadline != 0 ? vm->slice_deadline : -1);
+      continue;
+    }
+    if (scheduler->parked_count > 0 && ++turns > scheduler->count) {
+      WaitEvents(scheduler, 0);
+      turns = 0;
+    }
+    struct GreenThread thread = PopGreenThread(scheduler);
+    struct VM* context = thread.context;
+    if (context->deadline == 0 || context->deadline <= CurrentTime()) {
+      context->blocked = false;
+      int status = RunVM(context);
+      if (status == VM_PREEMPTED) {
+        PushGreenThread(scheduler, context, thread.priority);
+        return status;
+      }
+      if (status != VM_YIELDED) {
+        if (context != vm) {
+          MergeContext(vm, context);
+        }
+        stalled = 0;
+        continue;
+      }
+      if (context->blocked && ParkGreenThread(scheduler, thread)) {
+        continue;
+      }
+    }
+    if (!context->blocked) {
+      stalled = 0;
+    } else if (++stalled > scheduler->count) {
+      if (wake != 0 && vm->slice_deadline != 0 && vm->slice_deadline < wake) {
+        wake = vm->slice_deadline;
+      }
+      WaitEvents(scheduler, wake);
+      stalled = 0;
+      wake = 0;
+    }
+    if (context->deadline != 0 && (wake == 0 || context->deadline < wake)) {
+      wake = context->deadline;
+    }
+    PushGreenThread(scheduler, context, thread.priority);
+  }
+
+  FreeScheduler(scheduler);
+  vm->scheduler = NULL;
+  return 0;
+}
+
+// The atomic opcodes operate on the int or long that a pointer slot points
+// to, normally a NEW block shared between tasks. Values keep the byte order
+// STORE writes, so plain and atomic accesses to a block can be mixed. The
+// width comes from the type of the value operand; slots that receive the old
+// value must be an int or long of the same width.
+size_t GetAtomicSize(struct VM* vm, size_t index) {
+  switch (GetType(vm->memory, index)) {
+    case 0x02:
+    case 0x09:
+      return 4;
+    case 0x03:
+    case 0x0A:
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+uint64_t ReadSlotBits(struct VM* vm, size_t index, size_t size) {
+  void* slot = (void*)((uintptr_t)vm->memory->data + index);
+  if (size == 4) {
+    uint32_t bits;
+    memcpy(&bits, slot, 4);
+    return bits;
+  }
+  uint64_t bits;
+  memcpy(&bits, slot, 8);
+  return bits;
+}
+
+void WriteSlotBits(struct VM* vm, size_t index, size_t size, uint64_t bits) {
+  void* slot = (void*)((uintptr_t)vm->memory->data + index);
+  if (size == 4) {
+    uint32_t narrow = (uint32_t)bits;
+    memcpy(slot, &narrow, 4);
+  } else {
+    memcpy(slot, &bits, 8);
+  }
+}
+
+uint64_t AtomicLoad(void* address, size_t size) {
+#ifdef AQ_THREADS
+  if (size == 4) {
+    return atomic_load_explicit((_Atomic(uint32_t)*)address,
+                                memory_order_acquire);
+  }
+  return atomic_load_explicit((_Atomic(uint64_t)*)address,
+                              memory_order_acquire);
+#else
+  return size == 4 ? *(uint32_t*)address : *(uint64_t*)address;
+#endif
+}
+
+void AtomicStore(void* address, size_t size, uint64_t bits) {
+#ifdef AQ_THREADS
+  if (size == 4) {
+    atomic_store_explicit((_Atomic(uint32_t)*)address, (uint32_t)bits,
+                          memory_order_release);
+  } else {
+    atomic_store_explicit((_Atomic(uint64_t)*)address, bits,
+                          memory_order_release);
+  }
+#else
+  if (size == 4) {
+    *(uint32_t*)address = (uint32_t)bits;
+  } else {
+    *(uint64_t*)address = bits;
+  }
+#endif
+}
+
+uint64_t AtomicExchange(void* address, size_t size, uint64_t bits) {
+#ifdef AQ_THREADS
+  if (size == 4) {
+    return atomic_exchange((_Atomic(uint32_t)*)address, (uint32_t)bits);
+  }
+  return atomic_exchange((_Atomic(uint64_t)*)address, bits);
+#else
+  uint64_t old = AtomicLoad(address, size);
+  AtomicStore(address, size, bits);
+  return old;
+#endif
+}
+
+bool AtomicCompareExchange(void* address, size_t size, uint64_t* expected,
+                           uint64_t desired) {
+#ifdef AQ_THREADS
+  if (size == 4) {
+    uint32_t narrow = (uint32_t)*expected;
+    bool exchanged = atomic_compare_exchange_strong(
+        (_Atomic(uint32_t)*)address, &narrow, (uint32_t)desired);
+    *expected = narrow;
+    return exchanged;
+  }
+  return atomic_compare_exchange_strong((_Atomic(uint64_t)*)address, expected,
+                                        desired);
+#else
+  uint64_t old = AtomicLoad(address, size);
+  if (old != *expected) {
+    *expected = old;
+    return false;
+  }
+  AtomicStore(address, size, desired);
+  return true;
+#endif
+}
+
+// Adds |delta| to the stored representation |bits| of an int or long.
+uint64_t AddBits(struct VM* vm, uint64_t bits, size_t size, long delta) {
+  if (size == 4) {
+    int value = vm->is_big_endian ? (int)bits : SwapInt((int)bits);
+    value = (int)((uint32_t)value + (uint32_t)delta);
+    return (uint32_t)(vm->is_big_endian ? value : SwapInt(value));
+  }
+  long value = vm->is_big_endian ? (long)bits : SwapLong((long)bits);
+  value = (long)((uint64_t)value + (uint64_t)delta);
+  return (uint64_t)(vm->is_big_endian ? value : SwapLong(value));
+}
+
+int ATOMIC_ADD(struct VM* vm, size_t result, size_t ptr, size_t operand) {
+  size_t size = GetAtomicSize(vm, operand);
+  void* address = GetPtrData(vm, ptr);
+  if (size == 0 || GetAtomicSize(vm, result) != size || address == NULL) {
+    return -1;
+  }
+  long delta = GetLongData(vm, operand);
+  uint64_t old = AtomicLoad(address, size);
+  while (!AtomicCompareExchange(address, size, &old,
+                                AddBits(vm, old, size, delta))) {
+  }
+  WriteSlotBits(vm, result, size, old);
+  return 0;
+}
+
+// Stores 1 in |result| if the value equaled |expected| and was replaced by
+// |desired|. Otherwise stores 0 and loads the current value into |expected|.
+int CAS(struct VM* vm, size_t result, size_t ptr, size_t expected,
+        size_t desired) {
+  size_t size = GetAtomicSize(vm, expected);
+  void* address = GetPtrData(vm, ptr);
+  if (size == 0 || GetAtomicSize(vm, desired) != size || address == NULL) {
+    return -1;
+  }
+  uint64_t bits = ReadSlotBits(vm, expected, size);
+  bool exchanged = AtomicCompareExchange(address, size, &bits,
+                                         ReadSlotBits(vm, desired, size));
+  if (!exchanged) {
+    WriteSlotBits(vm, expected, size, bits);
+  }
+  SetByteData(vm, result, exchanged);
+  return 0;
+}
+
+int XCHG(struct VM* vm, size_t result, size_t ptr, size_t operand) {
+  size_t size = GetAtomicSize(vm, operand);
+  void* address = GetPtrData(vm, ptr);
+  if (size == 0 || GetAtomicSize(vm, result) != size || address == NULL) {
+    return -1;
+  }
+  WriteSlotBits(vm, result, size,
+                AtomicExchange(address, size, ReadSlotBits(vm, operand, size)));
+  return 0;
+}
+
+int LOAD_ACQUIRE(struct VM* vm, size_t result, size_t ptr) {
+  size_t size = GetAtomicSize(vm, result);
+  void* address = GetPtrData(vm, ptr);
+  if (size == 0 || address == NULL) {
+    return -1;
+  }
+  WriteSlotBits(vm, result, size, AtomicLoad(address, size));
+  return 0;
+}
+
+int STORE_RELEASE(struct VM* vm, size_t ptr, size_t operand) {
+  size_t size = GetAtomicSize(vm, operand);
+  void* address = GetPtrData(vm, ptr);
+  if (size == 0 || address == NULL) {
+    return -1;
+  }
+  AtomicStore(address, size, ReadSlotBits(vm, operand, size));
+  return 0;
+}
+
+int FENCE() {
+#ifdef AQ_THREADS
+  atomic_thread_fence(memory_order_seq_cst);
+#endif
+  return 0;
+}
+
+// The bit opcodes work on the width of the operand's slot: 8 bits for byte,
+// 32 for int and 64 for long. GCC and Clang turn the builtins and rotate
+// idiom into single instructions. POPCNT is chosen at run time on x86 since
+// it is not part of the baseline instruction set.
+static bool popcnt_hardware = false;
+
+void InitializeBitOperations(void) {
+#ifdef AQ_POPCNT
+  unsigned int eax, ebx, ecx, edx;
+  popcnt_hardware =
+      __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_POPCNT) != 0;
+#endif
+}
+
+int GetBitWidth(struct VM* vm, size_t index) {
+  return GetIntegerWidth(GetType(vm->memory, index));
+}
+
+// Returns the bits of an integer slot of |width| bits, zero-extended.
+uint64_t GetBits(struct VM* vm, size_t index, int width) {
+  uint64_t bits = (uint64_t)GetLongData(vm, index);
+  return width == 64 ? bits : bits & (((uint64_t)1 << width) - 1);
+}
+
+// Stores |bits| of |width| bits into |result| as a value of the type of
+// |source|, converted to the type of |result|.
+void SetBits(struct VM* vm, size_t result, size_t source, int width,
+             uint64_t bits) {
+  bool is_unsigned = IsUnsignedType(GetType(vm->memory, source));
+  SetIntegerData(vm, result, NormalizeInteger(bits, width, is_unsigned),
+                 is_unsigned);
+}
+
+#ifdef AQ_POPCNT
+__attribute__((target("popcnt"))) int PopCountHardware(uint64_t bits) {
+  return __builtin_popcountll(bits);
+}
+#endif
+
+int PopCount(uint64_t bits) {
+#ifdef AQ_POPCNT
+  if (popcnt_hardware) {
+    return PopCountHardware(bits);
+  }
+#endif
+#ifdef __GNUC__
+  return __builtin_popcountll(bits);
+#else
+  bits = bits - ((bits >> 1) & 0x5555555555555555ull);
+  bits = (bits & 0x3333333333333333ull) + ((bits >> 2) & 0x3333333333333333ull);
+  bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+  return (int)((bits * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+// |bits| must not be 0.
+int CountLeadingZeros(uint64_t bits) {
+#ifdef __GNUC__
+  return __builtin_clzll(bits);
+#else
+  int count = 0;
+  for (int shift = 32; shift > 0; shift >>= 1) {
+    if ((bits >> (64 - shift)) == 0) {
+      count += shift;
+      bits <<= shift;
+    }
+  }
+  return count;
+#endif
+}
+
+// |bits| must not be 0.
+int CountTrailingZeros(uint64_t bits) {
+#ifdef __GNUC__
+  return __builtin_ctzll(bits);
+#else
+  int count = 0;
+  for (int shift = 32; shift > 0; shift >>= 1) {
+    if ((bits & (((uint64_t)1 << shift) - 1)) == 0) {
+      count += shift;
+      bits >>= shift;
+    }
+  }
+  return count;
+#endif
+}
+
+uint64_t SwapBytes(uint64_t bits, int width) {
+  switch (width) {
+    case 16:
+      return (uint16_t)SwapShort((int16_t)bits);
+    case 32:
+#ifdef __GNUC__
+      return __builtin_bswap32((uint32_t)bits);
+#else
+      return (uint32_t)SwapInt((int)(uint32_t)bits);
+#endif
+    case 64:
+#ifdef __GNUC__
+      return __builtin_bswap64(bits);
+#else
+      return SwapUint64t(bits);
+#endif
+    default:
+      return bits;
+  }
+}
+
+// Rotates the low |width| bits of |bits| left by |count| modulo |width|.
+uint64_t RotateLeft(uint64_t bits, int width, long count) {
+  unsigned int shift = (unsigned int)count & (width - 1);
+  switch (width) {
+    case 8: {
+      uint8_t value = (uint8_t)bits;
+      return (uint8_t)(value << shift | value >> (-shift & 7));
+    }
+    case 16: {
+      uint16_t value = (uint16_t)bits;
+      return (uint16_t)(value << shift | value >> (-shift & 15));
+    }
+    case 32: {
+      uint32_t value = (uint32_t)bits;
+      return (uint32_t)(value << shift | value >> (-shift & 31));
+    }
+    default:
+      return bits << shift | bits >> (-shift & 63);
+  }
+}
+
+int POPCNT(struct VM* vm, size_t result, size_t operand1) {
+  int width = GetBitWidth(vm, operand1);
+  if (width == 0) {
+    return -1;
+  }
+  SetLongData(vm, result, PopCount(GetBits(vm, operand1, width)));
+  return 0;
+}
+
+// CLZ and CTZ give the operand width for 0.
+int CLZ(struct VM* vm, size_t result, size_t operand1) {
+  int width = GetBitWidth(vm, operand1);
+  if (width == 0) {
+    return -1;
+  }
+  uint64_t bits = GetBits(vm, operand1, width);
+  SetLongData(vm, result,
+              bits == 0 ? width : CountLeadingZeros(bits) - (64 - width));
+  return 0;
+}
+
+int CTZ(struct VM* vm, size_t result, size_t operand1) {
+  int width = GetBitWidth(vm, operand1);
+  if (width == 0) {
+    return -1;
+  }
+  uint64_t bits = GetBits(vm, operand1, width);
+  SetLongData(vm, result, bits == 0 ? width : CountTrailingZeros(bits));
+  return 0;
+}
+
+int BSWAP(struct VM* vm, size_t result, size_t operand1) {
+  int width = GetBitWidth(vm, operand1);
+  if (width == 0) {
+    return -1;
+  }
+  SetBits(vm, result, operand1, width,
+          SwapBytes(GetBits(vm, operand1, width), width));
+  return 0;
+}
+
+int ROTL(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  int width = GetBitWidth(vm, operand1);
+  if (width == 0) {
+    return -1;
+  }
+  SetBits(vm, result, operand1, width,
+          RotateLeft(GetBits(vm, operand1, width), width,
+                     GetLongData(vm, operand2)));
+  return 0;
+}
+
+int ROTR(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  int width = GetBitWidth(vm, operand1);
+  if (width == 0) {
+    return -1;
+  }
+  SetBits(vm, result, operand1, width,
+          RotateLeft(GetBits(vm, operand1, width), width,
+                     -GetLongData(vm, operand2)));
+  return 0;
+}
+
+// The math opcodes compute in double when the result or an operand is a
+// double, in float when one is a float and in long otherwise, or unsigned long
+// when one is an unsigned long, and convert the value to the result type like
+// the arithmetic opcodes. On x86, FMA and
+// SSE4.1 rounding are not part of the baseline and are chosen at run time.
+static bool fma_hardware = false;
+static bool round_hardware = false;
+
+void InitializeMathOperations(void) {
+#ifdef AQ_FMA
+  // FMA needs the OS to save the AVX registers, which cpuid alone does not
+  // tell.
+  __builtin_cpu_init();
+  fma_hardware = __builtin_cpu_supports("fma");
+  round_hardware = __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+uint8_t GetMathType(struct VM* vm, size_t result, size_t operand1,
+                    size_t operand2, size_t operand3) {
+  uint8_t types[4] = {
+      GetType(vm->memory, result), GetType(vm->memory, operand1),
+      GetType(vm->memory, operand2), GetType(vm->memory, operand3)};
+  uint8_t type = 0x03;
+  for (int i = 0; i < 4; i++) {
+    if (types[i] == 0x05) {
+      return 0x05;
+    } else if (types[i] == 0x04) {
+      type = 0x04;
+    } else if (types[i] == 0x0A && type == 0x03) {
+      type = 0x0A;
+    }
+  }
+  return type;
+}
+
+#ifdef AQ_FMA
+__attribute__((target("fma"))) double FusedMultiplyAddHardware(double a,
+                                                               double b,
+                                                               double c) {
+  return __builtin_fma(a, b, c);
+}
+
+__attribute__((target("fma"))) float FusedMultiplyAddFloatHardware(float a,
+                                                                   float b,
+                                                                   float c) {
+  return __builtin_fmaf(a, b, c);
+}
+#endif
+
+double FusedMultiplyAdd(double a, double b, double c) {
+#ifdef AQ_FMA
+  if (fma_hardware) {
+    return FusedMultiplyAddHardware(a, b, c);
+  }
+#endif
+  return fma(a, b, c);
+}
+
+float FusedMultiplyAddFloat(float a, float b, float c) {
+#ifdef AQ_FMA
+  if (fma_hardware) {
+    return FusedMultiplyAddFloatHardware(a, b, c);
+  }
+#endif
+  return fmaf(a, b, c);
+}
+
+#ifdef AQ_SSE41
+__attribute__((target("sse4.1"))) double RoundHardware(double x, bool up) {
+  return up ? __builtin_ceil(x) : __builtin_floor(x);
+}
+#endif
+
+// Rounds toward negative infinity, or positive infinity when |up| is set.
+// Floats are rounded as doubles, which is exact.
+double RoundDouble(double x, bool up) {
+#ifdef AQ_SSE41
+  if (round_hardware) {
+    return RoundHardware(x, up);
+  }
+#endif
+  return up ? ceil(x) : floor(x);
+}
+
+// FMA result, operand1, operand2, operand3 computes operand1 * operand2 +
+// operand3 with a single rounding.
+int FMA(struct VM* vm, size_t result, size_t operand1, size_t operand2,
+        size_t operand3) {
+  switch (GetMathType(vm, result, operand1, operand2, operand3)) {
+    case 0x05:
+      SetDoubleData(vm, result,
+                    FusedMultiplyAdd(GetDoubleData(vm, operand1),
+                                     GetDoubleData(vm, operand2),
+                                     GetDoubleData(vm, operand3)));
+      break;
+    case 0x04:
+      SetFloatData(vm, result,
+                   FusedMultiplyAddFloat(GetFloatData(vm, operand1),
+                                         GetFloatData(vm, operand2),
+                                         GetFloatData(vm, operand3)));
+      break;
+    default:
+      SetLongData(vm, result,
+                  (long)((uint64_t)GetLongData(vm, operand1) *
+                             (uint64_t)GetLongData(vm, operand2) +
+                         (uint64_t)GetLongData(vm, operand3)));
+      break;
+  }
+  return 0;
+}
+
+int SQRT(struct VM* vm, size_t result, size_t operand1) {
+  if (GetMathType(vm, result, operand1, operand1, operand1) == 0x04) {
+    SetFloatData(vm, result, (float)sqrt(GetFloatData(vm, operand1)));
+  } else {
+    SetDoubleData(vm, result, sqrt(GetDoubleData(vm, operand1)));
+  }
+  return 0;
+}
+
+// MIN and MAX return operand2 when either operand is NaN, like the SSE
+// instructions they compile to.
+int MIN(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  switch (GetMathType(vm, result, operand1, operand2, operand2)) {
+    case 0x05: {
+      double a = GetDoubleData(vm, operand1), b = GetDoubleData(vm, operand2);
+      SetDoubleData(vm, result, a < b ? a : b);
+      break;
+    }
+    case 0x04: {
+      float a = GetFloatData(vm, operand1), b = GetFloatData(vm, operand2);
+      SetFloatData(vm, result, a < b ? a : b);
+      break;
+    }
+    case 0x0A: {
+      uint64_t a = GetIntegerData(vm, operand1);
+      uint64_t b = GetIntegerData(vm, operand2);
+      SetIntegerData(vm, result, a < b ? a : b, true);
+      break;
+    }
+    default: {
+      long a = GetLongData(vm, operand1), b = GetLongData(vm, operand2);
+      SetLongData(vm, result, a < b ? a : b);
+      break;
+    }
+  }
+  return 0;
+}
+
+int MAX(struct VM* vm, size_t result, size_t operand1, size_t operand2) {
+  switch (GetMathType(vm, result, operand1, operand2, operand2)) {
+    case 0x05: {
+      double a = GetDoubleData(vm, operand1), b = GetDoubleData(vm, operand2);
+      SetDoubleData(vm, result, a > b ? a : b);
+      break;
+    }
+    case 0x04: {
+      float a = GetFloatData(vm, operand1), b = GetFloatData(vm, operand2);
+      SetFloatData(vm, result, a > b ? a : b);
+      break;
+    }
+    case 0x0A: {
+      uint64_t a = GetIntegerData(vm, operand1);
+      uint64_t b = GetIntegerData(vm, operand2);
+      SetIntegerData(vm, result, a > b ? a : b, true);
+      break;
+    }
+    default: {
+      long a = GetLongData(vm, operand1), b = GetLongData(vm, operand2);
+      SetLongData(vm, result, a > b ? a : b);
+      break;
+    }
+  }
+  return 0;
+}
+
+int ABS(struct VM* vm, size_t result, size_t operand1) {
+  switch (GetMathType(vm, result, operand1, operand1, operand1)) {
+    case 0x05:
+      SetDoubleData(vm, result, fabs(GetDoubleData(vm, operand1)));
+      break;
+    case 0x04:
+      SetFloatData(vm, result, fabsf(GetFloatData(vm, operand1)));
+      break;
+    case 0x0A: {
+      uint64_t value = GetIntegerData(vm, operand1);
+      if (!IsUnsignedType(GetType(vm->memory, operand1)) && value >> 63) {
+        value = 0 - value;
+      }
+      SetIntegerData(vm, result, value, true);
+      break;
+    }
+    default: {
+      uint64_t value = (uint64_t)GetLongData(vm, operand1);
+      SetLongData(vm, result, (long)(value >> 63 ? 0 - value : value));
+      break;
+    }
+  }
+  return 0;
+}
+
+int FLOOR(struct VM* vm, size_t result, size_t operand1) {
+  switch (GetMathType(vm, result, operand1, operand1, operand1)) {
+    case 0x05:
+      SetDoubleData(vm, result,
+                    RoundDouble(GetDoubleData(vm, operand1), false));
+      break;
+    case 0x04:
+      SetFloatData(vm, result,
+                   (float)RoundDouble(GetFloatData(vm, operand1), false));
+      break;
+    default:
+      SetIntegerData(vm, result, GetIntegerData(vm, operand1),
+                     IsUnsignedType(GetType(vm->memory, operand1)));
+      break;
+  }
+  return 0;
+}
+
+int CEIL(struct VM* vm, size_t result, size_t operand1) {
+  switch (GetMathType(vm, result, operand1, operand1, operand1)) {
+    case 0x05:
+      SetDoubleData(vm, result, RoundDouble(GetDoubleData(vm, operand1), true));
+      break;
+    case 0x04:
+      SetFloatData(vm, result,
+                   (float)RoundDouble(GetFloatData(vm, operand1), true));
+      break;
+    default:
+      SetIntegerData(vm, result, GetIntegerData(vm, operand1),
+                     IsUnsignedType(GetType(vm->memory, operand1)));
+      break;
+  }
+  return 0;
+}
+
+// ADD_CHECKED, SUB_CHECKED and MUL_CHECKED take a fourth operand, a long slot
+// holding a handler offset like GOTO. They compute in the integer type of the
+// result and branch to the handler, with the wrapped value stored, when an
+// operand does not fit in that type or the result overflows it. With a float
+// or double operand they compute in double, as C would, and overflow when the
+// result truncated toward zero does not fit. Float and double results never
+// overflow.
+
+// Whether |value|, unsigned if |value_unsigned|, converts exactly to an
+// integer of |width| bits.
+bool FitsInteger(uint64_t value, bool value_unsigned, int width,
+                 bool is_unsigned) {
+  if (value >> 63 != 0 && (value_unsigned || (is_unsigned && width == 64))) {
+    return value_unsigned && is_unsigned && width == 64;
+  }
+  return NormalizeInteger(value, width, is_unsigned) == value;
+}
+
+// Stores |a| |operation| |b| wrapped to 64 bits in |value| and returns whether
+// it overflowed the signed or unsigned 64-bit range.
+bool CheckedOperation(uint8_t operation, uint64_t a, uint64_t b,
+                      bool is_unsigned, uint64_t* value) {
+#ifdef __GNUC__
+  if (is_unsigned) {
+    switch (operation) {
+      case 0x06:
+        return __builtin_add_overflow(a, b, value);
+      case 0x07:
+        return __builtin_sub_overflow(a, b, value);
+      default:
+        return __builtin_mul_overflow(a, b, value);
+    }
+  }
+  int64_t signed_value;
+  bool overflow;
+  switch (operation) {
+    case 0x06:
+      overflow = __builtin_add_overflow((int64_t)a, (int64_t)b, &signed_value);
+      break;
+    case 0x07:
+      overflow = __builtin_sub_overflow((int64_t)a, (int64_t)b, &signed_value);
+      break;
+    default:
+      overflow = __builtin_mul_overflow((int64_t)a, (int64_t)b, &signed_value);
+      break;
+  }
+  *value = (uint64_t)signed_value;
+  return overflow;
+#else
+  switch (operation) {
+    case 0x06:
+      *value = a + b;
+      return is_unsigned ? *value < a : ((~(a ^ b) & (a ^ *value)) >> 63) != 0;
+    case 0x07:
+      *value = a - b;
+      return is_unsigned ? a < b : (((a ^ b) & (a ^ *value)) >> 63) != 0;
+    default:
+      *value = a * b;
+      if (a == 0 || b == 0) {
+        return false;
+      } else if (is_unsigned) {
+        return *value / a != b;
+      } else if ((int64_t)b == -1) {
+        return a == (uint64_t)INT64_MIN;
+      }
+      return (int64_t)*value / (int64_t)b != (int64_t)a;
+  }
+#endif
+}
+
+// Stores |value| truncated toward zero and wrapped to 64 bits in |bits| and
+// returns whether it fits in an integer of |width| bits. NaN stores 0.
+bool TruncateDouble(double value, int width, bool is_unsigned,
+                    uint64_t* bits) {
+  double truncated = trunc(value);
+  double limit = ldexp(1.0, is_unsigned ? width : width - 1);
+  if (truncated >= (is_unsigned ? 0.0 : -limit) && truncated < limit) {
+    *bits = DoubleToInteger(truncated);
+    return true;
+  }
+  double wrapped = fmod(truncated, 18446744073709551616.0);
+  if (isnan(wrapped)) {
+    *bits = 0;
+  } else {
+    *bits = wrapped < 0 ? -(uint64_t)-wrapped : (uint64_t)wrapped;
+  }
+  return false;
+}
+
+// Returns whether |operation| overflowed the type of |result|.
+bool CheckedArithmetic(struct VM* vm, uint8_t operation, size_t result,
+                       size_t operand1, size_t operand2) {
+  uint8_t type = GetType(vm->memory, result);
+  int width = GetIntegerWidth(type);
+  if (width == 0) {
+    if (operation == 0x06) {
+      ADD(vm, result, operand1, operand2);
+    } else if (operation == 0x07) {
+      SUB(vm, result, operand1, operand2);
+    } else {
+      MUL(vm, result, operand1, operand2);
+    }
+    return false;
+  }
+  bool is_unsigned = IsUnsignedType(type);
+  if (GetIntegerWidth(GetType(vm->memory, operand1)) == 0 ||
+      GetIntegerWidth(GetType(vm->memory, operand2)) == 0) {
+    double a = GetDoubleData(vm, operand1), b = GetDoubleData(vm, operand2);
+    double value = operation == 0x06   ? a + b
+                   : operation == 0x07 ? a - b
+                                       : a * b;
+    uint64_t bits;
+    bool overflow = !TruncateDouble(value, width, is_unsigned, &bits);
+    SetIntegerData(vm, result, bits, is_unsigned);
+    return overflow;
+  }
+  uint64_t a = GetIntegerData(vm, operand1);
+  uint64_t b = GetIntegerData(vm, operand2);
+  bool overflow =
+      !FitsInteger(a, IsUnsignedType(GetType(vm->memory, operand1)), width,
+                   is_unsigned) ||
+      !FitsInteger(b, IsUnsignedType(GetType(vm->memory, operand2)), width,
+                   is_unsigned);
+  uint64_t value;
+  overflow |= CheckedOperation(operation, a, b, is_unsigned, &value);
+  overflow |= NormalizeInteger(value, width, is_unsigned) != value;
+  SetIntegerData(vm, result, value, is_unsigned);
+  return overflow;
+}
+
+void* ADD_CHECKED(struct VM* vm, void* pc, size_t result, size_t operand1,
+                  size_t operand2, size_t handler) {
+  return CheckedArithmetic(vm, 0x06, result, operand1, operand2)
+             ? GOTO(vm, vm->run_code, handler)
+             : pc;
+}
+
+void* SUB_CHECKED(struct VM* vm, void* pc, size_t result, size_t operand1,
+                  size_t operand2, size_t handler) {
+  return CheckedArithmetic(vm, 0x07, result, operand1, operand2)
+             ? GOTO(vm, vm->run_code, handler)
+             : pc;
+}
+
+void* MUL_CHECKED(struct VM* vm, void* pc, size_t result, size_t operand1,
+                  size_t operand2, size_t handler) {
+  return CheckedArithmetic(vm, 0x08, result, operand1, operand2)
+             ? GOTO(vm, vm->run_code, handler)
+             : pc;
+}
+
+#ifdef AQ_THREADS
+struct ChannelCell {
+  atomic_size_t sequence;
+  uint64_t value;
+  // The value is a NEW block whose ownership moves to the receiving VM.
+  bool block;
+};
+
+// Bounded lock-free ring buffer carrying slot values of one type between VMs.
+// Multi-producer multi-consumer channels use per-cell sequence numbers;
+// single-producer single-consumer channels only publish the head and tail.
+struct Channel {
+  // Keeps producers and consumers off each other's cache line.
+  atomic_size_t head;
+  char head_padding[64 - sizeof(atomic_size_t)];
+  atomic_size_t tail;
+  char tail_padding[64 - sizeof(atomic_size_t)];
+  size_t mask;
+  bool single;
+  atomic_bool closed;
+  uint8_t type;
+  size_t size;
+  // The root VM an unnamed channel is confined to, NULL for named channels.
+  struct VM* owner;
+  char* name;
+  struct Channel* next;
+  struct ChannelCell cells[];
+};
+
+struct Channel* named_channels = NULL;
+pthread_mutex_t named_channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define MAX_CHANNEL_CAPACITY (1L << 24)
+
+size_t GetChannelSize(size_t capacity) {
+  size_t count = 1;
+  while (count < capacity) {
+    count *= 2;
+  }
+  return sizeof(struct Channel) + count * sizeof(struct ChannelCell);
+}
+
+void InitializeChannel(struct Channel* channel, size_t capacity, bool single,
+                       uint8_t type, size_t size) {
+  size_t count = 1;
+  while (count < capacity) {
+    count *= 2;
+  }
+  atomic_init(&channel->head, 0);
+  atomic_init(&channel->tail, 0);
+  channel->mask = count - 1;
+  channel->single = single;
+  atomic_init(&channel->closed, false);
+  channel->type = type;
+  channel->size = size;
+  channel->owner = NULL;
+  channel->name = NULL;
+  channel->next = NULL;
+  for (size_t i = 0; i < count; i++) {
+    atomic_init(&channel->cells[i].sequence, i);
+  }
+}
+
+bool PushChannel(struct Channel* channel, uint64_t value, bool block) {
+  struct ChannelCell* cell;
+  size_t position = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+  if (channel->single) {
+    if (position - atomic_load_explicit(&channel->head, memory_order_acquire) >
+        channel->mask) {
+      return false;
+    }
+    cell = &channel->cells[position & channel->mask];
+    cell->value = value;
+    cell->block = block;
+    atomic_store_explicit(&channel->tail, position + 1, memory_order_release);
+    return true;
+  }
+
+  while (true) {
+    cell = &channel->cells[position & channel->mask];
+    size_t sequence =
+        atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    if (sequence == position) {
+      if (atomic_compare_exchange_weak_explicit(&channel->tail, &position,
+                                                position + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if ((ptrdiff_t)(sequence - position) < 0) {
+      return false;
+    } else {
+      position = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    }
+  }
+  cell->value = value;
+  cell->block = block;
+  atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+  return true;
+}
+
+bool PopChannel(struct Channel* channel, uint64_t* value, bool* block) {
+  struct ChannelCell* cell;
+  size_t position = atomic_load_explicit(&channel->head, memory_order_relaxed);
+  if (channel->single) {
+    if (position ==
+        atomic_load_explicit(&channel->tail, memory_order_acquire)) {
+      return false;
+    }
+    cell = &channel->cells[position & channel->mask];
+    *value = cell->value;
+    *block = cell->block;
+    atomic_store_explicit(&channel->head, position + 1, memory_order_release);
+    return true;
+  }
+
+  while (true) {
+    cell = &channel->cells[position & channel->mask];
+    size_t sequence =
+        atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    if (sequence == position + 1) {
+      if (atomic_compare_exchange_weak_explicit(&channel->head, &position,
+                                                position + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if ((ptrdiff_t)(sequence - (position + 1)) < 0) {
+      return false;
+    } else {
+      position = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    }
+  }
+  *value = cell->value;
+  *block = cell->block;
+  atomic_store_explicit(&cell->sequence, position + channel->mask + 1,
+                        memory_order_release);
+  return true;
+}
+
+// Called when a channel operation cannot proceed. Blocks the green thread
+// running |vm| and returns true, or spins on the calling OS thread.
+bool WaitChannel(struct VM* vm, size_t* spins) {
+  if (BlockGreenThread(vm, 0)) {
+    return true;
+  }
+  if (++*spins % 64 == 0) {
+    sched_yield();
+  }
+  return false;
+}
+
+// Returns the channel in the slot |index|, or NULL if the slot is null or
+// holds an unnamed channel of another VM.
+struct Channel* GetChannel(struct VM* vm, size_t index) {
+  struct Channel* channel = (struct Channel*)GetPtrData(vm, index);
+  if (channel == NULL ||
+      (channel->owner != NULL && channel->owner != vm->root)) {
+    return NULL;
+  }
+  return channel;
+}
+
+// channel(capacity, element) and channel_spsc(capacity, element) create a
+// channel that carries values of the type of the |element| slot, or return
+// null if |capacity| is not between 1 and 2^24 or memory runs out. The
+// channel lives on the calling VM's heap and can be released with FREE. It
+// may only be used by that VM and the tasks and green threads it starts; the
+// channel natives fail for any other VM. Separately created VMs connect with
+// channel_open.
+void CreateChannel(struct VM* vm, InternalObject args, size_t return_value,
+                   bool single) {
+  long capacity = GetLongData(vm, args.index[0]);
+  struct Channel* channel = NULL;
+  if (capacity > 0 && capacity <= MAX_CHANNEL_CAPACITY) {
+    channel = (struct Channel*)AllocateHeap(vm, GetChannelSize(capacity));
+  }
+  if (channel != NULL) {
+    InitializeChannel(channel, capacity, single,
+                      GetType(vm->memory, args.index[1]),
+                      GetSlotSize(vm->memory, args.index[1]));
+    channel->owner = vm->root;
+  }
+  SetPtrData(vm, return_value, channel);
+}
+
+void channel(struct VM* vm, InternalObject args, size_t return_value) {
+  CreateChannel(vm, args, return_value, false);
+}
+
+void channel_spsc(struct VM* vm, InternalObject args, size_t return_value) {
+  CreateChannel(vm, args, return_value, true);
+}
+
+// channel_open(name, capacity, element) returns the process-wide channel
+// called |name|, creating it on first use. This is how separately created
+// VMs, such as the jobs of a batch, find each other. Creating it fails like
+// channel does.
+void channel_open(struct VM* vm, InternalObject args, size_t return_value) {
+  const char* name = (const char*)GetPtrData(vm, args.index[0]);
+  pthread_mutex_lock(&named_channels_lock);
+  struct Channel* channel = named_channels;
+  while (channel != NULL && strcmp(channel->name, name) != 0) {
+    channel = channel->next;
+  }
+  long capacity = GetLongData(vm, args.index[1]);
+  if (channel == NULL && capacity > 0 && capacity <= MAX_CHANNEL_CAPACITY) {
+    channel = (struct Channel*)malloc(GetChannelSize(capacity));
+    char* copy = (char*)malloc(strlen(name) + 1);
+    if (channel == NULL || copy == NULL) {
+      free(channel);
+      free(copy);
+      channel = NULL;
+    } else {
+      InitializeChannel(channel, capacity, false,
+                        GetType(vm->memory, args.index[2]),
+                        GetSlotSize(vm->memory, args.index[2]));
+      strcpy(copy, name);
+      channel->name = copy;
+      channel->next = named_channels;
+      named_channels = channel;
+    }
+  }
+  pthread_mutex_unlock(&named_channels_lock);
+  SetPtrData(vm, return_value, channel);
+}
+
+void FreeNamedChannels() {
+  pthread_mutex_lock(&named_channels_lock);
+  while (named_channels != NULL) {
+    struct Channel* next = named_channels->next;
+    free(named_channels->name);
+    free(named_channels);
+    named_channels = next;
+  }
+  pthread_mutex_unlock(&named_channels_lock);
+}
+
+// Returns 0 once the value is queued, or -1 if the channel is closed or the
+// value does not have the channel's type.
+int SendChannel(struct VM* vm, struct Channel* channel, uint64_t value,
+                bool block) {
+  size_t spins = 0;
+  while (!atomic_load(&channel->closed)) {
+    if (PushChannel(channel, value, block)) {
+      return 0;
+    }
+    if (WaitChannel(vm, &spins)) {
+      return 1;
+    }
+  }
+  return -1;
+}
+
+// channel_send(channel, value) copies |value| into the channel.
+void channel_send(struct VM* vm, InternalObject args, size_t return_value) {
+  struct Channel* channel = GetChannel(vm, args.index[0]);
+  uint64_t value = 0;
+  int status = -1;
+  if (channel != NULL && GetType(vm->memory, args.index[1]) == channel->type) {
+    memcpy(&value, (void*)((uintptr_t)vm->memory->data + args.index[1]),
+           channel->size);
+    status = SendChannel(vm, channel, value, false);
+  }
+  if (status != 1) {
+    SetIntData(vm, return_value, status);
+  }
+}
+
+// channel_send_block(channel, block) moves a NEW block to the receiving VM
+// without copying it. The sender must not use the block afterwards.
+void channel_send_block(struct VM* vm, InternalObject args,
+                        size_t return_value) {
+  struct Channel* channel = GetChannel(vm, args.index[0]);
+  void* data = GetPtrData(vm, args.index[1]);
+  uint64_t value = 0;
+  memcpy(&value, &data, sizeof(data));
+  if (channel == NULL || channel->type != 0x00 || data == NULL) {
+    SetIntData(vm, return_value, -1);
+    return;
+  }
+
+  // Unlink first: the receiver links the block into its own heap as soon as
+  // it is queued.
+  struct HeapBlock* block = (struct HeapBlock*)data - 1;
+  block->prev->next = block->next;
+  block->next->prev = block->prev;
+  int status = SendChannel(vm, channel, value, true);
+  if (status != 0) {
+    block->prev = &vm->heap;
+    block->next = vm->heap.next;
+    vm->heap.next->prev = block;
+    vm->heap.next = block;
+  }
+  if (status != 1) {
+    SetIntData(vm, return_value, status);
+  }
+}
+
+// channel_recv(channel) waits for the next value. A closed and drained channel
+// or one the VM may not use yields zero.
+void channel_recv(struct VM* vm, InternalObject args, size_t return_value) {
+  struct Channel* channel = GetChannel(vm, args.index[0]);
+  if (channel == NULL) {
+    SetLongData(vm, return_value, 0);
+    return;
+  }
+  uint64_t value = 0;
+  bool block = false;
+  size_t spins = 0;
+  while (!PopChannel(channel, &value, &block)) {
+    if (atomic_load(&channel->closed)) {
+      // A value may have been queued before the channel was closed.
+      if (!PopChannel(channel, &value, &block)) {
+        value = 0;
+      }
+      break;
+    }
+    if (WaitChannel(vm, &spins)) {
+      return;
+    }
+  }
+  if (block) {
+    struct HeapBlock* heap_block = NULL;
+    memcpy(&heap_block, &value, sizeof(heap_block));
+    heap_block = heap_block - 1;
+    heap_block->prev = &vm->heap;
+    heap_block->next = vm->heap.next;
+    vm->heap.next->prev = heap_block;
+    vm->heap.next = heap_block;
+  }
+  if (GetType(vm->memory, return_value) == channel->type) {
+    memcpy((void*)((uintptr_t)vm->memory->data + return_value), &value,
+           channel->size);
+  }
+}
+
+// channel_close(channel) makes further sends fail and wakes receivers once the
+// channel is drained.
+void channel_close(struct VM* vm, InternalObject args, size_t return_value) {
+  struct Channel* channel = GetChannel(vm, args.index[0]);
+  if (channel != NULL) {
+    atomic_store(&channel->closed, true);
+  }
+  SetIntData(vm, return_value, channel != NULL ? 0 : -1);
+}
+#endif
+
+#ifdef AQ_EVENTS
+// Descriptor natives. Descriptors are non-blocking: an operation that would
+// block suspends the calling green thread until the event loop of its
+// scheduler reports the descriptor ready, or blocks the VM's thread when it
+// runs no green threads. Results are -1 on error.
+
+// Runs |operation| on |fd| until it no longer would block, making the calling
+// native return when it has to wait to be invoked again.
+#define AQ_RETRY(vm, fd, events, result, operation)                     \
+  while (((result) = (operation)) < 0 &&                                \
+         (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) { \
+    if (errno != EINTR && WaitForDescriptor(vm, fd, events)) {          \
+      return;                                                           \
+    }                                                                   \
+  }                                                                     \
+  (vm)->wait_fd = -1
+
+// io_open(path, mode) opens a file for reading (0), writing (1) or appending
+// (2).
+void io_open(struct VM* vm, InternalObject args, size_t return_value) {
+  static const int flags[] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC,
+                              O_WRONLY | O_CREAT | O_APPEND};
+  long mode = GetLongData(vm, args.index[1]);
+  int fd = -1;
+  if (mode >= 0 && mode < 3) {
+    fd = open((char*)GetPtrData(vm, args.index[0]),
+              flags[mode] | O_NONBLOCK | O_CLOEXEC, 0644);
+  }
+  SetLongData(vm, return_value, fd);
+}
+
+// io_pipe(write_end) returns the read end of a new pipe and stores the write
+// end in |write_end|.
+void io_pipe(struct VM* vm, InternalObject args, size_t return_value) {
+  int fds[2];
+  if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+    SetLongData(vm, return_value, -1);
+    return;
+  }
+  SetLongData(vm, args.index[0], fds[1]);
+  SetLongData(vm, return_value, fds[0]);
+}
+
+// io_listen(port) listens on the loopback interface; port 0 picks a free one,
+// which io_port(fd) returns.
+void io_listen(struct VM* vm, InternalObject args, size_t return_value) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  struct sockaddr_in address = {0};
+  address.sin_family = AF_INET;
+  address.sin_port = htons((uint16_t)GetLongData(vm, args.index[0]));
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int enable = 1;
+  if (fd >= 0 &&
+      (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0 ||
+       bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+       listen(fd, SOMAXCONN) != 0)) {
+    close(fd);
+    fd = -1;
+  }
+  SetLongData(vm, return_value, fd);
+}
+
+void io_port(struct VM* vm, InternalObject args, size_t return_value) {
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+  long port = -1;
+  if (getsockname((int)GetLongData(vm, args.index[0]),
+                  (struct sockaddr*)&address, &length) == 0) {
+    port = ntohs(address.sin_port);
+  }
+  SetLongData(vm, return_value, port);
+}
+
+void io_accept(struct VM* vm, InternalObject args, size_t return_value) {
+  int fd = (int)GetLongData(vm, args.index[0]);
+  int client;
+  AQ_RETRY(vm, fd, POLLIN, client,
+           accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC));
+  SetLongData(vm, return_value, client);
+}
+
+// io_connect(port) connects to a port on the loopback interface. While the
+// connection is in progress vm->wait_fd holds the socket.
+void io_connect(struct VM* vm, InternalObject args, size_t return_value) {
+  int fd = vm->wait_fd;
+  if (fd < 0) {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)GetLongData(vm, args.index[0]));
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 ||
+        (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0 &&
+         errno != EINPROGRESS)) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      SetLongData(vm, return_value, -1);
+      return;
+    }
+  }
+  struct pollfd descriptor = {fd, POLLOUT, 0};
+  while (poll(&descriptor, 1, 0) == 0) {
+    if (WaitForDescriptor(vm, fd, POLLOUT)) {
+      return;
+    }
+  }
+  vm->wait_fd = -1;
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 ||
+      error != 0) {
+    close(fd);
+    fd = -1;
+  }
+  SetLongData(vm, return_value, fd);
+}
+
+// io_read(fd, buffer, size) reads up to |size| bytes and returns how many were
+// read, 0 at the end of the input.
+void io_read(struct VM* vm, InternalObject args, size_t return_value) {
+  int fd = (int)GetLongData(vm, args.index[0]);
+  ssize_t count;
+  AQ_RETRY(vm, fd, POLLIN, count,
+           read(fd, GetPtrData(vm, args.index[1]),
+                GetLongData(vm, args.index[2])));
+  SetLongData(vm, return_value, count);
+}
+
+// io_write(fd, buffer, size) writes up to |size| bytes and returns how many
+// were written.
+void io_write(struct VM* vm, InternalObject args, size_t return_value) {
+  int fd = (int)GetLongData(vm, args.index[0]);
+  ssize_t count;
+  AQ_RETRY(vm, fd, POLLOUT, count,
+           write(fd, GetPtrData(vm, args.index[1]),
+                 GetLongData(vm, args.index[2])));
+  SetLongData(vm, return_value, count);
+}
+
+void io_close(struct VM* vm, InternalObject args, size_t return_value) {
+  SetLongData(vm, return_value, close((int)GetLongData(vm, args.index[0])));
+}
+#endif
+
+#ifdef AQ_IO_URING
+// File natives, backed by the VM's io_uring. A green thread is suspended until
+// its request completes, so the requests of all green threads are submitted
+// in one batch while the others keep running; without green threads a
+// request is submitted and waited for right away. Kernels without io_uring
+// get the equivalent system calls. Results are -1 on error; an |offset| of
+// -1 uses the file position.
+
+// file_open(path, mode) opens a file for reading (0), writing (1) or
+// appending (2).
+void file_open(struct VM* vm, InternalObject args, size_t return_value) {
+  static const int flags[] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC,
+                              O_WRONLY | O_CREAT | O_APPEND};
+  if (vm->request == NULL) {
+    long mode = GetLongData(vm, args.index[1]);
+    if (mode < 0 || mode > 2) {
+      SetLongData(vm, return_value, -1);
+      return;
+    }
+    struct io_uring_sqe entry = {0};
+    entry.opcode = IORING_OP_OPENAT;
+    entry.fd = AT_FDCWD;
+    entry.addr = (uintptr_t)GetPtrData(vm, args.index[0]);
+    entry.len = 0644;
+    entry.open_flags = flags[mode] | O_CLOEXEC;
+    StartRequest(vm, &entry, NULL, 0);
+  }
+  FinishRequest(vm, return_value);
+}
+
+// file_read(fd, buffer, size, offset)
+void file_read(struct VM* vm, InternalObject args, size_t return_value) {
+  if (vm->request == NULL) {
+    struct io_uring_sqe entry = {0};
+    entry.opcode = IORING_OP_READ;
+    entry.fd = (int)GetLongData(vm, args.index[0]);
+    entry.addr = (uintptr_t)GetPtrData(vm, args.index[1]);
+    entry.len = (unsigned)GetLongData(vm, args.index[2]);
+    entry.off = (uint64_t)GetLongData(vm, args.index[3]);
+    StartRequest(vm, &entry, NULL, 0);
+  }
+  FinishRequest(vm, return_value);
+}
+
+// file_write(fd, buffer, size, offset)
+void file_write(struct VM* vm, InternalObject args, size_t return_value) {
+  if (vm->request == NULL) {
+    struct io_uring_sqe entry = {0};
+    entry.opcode = IORING_OP_WRITE;
+    entry.fd = (int)GetLongData(vm, args.index[0]);
+    entry.addr = (uintptr_t)GetPtrData(vm, args.index[1]);
+    entry.len = (unsigned)GetLongData(vm, args.index[2]);
+    entry.off = (uint64_t)GetLongData(vm, args.index[3]);
+    StartRequest(vm, &entry, NULL, 0);
+  }
+  FinishRequest(vm, return_value);
+}
+
+// file_readv(fd, offset, buffer, size, ...) fills the buffers in order with
+// one request.
+void file_readv(struct VM* vm, InternalObject args, size_t return_value) {
+  if (vm->request == NULL) {
+    size_t count = args.size < 2 ? 0 : (args.size - 2) / 2;
+    if (count == 0 || count > IOV_MAX) {
+      SetLongData(vm, return_value, -1);
+      return;
+    }
+    struct iovec* iovecs =
+        (struct iovec*)malloc(count * sizeof(struct iovec));
+    for (size_t i = 0; i < count; i++) {
+      iovecs[i].iov_base = GetPtrData(vm, args.index[2 + 2 * i]);
+      iovecs[i].iov_len = GetLongData(vm, args.index[3 + 2 * i]);
+    }
+    struct io_uring_sqe entry = {0};
+    entry.opcode = IORING_OP_READV;
+    entry.fd = (int)GetLongData(vm, args.index[0]);
+    entry.off = (uint64_t)GetLongData(vm, args.index[1]);
+    StartRequest(vm, &entry, iovecs, count);
+    free(iovecs);
+  }
+  FinishRequest(vm, return_value);
+}
+
+void file_fsync(struct VM* vm, InternalObject args, size_t return_value) {
+  if (vm->request == NULL) {
+    struct io_uring_sqe entry = {0};
+    entry.opcode = IORING_OP_FSYNC;
+    entry.fd = (int)GetLongData(vm, args.index[0]);
+    StartRequest(vm, &entry, NULL, 0);
+  }
+  FinishRequest(vm, return_value);
+}
+
+void file_close(struct VM* vm, InternalObject args, size_t return_value) {
+  if (vm->request == NULL) {
+    struct io_uring_sqe entry = {0};
+    entry.opcode = IORING_OP_CLOSE;
+    entry.fd = (int)GetLongData(vm, args.index[0]);
+    StartRequest(vm, &entry, NULL, 0);
+  }
+  FinishRequest(vm, return_value);
+}
+
+// file_buffer(size) returns one of the VM's registered I/O buffers of up to
+// 64 KiB, or NULL if none is free. Buffers are released with
+// file_buffer_free(buffer) or when the VM is reset.
+void file_buffer(struct VM* vm, InternalObject args, size_t return_value) {
+  SetPtrData(vm, return_value,
+             AllocateRingBuffer(GetRing(vm), GetLongData(vm, args.index[0])));
+}
+
+void file_buffer_free(struct VM* vm, InternalObject args,
+                      size_t return_value) {
+  FreeRingBuffer(GetRing(vm), GetPtrData(vm, args.index[0]));
+  SetLongData(vm, return_value, 0);
+}
+#endif
+
+#ifdef AQ_MAPPED_FILES
+// Advice bits of file_map and file_advise.
+#define AQ_MAP_SEQUENTIAL 1
+#define AQ_MAP_WILLNEED 2
+#define AQ_MAP_RANDOM 4
+
+void AdviseMapping(void* data, size_t size, long hint) {
+  if (hint & AQ_MAP_SEQUENTIAL) {
+    posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+  } else if (hint & AQ_MAP_RANDOM) {
+    posix_madvise(data, size, POSIX_MADV_RANDOM);
+  }
+  if (hint & AQ_MAP_WILLNEED) {
+    posix_madvise(data, size, POSIX_MADV_WILLNEED);
+  }
+}
+
+struct MappedFile* FindMappedFile(struct VM* vm, void* data) {
+  struct MappedFile* file = vm->mapped_files;
+  while (file != NULL && file->data != data) {
+    file = file->next;
+  }
+  return file;
+}
+
+// file_map(path, mode, hint) maps a whole file into memory and returns a
+// pointer to it, or NULL. Mode 0 maps it read-only and shares the page cache
+// with every other mapping of the file; mode 1 maps it copy-on-write, so
+// stores stay private to the VM. |hint| combines 1 (sequential), 2 (willneed)
+// and 4 (random) access advice. The mapping stays valid until file_unmap or
+// until the VM is reset; it must not be passed to FREE.
+void file_map(struct VM* vm, InternalObject args, size_t return_value) {
+  long mode = GetLongData(vm, args.index[1]);
+  int fd = -1;
+  if (mode == 0 || mode == 1) {
+    fd = open((char*)GetPtrData(vm, args.index[0]), O_RDONLY | O_CLOEXEC);
+  }
+  struct stat status;
+  void* data = MAP_FAILED;
+  if (fd >= 0 && fstat(fd, &status) == 0 && status.st_size > 0) {
+    data = mmap(NULL, status.st_size,
+                mode == 0 ? PROT_READ : PROT_READ | PROT_WRITE,
+                mode == 0 ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (data == MAP_FAILED) {
+    SetPtrData(vm, return_value, NULL);
+    return;
+  }
+  AdviseMapping(data, status.st_size, GetLongData(vm, args.index[2]));
+
+  struct MappedFile* file =
+      (struct MappedFile*)malloc(sizeof(struct MappedFile));
+  file->data = data;
+  file->size = status.st_size;
+  file->next = vm->mapped_files;
+  vm->mapped_files = file;
+  SetPtrData(vm, return_value, data);
+}
+
+// file_map_size(mapping) returns the size of a mapping in bytes, or -1.
+void file_map_size(struct VM* vm, InternalObject args, size_t return_value) {
+  struct MappedFile* file = FindMappedFile(vm, GetPtrData(vm, args.index[0]));
+  SetLongData(vm, return_value, file != NULL ? (long)file->size : -1);
+}
+
+// file_advise(mapping, offset, length, hint) gives access advice for a part
+// of a mapping, such as willneed for the range a scan reaches next.
+void file_advise(struct VM* vm, InternalObject args, size_t return_value) {
+  struct MappedFile* file = FindMappedFile(vm, GetPtrData(vm, args.index[0]));
+  size_t offset = GetLongData(vm, args.index[1]);
+  size_t length = GetLongData(vm, args.index[2]);
+  if (file == NULL || offset > file->size || length > file->size - offset) {
+    SetLongData(vm, return_value, -1);
+    return;
+  }
+  // madvise() wants a page-aligned start.
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t start = offset / page * page;
+  AdviseMapping((char*)file->data + start, length + offset - start,
+                GetLongData(vm, args.index[3]));
+  SetLongData(vm, return_value, 0);
+}
+
+void file_unmap(struct VM* vm, InternalObject args, size_t return_value) {
+  void* data = GetPtrData(vm, args.index[0]);
+  struct MappedFile** link = &vm->mapped_files;
+  while (*link != NULL && (*link)->data != data) {
+    link = &(*link)->next;
+  }
+  if (*link == NULL) {
+    SetLongData(vm, return_value, -1);
+    return;
+  }
+  struct MappedFile* file = *link;
+  *link = file->next;
+  munmap(file->data, file->size);
+  free(file);
+  SetLongData(vm, return_value, 0);
+}
+#endif
+
+#ifdef AQ_READERS
+#define AQ_READER_BUFFER_SIZE (1 << 20)
+
+// Buffered reader over a file or stdin for the reader natives. Records are
+// returned as pointers into the buffer, terminated in place, so reading
+// allocates nothing per record.
+struct Reader {
+  int fd;
+  bool eof;
+  size_t start;
+  size_t end;
+  // One byte more than is read at once, so the last record always has room
+  // for its terminator.
+  char buffer[AQ_READER_BUFFER_SIZE + 1];
+};
+
+// Returns the first byte in [data, end) equal to |a| or |b|, or |end|.
+char* FindEither(char* data, char* end, char a, char b) {
+#ifdef AQ_SSE2
+  __m128i first = _mm_set1_epi8(a);
+  __m128i second = _mm_set1_epi8(b);
+  for (; end - data >= 16; data += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)data);
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, first),
+                                              _mm_cmpeq_epi8(chunk, second)));
+    if (mask != 0) {
+      return data + __builtin_ctz(mask);
+    }
+  }
+#endif
+  while (data < end && *data != a && *data != b) {
+    data++;
+  }
+  return data;
+}
+
+// Moves the unread bytes to the front of the buffer and reads more input.
+// Returns false if the buffer did not change because it is full or the input
+// ended; otherwise pointers into the buffer have to be recomputed.
+bool FillReader(struct Reader* reader) {
+  if (reader->eof) {
+    return false;
+  }
+  bool moved = reader->start != 0;
+  memmove(reader->buffer, reader->buffer + reader->start,
+          reader->end - reader->start);
+  reader->end -= reader->start;
+  reader->start = 0;
+  while (reader->end < AQ_READER_BUFFER_SIZE) {
+    ssize_t count = read(reader->fd, reader->buffer + reader->end,
+                         AQ_READER_BUFFER_SIZE - reader->end);
+    if (count > 0) {
+      reader->end += count;
+      return true;
+    }
+    if (count == 0 || errno != EINTR) {
+      reader->eof = true;
+      break;
+    }
+  }
+  return moved;
+}
+
+// Returns the next line without its line break, or NULL at the end of the
+// input or, unless |refill|, of the buffered input. Lines longer than the
+// buffer are returned in pieces.
+char* ReadLine(struct Reader* reader, bool refill) {
+  while (true) {
+    char* line = reader->buffer + reader->start;
+    char* end = reader->buffer + reader->end;
+    char* newline = (char*)memchr(line, '\n', end - line);
+    if (newline == NULL) {
+      if (refill && FillReader(reader)) {
+        continue;
+      }
+      if (line == end || (!reader->eof && reader->start != 0)) {
+        return NULL;
+      }
+      newline = end;
+    }
+    reader->start = newline - reader->buffer + (newline < end ? 1 : 0);
+    if (newline > line && newline[-1] == '\r') {
+      newline--;
+    }
+    *newline = '\0';
+    return line;
+  }
+}
+
+// reader_open(path) opens a file, or stdin when |path| is NULL. The reader is
+// freed with reader_close or with the VM's heap.
+void reader_open(struct VM* vm, InternalObject args, size_t return_value) {
+  const char* path = (const char*)GetPtrData(vm, args.index[0]);
+  int fd = path != NULL ? open(path, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+  struct Reader* reader =
+      fd >= 0 ? (struct Reader*)AllocateHeap(vm, sizeof(struct Reader)) : NULL;
+  if (reader == NULL) {
+    if (fd > STDIN_FILENO) {
+      close(fd);
+    }
+    SetPtrData(vm, return_value, NULL);
+    return;
+  }
+  reader->fd = fd;
+  reader->eof = false;
+  reader->start = 0;
+  reader->end = 0;
+  SetPtrData(vm, return_value, reader);
+}
+
+// reader_lines(reader, line, ...) stores up to one line per pointer slot and
+// returns how many were stored, 0 at the end of the input. The lines stay
+// valid until the next call on the reader.
+void reader_lines(struct VM* vm, InternalObject args, size_t return_value) {
+  struct Reader* reader = (struct Reader*)GetPtrData(vm, args.index[0]);
+  long count = 0;
+  for (size_t i = 1; i < args.size; i++) {
+    // Refilling moves the buffer, so only the first line may refill.
+    char* line = ReadLine(reader, count == 0);
+    if (line == NULL) {
+      break;
+    }
+    SetPtrData(vm, args.index[i], line);
+    count++;
+  }
+  SetLongData(vm, return_value, count);
+}
+
+// reader_fields(reader, delimiter, field, ...) splits the next line at the
+// byte |delimiter| and stores one field per pointer slot; the last slot gets
+// the rest of the line. Returns the number of fields in the line, 0 at the
+// end of the input. The fields stay valid until the next call on the reader.
+void reader_fields(struct VM* vm, InternalObject args, size_t return_value) {
+  struct Reader* reader = (struct Reader*)GetPtrData(vm, args.index[0]);
+  char delimiter = (char)GetByteData(vm, args.index[1]);
+  size_t* slots = args.index + 2;
+  size_t slot_count = args.size - 2;
+  char* line;
+  char* end;
+  char* found;
+  long count;
+  size_t stored;
+  do {
+    line = reader->buffer + reader->start;
+    end = reader->buffer + reader->end;
+    count = 0;
+    stored = 0;
+    if (slot_count > 0) {
+      SetPtrData(vm, slots[stored++], line);
+    }
+    // Delimiters and the line break are found in one pass. Nothing is written
+    // to the buffer before the line is complete, as refilling rescans it.
+    found = line;
+    while ((found = FindEither(found, end, delimiter, '\n')) < end &&
+           *found == delimiter) {
+      found++;
+      count++;
+      if (stored < slot_count) {
+        SetPtrData(vm, slots[stored++], found);
+      }
+    }
+  } while (found == end && FillReader(reader));
+  if (found == line && line == end) {
+    SetLongData(vm, return_value, 0);
+    return;
+  }
+
+  for (size_t i = 1; i < stored; i++) {
+    ((char*)GetPtrData(vm, slots[i]))[-1] = '\0';
+  }
+  reader->start = found - reader->buffer + (found < end ? 1 : 0);
+  if (found > line && found[-1] == '\r') {
+    found--;
+  }
+  *found = '\0';
+  SetLongData(vm, return_value, count + 1);
+}
+
+void reader_close(struct VM* vm, InternalObject args, size_t return_value) {
+  struct Reader* reader = (struct Reader*)GetPtrData(vm, args.index[0]);
+  if (reader != NULL) {
+    if (reader->fd > STDIN_FILENO) {
+      close(reader->fd);
+    }
+    FreeHeap(reader);
+  }
+  SetLongData(vm, return_value, 0);
+}
+#endif
+
+// JSON documents parsed in two stages, after simdjson. Stage one classifies
+// 64-byte blocks with SIMD compares and bit arithmetic and records the
+// position of every structural character, string start and scalar start in
+// an index. Stage two validates the index and records where each object and
+// array ends, so lookups skip whole values in one step. A lazy document stops
+// after stage one and skips values by counting nesting on demand.
+//
+// The text is not copied and must outlive the document. Strings are unescaped
+// on first access and interned per document. All memory comes from the VM's
+// heap.
+struct JsonString {
+  size_t index;
+  char* text;
+};
+
+struct JsonDocument {
+  const char* text;
+  size_t length;
+  uint32_t* index;
+  size_t count;
+  // For each '{' or '[' entry of the index, the entry of its closing bracket.
+  // NULL in a lazy document.
+  uint32_t* ends;
+  // Open-addressed table of unescaped strings, keyed by index entry.
+  struct JsonString* strings;
+  size_t string_count;
+  size_t string_capacity;
+};
+
+#define AQ_JSON_MISSING 0
+#define AQ_JSON_NULL 1
+#define AQ_JSON_BOOLEAN 2
+#define AQ_JSON_NUMBER 3
+#define AQ_JSON_STRING 4
+#define AQ_JSON_ARRAY 5
+#define AQ_JSON_OBJECT 6
+
+// Masks of a 64-byte block with bit i set where byte i is in the class.
+struct JsonClasses {
+  uint64_t backslashes;
+  uint64_t quotes;
+  // One of {}[]:,
+  uint64_t operators;
+  uint64_t spaces;
+};
+
+#ifdef AQ_SSE2
+uint64_t GetJsonMask(__m128i found) {
+  return (uint64_t)(uint16_t)_mm_movemask_epi8(found);
+}
+#endif
+
+// Builds every class mask of |block| in one pass over it.
+void ClassifyJsonBlock(const char* block, struct JsonClasses* classes) {
+  memset(classes, 0, sizeof(*classes));
+#ifdef AQ_SSE2
+  for (int chunk = 0; chunk < 4; chunk++) {
+    __m128i data = _mm_loadu_si128((const __m128i*)(block + 16 * chunk));
+    // Setting bit 5 turns '[' and ']' into '{' and '}' and no other byte.
+    __m128i folded = _mm_or_si128(data, _mm_set1_epi8(0x20));
+    __m128i operators = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')),
+                     _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+        _mm_or_si128(_mm_cmpeq_epi8(data, _mm_set1_epi8(':')),
+                     _mm_cmpeq_epi8(data, _mm_set1_epi8(','))));
+    __m128i spaces = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(data, _mm_set1_epi8(' ')),
+                     _mm_cmpeq_epi8(data, _mm_set1_epi8('\t'))),
+        _mm_or_si128(_mm_cmpeq_epi8(data, _mm_set1_epi8('\n')),
+                     _mm_cmpeq_epi8(data, _mm_set1_epi8('\r'))));
+    int shift = 16 * chunk;
+    classes->backslashes |=
+        GetJsonMask(_mm_cmpeq_epi8(data, _mm_set1_epi8('\\'))) << shift;
+    classes->quotes |= GetJsonMask(_mm_cmpeq_epi8(data, _mm_set1_epi8('"')))
+                       << shift;
+    classes->operators |= GetJsonMask(operators) << shift;
+    classes->spaces |= GetJsonMask(spaces) << shift;
+  }
+#else
+  for (int i = 0; i < 64; i++) {
+    uint64_t bit = (uint64_t)1 << i;
+    switch (block[i]) {
+      case '\\':
+        classes->backslashes |= bit;
+        break;
+      case '"':
+        classes->quotes |= bit;
+        break;
+      case '{':
+      case '}':
+      case '[':
+      case ']':
+      case ':':
+      case ',':
+        classes->operators |= bit;
+        break;
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\r':
+        classes->spaces |= bit;
+        break;
+      default:
+        break;
+    }
+  }
+#endif
+}
+
+// Returns the bytes escaped by a backslash, without a loop over the bits as
+// in simdjson: a byte is escaped when it ends an odd-length run of
+// backslashes. |carry| is set when the block ends in such a run.
+uint64_t FindEscapedJsonBytes(uint64_t backslashes, uint64_t* carry) {
+  const uint64_t even_bits = 0x5555555555555555ull;
+  backslashes &= ~*carry;
+  uint64_t follows_escape = (backslashes << 1) | *carry;
+  uint64_t odd_starts = backslashes & ~even_bits & ~follows_escape;
+  uint64_t even_run_ends = odd_starts + backslashes;
+  *carry = even_run_ends < odd_starts;
+  return (even_bits ^ (even_run_ends << 1)) & follows_escape;
+}
+
+// Sets every bit from each set bit up to, not including, the next one.
+uint64_t PrefixXor(uint64_t mask) {
+  mask ^= mask << 1;
+  mask ^= mask << 2;
+  mask ^= mask << 4;
+  mask ^= mask << 8;
+  mask ^= mask << 16;
+  mask ^= mask << 32;
+  return mask;
+}
+
+// Stage one. Stores the index entries of |text| in |index|, which has room for
+// |length| + 1 entries, and returns their count. Returns SIZE_MAX if a string
+// is not terminated.
+size_t IndexJson(const char* text, size_t length, uint32_t* index) {
+  size_t count = 0;
+  uint64_t escape_carry = 0;
+  uint64_t in_string_carry = 0;
+  uint64_t scalar_carry = 0;
+  char padded[64];
+  for (size_t base = 0; base < length; base += 64) {
+    const char* block = text + base;
+    if (length - base < 64) {
+      memset(padded, ' ', sizeof(padded));
+      memcpy(padded, block, length - base);
+      block = padded;
+    }
+    struct JsonClasses classes;
+    ClassifyJsonBlock(block, &classes);
+    uint64_t escaped = 0;
+    if (classes.backslashes != 0 || escape_carry != 0) {
+      escaped = FindEscapedJsonBytes(classes.backslashes, &escape_carry);
+    }
+    uint64_t quotes = classes.quotes & ~escaped;
+    uint64_t in_string = PrefixXor(quotes) ^ in_string_carry;
+    in_string_carry = (uint64_t)((int64_t)in_string >> 63);
+    uint64_t operators = classes.operators & ~in_string;
+    uint64_t spaces = classes.spaces;
+    uint64_t scalars = ~(operators | spaces | quotes | in_string);
+    uint64_t starts = scalars & ~((scalars << 1) | scalar_carry);
+    scalar_carry = scalars >> 63;
+
+    uint64_t entries = operators | (quotes & in_string) | starts;
+    while (entries != 0) {
+      index[count++] = (uint32_t)(base + CountTrailingZeros(entries));
+      entries &= entries - 1;
+    }
+  }
+  return in_string_carry != 0 ? SIZE_MAX : count;
+}
+
+// Returns the end of the number, literal or other scalar at |text|.
+const char* ScanJsonScalar(const char* text, const char* end) {
+  while (text < end && strchr("{}[]:,\" \t\n\r", *text) == NULL) {
+    text++;
+  }
+  return text;
+}
+
+bool IsJsonScalar(const char* text, const char* end) {
+  const char* scalar_end = ScanJsonScalar(text, end);
+  size_t size = scalar_end - text;
+  if ((size == 4 && memcmp(text, "true", 4) == 0) ||
+      (size == 5 && memcmp(text, "false", 5) == 0) ||
+      (size == 4 && memcmp(text, "null", 4) == 0)) {
+    return true;
+  }
+  if (text < scalar_end && *text == '-') {
+    text++;
+  }
+  if (text == scalar_end || *text < '0' || *text > '9') {
+    return false;
+  }
+  if (*text == '0') {
+    text++;
+  } else {
+    while (text < scalar_end && *text >= '0' && *text <= '9') {
+      text++;
+    }
+  }
+  if (text < scalar_end && *text == '.') {
+    const char* digits = ++text;
+    while (text < scalar_end && *text >= '0' && *text <= '9') {
+      text++;
+    }
+    if (text == digits) {
+      return false;
+    }
+  }
+  if (text < scalar_end && (*text == 'e' || *text == 'E')) {
+    text++;
+    if (text < scalar_end && (*text == '+' || *text == '-')) {
+      text++;
+    }
+    const char* digits = text;
+    while (text < scalar_end && *text >= '0' && *text <= '9') {
+      text++;
+    }
+    if (text == digits) {
+      return false;
+    }
+  }
+  return text == scalar_end;
+}
+
+// Stage two. Checks the grammar of the indexed document and fills
+// document->ends. Returns false if the document is invalid.
+bool MatchJson(struct JsonDocument* document, uint32_t* stack) {
+  enum { VALUE, VALUE_OR_END, KEY, KEY_OR_END, COLON, NEXT } state = VALUE;
+  const char* text = document->text;
+  size_t depth = 0;
+  for (size_t i = 0; i < document->count; i++) {
+    char c = text[document->index[i]];
+    char open = depth > 0 ? text[document->index[stack[depth - 1]]] : 0;
+    switch (state) {
+      case VALUE_OR_END:
+      case VALUE:
+        if (state == VALUE_OR_END && c == ']') {
+          document->ends[stack[--depth]] = (uint32_t)i;
+          state = NEXT;
+        } else if (c == '{' || c == '[') {
+          stack[depth++] = (uint32_t)i;
+          state = c == '{' ? KEY_OR_END : VALUE_OR_END;
+        } else if (c == '"' ||
+                   IsJsonScalar(text + document->index[i],
+                                text + document->length)) {
+          state = NEXT;
+        } else {
+          return false;
+        }
+        break;
+      case KEY_OR_END:
+      case KEY:
+        if (state == KEY_OR_END && c == '}') {
+          document->ends[stack[--depth]] = (uint32_t)i;
+          state = NEXT;
+        } else if (c == '"') {
+          state = COLON;
+        } else {
+          return false;
+        }
+        break;
+      case COLON:
+        if (c != ':') {
+          return false;
+        }
+        state = VALUE;
+        break;
+      case NEXT:
+        if (depth == 0) {
+          return false;
+        } else if (c == ',') {
+          state = open == '{' ? KEY : VALUE;
+        } else if ((c == '}' && open == '{') || (c == ']' && open == '[')) {
+          document->ends[stack[--depth]] = (uint32_t)i;
+        } else {
+          return false;
+        }
+        break;
+    }
+  }
+  return state == NEXT && depth == 0;
+}
+
+struct JsonDocument* ParseJson(struct VM* vm, const char* text, size_t length,
+                               bool lazy) {
+  if (length >= UINT32_MAX) {
+    return NULL;
+  }
+  struct JsonDocument* document =
+      (struct JsonDocument*)AllocateHeap(vm, sizeof(struct JsonDocument));
+  uint32_t* index =
+      (uint32_t*)AllocateHeap(vm, (length + 1) * sizeof(uint32_t));
+  if (document == NULL || index == NULL) {
+    FreeHeap(document);
+    FreeHeap(index);
+    return NULL;
+  }
+  memset(document, 0, sizeof(*document));
+  document->text = text;
+  document->length = length;
+  document->index = index;
+  document->count = IndexJson(text, length, index);
+  bool valid = document->count != SIZE_MAX && document->count != 0;
+  if (valid && !lazy) {
+    document->ends =
+        (uint32_t*)AllocateHeap(vm, document->count * sizeof(uint32_t));
+    uint32_t* stack = (uint32_t*)malloc(document->count * sizeof(uint32_t));
+    valid = document->ends != NULL && stack != NULL &&
+            MatchJson(document, stack);
+    free(stack);
+  }
+  if (!valid) {
+    FreeHeap(document->ends);
+    FreeHeap(index);
+    FreeHeap(document);
+    return NULL;
+  }
+  return document;
+}
+
+char JsonAt(const struct JsonDocument* document, size_t entry) {
+  return entry < document->count ? document->text[document->index[entry]] : 0;
+}
+
+// Returns the entry following the value at |entry|.
+size_t SkipJson(const struct JsonDocument* document, size_t entry) {
+  char c = JsonAt(document, entry);
+  if (c != '{' && c != '[') {
+    return entry + 1;
+  }
+  if (document->ends != NULL) {
+    return document->ends[entry] + 1;
+  }
+  size_t depth = 0;
+  do {
+    c = JsonAt(document, entry++);
+    if (c == '{' || c == '[') {
+      depth++;
+    } else if (c == '}' || c == ']') {
+      depth--;
+    }
+  } while (depth > 0 && entry < document->count);
+  return entry;
+}
+
+// Returns the end of the raw string whose opening quote is at |entry|.
+const char* GetJsonStringEnd(const struct JsonDocument* document,
+                             size_t entry) {
+  const char* end = entry + 1 < document->count
+                        ? document->text + document->index[entry + 1]
+                        : document->text + document->length;
+  while (*--end != '"') {
+  }
+  return end;
+}
+
+void AppendUtf8(char** output, uint32_t code) {
+  char* out = *output;
+  if (code < 0x80) {
+    *out++ = (char)code;
+  } else if (code < 0x800) {
+    *out++ = (char)(0xC0 | code >> 6);
+    *out++ = (char)(0x80 | (code & 0x3F));
+  } else if (code < 0x10000) {
+    *out++ = (char)(0xE0 | code >> 12);
+    *out++ = (char)(0x80 | (code >> 6 & 0x3F));
+    *out++ = (char)(0x80 | (code & 0x3F));
+  } else {
+    *out++ = (char)(0xF0 | code >> 18);
+    *out++ = (char)(0x80 | (code >> 12 & 0x3F));
+    *out++ = (char)(0x80 | (code >> 6 & 0x3F));
+    *out++ = (char)(0x80 | (code & 0x3F));
+  }
+  *output = out;
+}
+
+uint32_t ParseHex4(const char* text) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = text[i];
+    value = value * 16 + (c >= 'a' ? c - 'a' + 10 : c >= 'A' ? c - 'A' + 10
+                                                             : c - '0');
+  }
+  return value;
+}
+
+// Decodes the escapes of [text, end) into |output|, which needs as many bytes
+// plus a terminator. Unescaping never makes a string longer.
+void UnescapeJson(const char* text, const char* end, char* output) {
+  while (text < end) {
+    const char* backslash = (const char*)memchr(text, '\\', end - text);
+    const char* stop = backslash != NULL ? backslash : end;
+    memcpy(output, text, stop - text);
+    output += stop - text;
+    text = stop;
+    if (text == end || text + 1 == end) {
+      break;
+    }
+    char c = text[1];
+    text += 2;
+    switch (c) {
+      case 'b':
+        *output++ = '\b';
+        break;
+      case 'f':
+        *output++ = '\f';
+        break;
+      case 'n':
+        *output++ = '\n';
+        break;
+      case 'r':
+        *output++ = '\r';
+        break;
+      case 't':
+        *output++ = '\t';
+        break;
+      case 'u': {
+        if (end - text < 4) {
+          text = end;
+          break;
+        }
+        uint32_t code = ParseHex4(text);
+        text += 4;
+        if (code >= 0xD800 && code < 0xDC00 && end - text >= 6 &&
+            text[0] == '\\' && text[1] == 'u') {
+          uint32_t low = ParseHex4(text + 2);
+          if (low >= 0xDC00 && low < 0xE000) {
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            text += 6;
+          }
+        }
+        AppendUtf8(&output, code);
+        break;
+      }
+      default:
+        *output++ = c;
+        break;
+    }
+  }
+  *output = '\0';
+}
+
+// Returns the unescaped string whose opening quote is at |entry|, interning
+// it in the document.
+char* GetJsonString(struct VM* vm, struct JsonDocument* document,
+                    size_t entry) {
+  if (document->string_count * 2 >= document->string_capacity) {
+    size_t capacity =
+        document->string_capacity == 0 ? 64 : 2 * document->string_capacity;
+    struct JsonString* strings = (struct JsonString*)AllocateHeap(
+        vm, capacity * sizeof(struct JsonString));
+    if (strings == NULL) {
+      return NULL;
+    }
+    memset(strings, 0, capacity * sizeof(struct JsonString));
+    for (size_t i = 0; i < document->string_capacity; i++) {
+      struct JsonString* string = &document->strings[i];
+      if (string->text == NULL) {
+        continue;
+      }
+      size_t slot = string->index & (capacity - 1);
+      while (strings[slot].text != NULL) {
+        slot = (slot + 1) & (capacity - 1);
+      }
+      strings[slot] = *string;
+    }
+    FreeHeap(document->strings);
+    document->strings = strings;
+    document->string_capacity = capacity;
+  }
+
+  size_t slot = entry & (document->string_capacity - 1);
+  while (document->strings[slot].text != NULL) {
+    if (document->strings[slot].index == entry) {
+      return document->strings[slot].text;
+    }
+    slot = (slot + 1) & (document->string_capacity - 1);
+  }
+  const char* start = document->text + document->index[entry] + 1;
+  const char* end = GetJsonStringEnd(document, entry);
+  char* text = (char*)AllocateHeap(vm, end - start + 1);
+  if (text == NULL) {
+    return NULL;
+  }
+  UnescapeJson(start, end, text);
+  document->strings[slot].index = entry;
+  document->strings[slot].text = text;
+  document->string_count++;
+  return text;
+}
+
+bool JsonKeyEquals(const struct JsonDocument* document, size_t entry,
+                   const char* name, size_t size) {
+  const char* start = document->text + document->index[entry] + 1;
+  const char* end = GetJsonStringEnd(document, entry);
+  if (memchr(start, '\\', end - start) == NULL) {
+    return (size_t)(end - start) == size && memcmp(start, name, size) == 0;
+  }
+  char* key = (char*)malloc(end - start + 1);
+  if (key == NULL) {
+    return false;
+  }
+  UnescapeJson(start, end, key);
+  bool equal = strlen(key) == size && memcmp(key, name, size) == 0;
+  free(key);
+  return equal;
+}
+
+// Returns the entry of the value |path| names, such as "items[2].name", or
+// SIZE_MAX if there is none. An empty path names the whole document.
+size_t FindJson(const struct JsonDocument* document, const char* path) {
+  if (document == NULL || path == NULL) {
+    return SIZE_MAX;
+  }
+  size_t entry = 0;
+  while (*path != '\0') {
+    char c = JsonAt(document, entry);
+    if (*path == '[') {
+      char* after;
+      long position = strtol(path + 1, &after, 10);
+      if (c != '[' || *after != ']' || position < 0) {
+        return SIZE_MAX;
+      }
+      path = after + 1;
+      entry++;
+      if (JsonAt(document, entry) == ']') {
+        return SIZE_MAX;
+      }
+      for (; position > 0; position--) {
+        entry = SkipJson(document, entry);
+        if (JsonAt(document, entry) != ',') {
+          return SIZE_MAX;
+        }
+        entry++;
+      }
+    } else {
+      if (*path == '.') {
+        path++;
+      }
+      size_t size = strcspn(path, ".[");
+      if (c != '{') {
+        return SIZE_MAX;
+      }
+      entry++;
+      while (JsonAt(document, entry) == '"' &&
+             !JsonKeyEquals(document, entry, path, size)) {
+        entry = SkipJson(document, entry + 2);
+        if (JsonAt(document, entry) != ',') {
+          return SIZE_MAX;
+        }
+        entry++;
+      }
+      if (JsonAt(document, entry) != '"') {
+        return SIZE_MAX;
+      }
+      entry += 2;
+      path += size;
+    }
+  }
+  return entry < document->count ? entry : SIZE_MAX;
+}
+
+int GetJsonType(const struct JsonDocument* document, size_t entry) {
+  switch (entry != SIZE_MAX ? JsonAt(document, entry) : 0) {
+    case 0:
+      return AQ_JSON_MISSING;
+    case '{':
+      return AQ_JSON_OBJECT;
+    case '[':
+      return AQ_JSON_ARRAY;
+    case '"':
+      return AQ_JSON_STRING;
+    case 'n':
+      return AQ_JSON_NULL;
+    case 't':
+    case 'f':
+      return AQ_JSON_BOOLEAN;
+    default:
+      return AQ_JSON_NUMBER;
+  }
+}
+
+// json_parse(text, length, lazy) parses |length| bytes of |text|, or up to
+// its terminator when |length| is -1, and returns a document or NULL if the
+// text is not valid JSON. A lazy document is only indexed, which is faster
+// for large documents of which few values are read, and not validated.
+void json_parse(struct VM* vm, InternalObject args, size_t return_value) {
+  const char* text = (const char*)GetPtrData(vm, args.index[0]);
+  long length = GetLongData(vm, args.index[1]);
+  if (text == NULL) {
+    SetPtrData(vm, return_value, NULL);
+    return;
+  }
+  SetPtrData(vm, return_value,
+             ParseJson(vm, text, length < 0 ? strlen(text) : (size_t)length,
+                       GetLongData(vm, args.index[2]) != 0));
+}
+
+// json_get(document, path) converts the value at |path| to the type of the
+// return slot: pointer slots receive strings, numeric slots numbers and
+// booleans. Missing values and values of other kinds give NULL or 0.
+void json_get(struct VM* vm, InternalObject args, size_t return_value) {
+  struct JsonDocument* document =
+      (struct JsonDocument*)GetPtrData(vm, args.index[0]);
+  size_t entry = FindJson(document, (char*)GetPtrData(vm, args.index[1]));
+  int type = GetJsonType(document, entry);
+  if (GetType(vm->memory, return_value) == 0x00) {
+    SetPtrData(vm, return_value,
+               type == AQ_JSON_STRING ? GetJsonString(vm, document, entry)
+                                      : NULL);
+    return;
+  }
+  if (type == AQ_JSON_BOOLEAN) {
+    SetLongData(vm, return_value,
+                document->text[document->index[entry]] == 't');
+    return;
+  } else if (type != AQ_JSON_NUMBER) {
+    SetLongData(vm, return_value, 0);
+    return;
+  }
+  // The text may be a mapped file without a terminator, so the number is
+  // copied out before conversion.
+  const char* value = document->text + document->index[entry];
+  size_t size =
+      ScanJsonScalar(value, document->text + document->length) - value;
+  char number[64];
+  if (size >= sizeof(number)) {
+    size = sizeof(number) - 1;
+  }
+  memcpy(number, value, size);
+  number[size] = '\0';
+  if (strpbrk(number, ".eE") != NULL) {
+    SetDoubleData(vm, return_value, strtod(number, NULL));
+  } else {
+    SetLongData(vm, return_value, strtol(number, NULL, 10));
+  }
+}
+
+// json_type(document, path) returns 0 for a missing value, then 1 to 6 for
+// null, boolean, number, string, array and object.
+void json_type(struct VM* vm, InternalObject args, size_t return_value) {
+  struct JsonDocument* document =
+      (struct JsonDocument*)GetPtrData(vm, args.index[0]);
+  SetLongData(vm, return_value,
+              GetJsonType(document,
+                          FindJson(document,
+                                   (char*)GetPtrData(vm, args.index[1]))));
+}
+
+// json_count(document, path) returns the number of elements or members of an
+// array or object, or -1.
+void json_count(struct VM* vm, InternalObject args, size_t return_value) {
+  struct JsonDocument* document =
+      (struct JsonDocument*)GetPtrData(vm, args.index[0]);
+  size_t entry = FindJson(document, (char*)GetPtrData(vm, args.index[1]));
+  int type = GetJsonType(document, entry);
+  if (type != AQ_JSON_ARRAY && type != AQ_JSON_OBJECT) {
+    SetLongData(vm, return_value, -1);
+    return;
+  }
+  long count = 0;
+  char close = type == AQ_JSON_ARRAY ? ']' : '}';
+  entry++;
+  while (entry < document->count && JsonAt(document, entry) != close) {
+    count++;
+    entry = SkipJson(document, type == AQ_JSON_ARRAY ? entry : entry + 2);
+    if (JsonAt(document, entry) == ',') {
+      entry++;
+    }
+  }
+  SetLongData(vm, return_value, count);
+}
+
+// json_key(document, path, position) returns the key of a member of the
+// object at |path|, or NULL.
+void json_key(struct VM* vm, InternalObject args, size_t return_value) {
+  struct JsonDocument* document =
+      (struct JsonDocument*)GetPtrData(vm, args.index[0]);
+  size_t entry = FindJson(document, (char*)GetPtrData(vm, args.index[1]));
+  long position = GetLongData(vm, args.index[2]);
+  if (GetJsonType(document, entry) != AQ_JSON_OBJECT || position < 0) {
+    SetPtrData(vm, return_value, NULL);
+    return;
+  }
+  entry++;
+  for (; position > 0 && JsonAt(document, entry) == '"'; position--) {
+    entry = SkipJson(document, entry + 2);
+    if (JsonAt(document, entry) == ',') {
+      entry++;
+    }
+  }
+  SetPtrData(vm, return_value,
+             JsonAt(document, entry) == '"'
+                 ? GetJsonString(vm, document, entry)
+                 : NULL);
+}
+
+void json_free(struct VM* vm, InternalObject args, size_t return_value) {
+  struct JsonDocument* document =
+      (struct JsonDocument*)GetPtrData(vm, args.index[0]);
+  if (document != NULL) {
+    for (size_t i = 0; i < document->string_capacity; i++) {
+      FreeHeap(document->strings[i].text);
+    }
+    FreeHeap(document->strings);
+    FreeHeap(document->ends);
+    FreeHeap(document->index);
+    FreeHeap(document);
+  }
+  SetLongData(vm, return_value, 0);
+}
+
+// Non-cryptographic hashing after wyhash. A 64x64->128-bit multiply folds
+// 48 bytes per round into three independent lanes, which keeps large buffers
+// close to memory speed.
+static const uint64_t kWySecret[4] = {0x2d358dccaa6c78a5ull,
+                                      0x8bb84b93962eacc9ull,
+                                      0x4b33a62ed433d4a3ull,
+                                      0x4d5a2da51de1aa47ull};
+
+void WyMultiply(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t product = (__uint128_t)*a * *b;
+  *a = (uint64_t)product;
+  *b = (uint64_t)(product >> 64);
+#else
+  uint64_t high_a = *a >> 32, low_a = (uint32_t)*a;
+  uint64_t high_b = *b >> 32, low_b = (uint32_t)*b;
+  uint64_t high = high_a * high_b, middle_1 = high_a * low_b;
+  uint64_t middle_2 = low_a * high_b, low = low_a * low_b;
+  uint64_t carry =
+      ((low >> 32) + (uint32_t)middle_1 + (uint32_t)middle_2) >> 32;
+  *a = low + (middle_1 << 32) + (middle_2 << 32);
+  *b = high + (middle_1 >> 32) + (middle_2 >> 32) + carry;
+#endif
+}
+
+uint64_t WyMix(uint64_t a, uint64_t b) {
+  WyMultiply(&a, &b);
+  return a ^ b;
+}
+
+uint64_t WyRead8(const uint8_t* data) {
+  uint64_t value;
+  memcpy(&value, data, 8);
+  return value;
+}
+
+uint64_t WyRead4(const uint8_t* data) {
+  uint32_t value;
+  memcpy(&value, data, 4);
+  return value;
+}
+
+uint64_t WyHash(const void* key, size_t length, uint64_t seed) {
+  const uint8_t* data = (const uint8_t*)key;
+  uint64_t a, b;
+  seed ^= WyMix(seed ^ kWySecret[0], kWySecret[1]);
+  if (length <= 16) {
+    if (length >= 4) {
+      size_t step = (length >> 3) << 2;
+      a = (WyRead4(data) << 32) | WyRead4(data + step);
+      b = (WyRead4(data + length - 4) << 32) |
+          WyRead4(data + length - 4 - step);
+    } else if (length > 0) {
+      a = ((uint64_t)data[0] << 16) | ((uint64_t)data[length >> 1] << 8) |
+          data[length - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t left = length;
+    if (left > 48) {
+      uint64_t lane_1 = seed, lane_2 = seed;
+      do {
+        seed = WyMix(WyRead8(data) ^ kWySecret[1], WyRead8(data + 8) ^ seed);
+        lane_1 = WyMix(WyRead8(data + 16) ^ kWySecret[2],
+                       WyRead8(data + 24) ^ lane_1);
+        lane_2 = WyMix(WyRead8(data + 32) ^ kWySecret[3],
+                       WyRead8(data + 40) ^ lane_2);
+        data += 48;
+        left -= 48;
+      } while (left > 48);
+      seed ^= lane_1 ^ lane_2;
+    }
+    while (left > 16) {
+      seed = WyMix(WyRead8(data) ^ kWySecret[1], WyRead8(data + 8) ^ seed);
+      data += 16;
+      left -= 16;
+    }
+    a = WyRead8(data + left - 16);
+    b = WyRead8(data + left - 8);
+  }
+  a ^= kWySecret[1];
+  b ^= seed;
+  WyMultiply(&a, &b);
+  return WyMix(a ^ kWySecret[0] ^ length, b ^ kWySecret[1]);
+}
+
+// CRC32C (Castagnoli). The SSE4.2 and ARMv8 CRC instructions process 8 bytes
+// per instruction; other CPUs use slicing-by-8 tables.
+static uint32_t crc32c_table[8][256];
+static bool crc32c_hardware = false;
+
+void InitializeCrc32c(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+    }
+    crc32c_table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int slice = 1; slice < 8; slice++) {
+      uint32_t previous = crc32c_table[slice - 1][i];
+      crc32c_table[slice][i] =
+          (previous >> 8) ^ crc32c_table[0][previous & 0xFF];
+    }
+  }
+#if defined(AQ_CRC32C_SSE42)
+  unsigned int eax, ebx, ecx, edx;
+  crc32c_hardware =
+      __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2) != 0;
+#elif defined(AQ_CRC32C_ARM)
+  crc32c_hardware = true;
+#endif
+}
+
+#ifdef AQ_CRC32C_SSE42
+__attribute__((target("sse4.2"))) uint32_t Crc32cHardware(
+    uint32_t crc, const uint8_t* data, size_t length) {
+#ifdef __x86_64__
+  uint64_t wide = crc;
+  for (; length >= 8; data += 8, length -= 8) {
+    uint64_t value;
+    memcpy(&value, data, 8);
+    wide = _mm_crc32_u64(wide, value);
+  }
+  crc = (uint32_t)wide;
+#endif
+  for (; length > 0; data++, length--) {
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return crc;
+}
+#elif defined(AQ_CRC32C_ARM)
+uint32_t Crc32cHardware(uint32_t crc, const uint8_t* data, size_t length) {
+  for (; length >= 8; data += 8, length -= 8) {
+    uint64_t value;
+    memcpy(&value, data, 8);
+    crc = __crc32cd(crc, value);
+  }
+  for (; length > 0; data++, length--) {
+    crc = __crc32cb(crc, *data);
+  }
+  return crc;
+}
+#endif
+
+// Returns the CRC32C of |length| bytes at |data| continuing from |crc|, the
+// result for the preceding bytes or 0.
+uint32_t Crc32c(uint32_t crc, const void* data, size_t length) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  crc = ~crc;
+#if defined(AQ_CRC32C_SSE42) || defined(AQ_CRC32C_ARM)
+  if (crc32c_hardware) {
+    return ~Crc32cHardware(crc, bytes, length);
+  }
+#endif
+  for (; length >= 8; bytes += 8, length -= 8) {
+    uint32_t low = crc ^ ((uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+                          (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24);
+    crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF] ^
+          crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24] ^
+          crc32c_table[3][bytes[4]] ^ crc32c_table[2][bytes[5]] ^
+          crc32c_table[1][bytes[6]] ^ crc32c_table[0][bytes[7]];
+  }
+  for (; length > 0; bytes++, length--) {
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *bytes) & 0xFF];
+  }
+  return ~crc;
+}
+
+// hash_bytes(data, length, seed) hashes |length| bytes of any block, slot or
+// string. Equal bytes and seeds always give equal hashes within a process;
+// scripts keying maps on untrusted input should pick a random seed.
+void hash_bytes(struct VM* vm, InternalObject args, size_t return_value) {
+  const void* data = GetPtrData(vm, args.index[0]);
+  long length = GetLongData(vm, args.index[1]);
+  SetLongData(vm, return_value,
+              (long)WyHash(data, data != NULL && length > 0 ? length : 0,
+                           (uint64_t)GetLongData(vm, args.index[2])));
+}
+
+// hash_string(string, seed) hashes the bytes of |string| up to its terminator.
+void hash_string(struct VM* vm, InternalObject args, size_t return_value) {
+  const char* string = (const char*)GetPtrData(vm, args.index[0]);
+  SetLongData(vm, return_value,
+              (long)WyHash(string, string != NULL ? strlen(string) : 0,
+                           (uint64_t)GetLongData(vm, args.index[1])));
+}
+
+// hash_long(value, seed) hashes an integer of any slot type, so that values
+// equal after widening hash equally.
+void hash_long(struct VM* vm, InternalObject args, size_t return_value) {
+  int64_t value = GetLongData(vm, args.index[0]);
+  SetLongData(vm, return_value,
+              (long)WyHash(&value, sizeof(value),
+                           (uint64_t)GetLongData(vm, args.index[1])));
+}
+
+// crc32c(data, length, crc) returns the CRC32C of |length| bytes, continuing
+// from the |crc| of the bytes before them, or from 0 to start.
+void crc32c(struct VM* vm, InternalObject args, size_t return_value) {
+  const void* data = GetPtrData(vm, args.index[0]);
+  long length = GetLongData(vm, args.index[1]);
+  SetLongData(vm, return_value,
+              Crc32c((uint32_t)GetLongData(vm, args.index[2]), data,
+                     data != NULL && length > 0 ? length : 0));
+}
+
+// Transcendental functions over arrays of doubles in the byte order STORE
+// writes, so a block filled by bytecode can be passed directly. With SSE2,
+// sin and cos are computed two elements at a time: the argument is reduced
+// with Cody-Waite constants and both fdlibm polynomials are evaluated
+// without branches. Elements too large for that reduction are computed by
+// the C library, as are exp and log, whose table-driven C library versions
+// are as fast as two-lane polynomials.
+#define AQ_MATH_EXP 0
+#define AQ_MATH_LOG 1
+#define AQ_MATH_SIN 2
+#define AQ_MATH_COS 3
+
+double ApplyMath(double x, int function) {
+  switch (function) {
+    case AQ_MATH_EXP:
+      return exp(x);
+    case AQ_MATH_LOG:
+      return log(x);
+    case AQ_MATH_SIN:
+      return sin(x);
+    default:
+      return cos(x);
+  }
+}
+
+#ifdef AQ_SSE2
+static const double kSinCoefficients[6] = {
+    1.58969099521155010221e-10,  -2.50507602534068634195e-08,
+    2.75573137070700676789e-06,  -1.98412698298579493134e-04,
+    8.33333333332248946124e-03,  -1.66666666666666324348e-01};
+static const double kCosCoefficients[6] = {
+    -1.13596475577881948265e-11, 2.08757232129817482790e-09,
+    -2.75573143513906633035e-07, 2.48015872894767294178e-05,
+    -1.38888888888741095749e-03, 4.16666666666666019037e-02};
+
+__m128i SwapDoublePair(__m128i bytes) {
+  bytes = _mm_or_si128(_mm_slli_epi16(bytes, 8), _mm_srli_epi16(bytes, 8));
+  bytes = _mm_shufflelo_epi16(bytes, _MM_SHUFFLE(0, 1, 2, 3));
+  return _mm_shufflehi_epi16(bytes, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+__m128d EvaluatePolynomial(__m128d x, const double* coefficients, int count) {
+  __m128d sum = _mm_set1_pd(coefficients[0]);
+  for (int i = 1; i < count; i++) {
+    sum = _mm_add_pd(_mm_mul_pd(sum, x), _mm_set1_pd(coefficients[i]));
+  }
+  return sum;
+}
+
+__m128d AbsPair(__m128d x) {
+  return _mm_andnot_pd(_mm_set1_pd(-0.0), x);
+}
+
+__m128d SinCosPair(__m128d x, bool cosine, __m128d* in_range) {
+  *in_range = _mm_cmplt_pd(AbsPair(x), _mm_set1_pd(1e5));
+  __m128i k =
+      _mm_cvtpd_epi32(_mm_mul_pd(x, _mm_set1_pd(0.63661977236758134308)));
+  __m128d kd = _mm_cvtepi32_pd(k);
+  __m128d r = _mm_sub_pd(x,
+                         _mm_mul_pd(kd, _mm_set1_pd(1.57079632673412561417)));
+  r = _mm_sub_pd(r, _mm_mul_pd(kd, _mm_set1_pd(6.07710050630396597660e-11)));
+  r = _mm_sub_pd(r, _mm_mul_pd(kd, _mm_set1_pd(2.02226624871116645580e-21)));
+  __m128d z = _mm_mul_pd(r, r);
+  __m128d sin_r = _mm_add_pd(
+      r, _mm_mul_pd(_mm_mul_pd(r, z),
+                    EvaluatePolynomial(z, kSinCoefficients, 6)));
+  __m128d cos_r = _mm_add_pd(
+      _mm_sub_pd(_mm_set1_pd(1.0), _mm_mul_pd(z, _mm_set1_pd(0.5))),
+      _mm_mul_pd(_mm_mul_pd(z, z),
+                 EvaluatePolynomial(z, kCosCoefficients, 6)));
+  // cos(x) is sin(x) one quadrant further. Odd quadrants use the cosine
+  // polynomial and the upper two are negated.
+  if (cosine) {
+    k = _mm_add_epi32(k, _mm_set1_epi32(1));
+  }
+  __m128i quadrant = _mm_shuffle_epi32(k, _MM_SHUFFLE(1, 1, 0, 0));
+  __m128d odd = _mm_castsi128_pd(
+      _mm_cmpeq_epi32(_mm_and_si128(quadrant, _mm_set1_epi32(1)),
+                      _mm_set1_epi32(1)));
+  __m128d sign = _mm_castsi128_pd(
+      _mm_slli_epi64(_mm_and_si128(quadrant, _mm_set1_epi32(2)), 62));
+  return _mm_xor_pd(
+      _mm_or_pd(_mm_and_pd(odd, cos_r), _mm_andnot_pd(odd, sin_r)), sign);
+}
+#endif
+
+void MapDoubles(void* destination, const void* source, size_t count,
+                int function) {
+  uint8_t* output = (uint8_t*)destination;
+  const uint8_t* input = (const uint8_t*)source;
+  size_t i = 0;
+#ifdef AQ_SSE2
+  if (function == AQ_MATH_SIN || function == AQ_MATH_COS) {
+    for (; i + 2 <= count; i += 2) {
+      __m128d x = _mm_castsi128_pd(
+          SwapDoublePair(_mm_loadu_si128((const __m128i*)(input + 8 * i))));
+      __m128d in_range;
+      __m128d y = SinCosPair(x, function == AQ_MATH_COS, &in_range);
+      int lanes = _mm_movemask_pd(in_range);
+      if (lanes != 3) {
+        double values[2], results[2];
+        _mm_storeu_pd(values, x);
+        _mm_storeu_pd(results, y);
+        for (int lane = 0; lane < 2; lane++) {
+          if ((lanes & (1 << lane)) == 0) {
+            results[lane] = ApplyMath(values[lane], function);
+          }
+        }
+        y = _mm_loadu_pd(results);
+      }
+      _mm_storeu_si128((__m128i*)(output + 8 * i),
+                       SwapDoublePair(_mm_castpd_si128(y)));
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    double value;
+    memcpy(&value, input + 8 * i, sizeof(value));
+    value = SwapDouble(ApplyMath(SwapDouble(value), function));
+    memcpy(output + 8 * i, &value, sizeof(value));
+  }
+}
+
+// math_exp(destination, source, count) and the log, sin and cos variants
+// write the function of |count| doubles at |source| to |destination|, which
+// may be the same block.
+void MapDoublesNative(struct VM* vm, InternalObject args, size_t return_value,
+                      int function) {
+  void* destination = GetPtrData(vm, args.index[0]);
+  const void* source = GetPtrData(vm, args.index[1]);
+  long count = GetLongData(vm, args.index[2]);
+  if (destination != NULL && source != NULL && count > 0) {
+    MapDoubles(destination, source, count, function);
+  }
+  SetLongData(vm, return_value, 0);
+}
+
+void math_exp(struct VM* vm, InternalObject args, size_t return_value) {
+  MapDoublesNative(vm, args, return_value, AQ_MATH_EXP);
+}
+
+void math_log(struct VM* vm, InternalObject args, size_t return_value) {
+  MapDoublesNative(vm, args, return_value, AQ_MATH_LOG);
+}
+
+void math_sin(struct VM* vm, InternalObject args, size_t return_value) {
+  MapDoublesNative(vm, args, return_value, AQ_MATH_SIN);
+}
+
+void math_cos(struct VM* vm, InternalObject args, size_t return_value) {
+  MapDoublesNative(vm, args, return_value, AQ_MATH_COS);
+}
+
+void print(struct VM* vm, InternalObject args, size_t return_value) {
+  SetIntData(vm, return_value,
+             fprintf(vm->output, (char*)GetPtrData(vm, *args.index)));
+}
+
+void argc(struct VM* vm, InternalObject args, size_t return_value) {
+  (void)args;
+  SetLongData(vm, return_value, vm->argc);
+}
+
+void argv(struct VM* vm, InternalObject args, size_t return_value) {
+  long index = GetLongData(vm, *args.index);
+  SetPtrData(vm, return_value,
+             index >= 0 && index < vm->argc ? vm->argv[index] : NULL);
+}
+
+// sleep(milliseconds). On a green thread only the thread waits.
+void sleep_native(struct VM* vm, InternalObject args, size_t return_value) {
+  if (vm->deadline == 0) {
+    vm->deadline = CurrentTime() + GetLongData(vm, *args.index) * 1000000;
+  }
+  if (vm->deadline > CurrentTime() && BlockGreenThread(vm, vm->deadline)) {
+    return;
+  }
+  SleepUntil(vm->deadline);
+  vm->deadline = 0;
+  SetIntData(vm, return_value, 0);
+}
+
+unsigned int hash(const char* str) {
+  unsigned long hash = 5381;
+  int c;
+  while (c = *str++) {
+    hash = ((hash << 5) + hash) + c;
+  }
+  return hash % 1024;
+}
+
+void AddFunction(struct LinkedList* list, char* name, func_ptr func) {
+  unsigned int name_hash = hash(name);
+  struct LinkedList* table = &list[name_hash];
+  while (table->next != NULL) {
+    table = table->next;
+  }
+  table->pair.first = name;
+  table->pair.second = func;
+  table->next = (struct LinkedList*)malloc(sizeof(struct LinkedList));
+  table->next->next = NULL;
+  table->next->pair.first = NULL;
+  table->next->pair.second = NULL;
+}
+
+void InitializeNameTable(struct LinkedList* list) {
+  AddFunction(list, "print", print);
+  AddFunction(list, "argc", argc);
+  AddFunction(list, "argv", argv);
+  AddFunction(list, "sleep", sleep_native);
+#ifdef AQ_THREADS
+  AddFunction(list, "channel", channel);
+  AddFunction(list, "channel_spsc", channel_spsc);
+  AddFunction(list, "channel_open", channel_open);
+  AddFunction(list, "channel_send", channel_send);
+  AddFunction(list, "channel_send_block", channel_send_block);
+  AddFunction(list, "channel_recv", channel_recv);
+  AddFunction(list, "channel_close", channel_close);
+#endif
+#ifdef AQ_EVENTS
+  AddFunction(list, "io_open", io_open);
+  AddFunction(list, "io_pipe", io_pipe);
+  AddFunction(list, "io_listen", io_listen);
+  AddFunction(list, "io_port", io_port);
+  AddFunction(list, "io_accept", io_accept);
+  AddFunction(list, "io_connect", io_connect);
+  AddFunction(list, "io_read", io_read);
+  AddFunction(list, "io_write", io_write);
+  AddFunction(list, "io_close", io_close);
+#endif
+#ifdef AQ_IO_URING
+  AddFunction(list, "file_open", file_open);
+  AddFunction(list, "file_read", file_read);
+  AddFunction(list, "file_write", file_write);
+  AddFunction(list, "file_readv", file_readv);
+  AddFunction(list, "file_fsync", file_fsync);
+  AddFunction(list, "file_close", file_close);
+  AddFunction(list, "file_buffer", file_buffer);
+  AddFunction(list, "file_buffer_free", file_buffer_free);
+#endif
+#ifdef AQ_MAPPED_FILES
+  AddFunction(list, "file_map", file_map);
+  AddFunction(list, "file_map_size", file_map_size);
+  AddFunction(list, "file_advise", file_advise);
+  AddFunction(list, "file_unmap", file_unmap);
+#endif
+  AddFunction(list, "json_parse", json_parse);
+  AddFunction(list, "json_get", json_get);
+  AddFunction(list, "json_type", json_type);
+  AddFunction(list, "json_count", json_count);
+  AddFunction(list, "json_key", json_key);
+  AddFunction(list, "json_free", json_free);
+  AddFunction(list, "hash_bytes", hash_bytes);
+  AddFunction(list, "hash_string", hash_string);
+  AddFunction(list, "hash_long", hash_long);
+  AddFunction(list, "crc32c", crc32c);
+  AddFunction(list, "math_exp", math_exp);
+  AddFunction(list, "math_log", math_log);
+  AddFunction(list, "math_sin", math_sin);
+  AddFunction(list, "math_cos", math_cos);
+#ifdef AQ_READERS
+  AddFunction(list, "reader_open", reader_open);
+  AddFunction(list, "reader_lines", reader_lines);
+  AddFunction(list, "reader_fields", reader_fields);
+  AddFunction(list, "reader_close", reader_close);
+#endif
+}
+
+func_ptr GetFunction(const struct LinkedList* list, const char* name) {
+  unsigned int name_hash = hash(name);
+  const struct LinkedList* table = &list[name_hash];
+  while (table != NULL && table->pair.first != NULL) {
+    if (strcmp(table->pair.first, name) == 0) {
+      return table->pair.second;
+    }
+    table = table->next;
+  }
+  return (func_ptr)NULL;
+}
+
+void DeinitializeNameTable(struct LinkedList* list) {
+  for (size_t i = 0; i < 1024; i++) {
+    struct LinkedList* table = list[i].next;
+    struct LinkedList* next;
+    while (table != NULL) {
+      next = table->next;
+      free(table);
+      table = next;
+    }
+    list[i].next = NULL;
+    list[i].pair.first = NULL;
+    list[i].pair.second = NULL;
+  }
+}
+
+int ExecuteVM(struct VM* vm) {
+  void* pc = vm->pc;
   size_t first, second, result, operand1, operand2, opcode, arg_count,
       return_value;
-  while (bytecode_file < bytecode_end) {
-    // fprintf(stderr, "Current operand: %02x\n", *(uint8_t*)bytecode_file);
-    switch (*(uint8_t*)bytecode_file) {
+  size_t* slots;
+  void* start;
+  int status;
+  bool scheduled;
+  if (vm->scheduler != NULL) {
+    vm->green_remaining = vm->scheduler->budget;
+  }
+  size_t ticks = StartSlice(vm);
+#ifdef AQ_PROFILER
+  // Read once so that runs without a profiler skip the store below.
+  bool profiled = atomic_load(&profile_running);
+  vm->executing = NULL;
+#endif
+  while (pc < vm->end) {
+    // fprintf(stderr, "Current operand: %02x\n", *(uint8_t*)pc);
+#ifdef AQ_PROFILER
+    if (profiled) {
+      vm->executing = pc;
+    }
+#endif
+    switch (*(uint8_t*)pc) {
       case 0x00:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
+        pc = (void*)((uintptr_t)pc + 1);
         NOP();
         break;
       case 0x01:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file = Get2Parament(bytecode_file, &first, &second);
-        LOAD(first, second);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &first, &second);
+        LOAD(vm, first, second);
         break;
       case 0x02:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file = Get2Parament(bytecode_file, &first, &second);
-        STORE(first, second);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &first, &second);
+        STORE(vm, first, second);
         break;
       case 0x03:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file = Get2Parament(bytecode_file, &first, &second);
-        NEW(first, second);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &first, &second);
+        NEW(vm, first, second);
         break;
       case 0x04:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file = Get1Parament(bytecode_file, &first);
-        FREE(first);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get1Parament(pc, &first);
+        FREE(vm, first);
         break;
       case 0x05:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file = Get2Parament(bytecode_file, &first, &second);
-        PTR(first, second);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &first, &second);
+        PTR(vm, first, second);
         break;
       case 0x06:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file =
-            Get3Parament(bytecode_file, &result, &operand1, &operand2);
-        ADD(result, operand1, operand2);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        ADD(vm, result, operand1, operand2);
         break;
       case 0x07:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file =
-            Get3Parament(bytecode_file, &result, &operand1, &operand2);
-        SUB(result, operand1, operand2);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        SUB(vm, result, operand1, operand2);
         break;
       case 0x08:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file =
-            Get3Parament(bytecode_file, &result, &operand1, &operand2);
-        MUL(result, operand1, operand2);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        MUL(vm, result, operand1, operand2);
         break;
       case 0x09:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file =
-            Get3Parament(bytecode_file, &result, &operand1, &operand2);
-        DIV(result, operand1, operand2);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        DIV(vm, result, operand1, operand2);
         break;
       case 0x0A:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file =
-            Get3Parament(bytecode_file, &result, &operand1, &operand2);
-        REM(result, operand1, operand2);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        REM(vm, result, operand1, operand2);
         break;
       case 0x0B:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file = Get2Parament(bytecode_file, &result, &operand1);
-        NEG(result, operand1);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &result, &operand1);
+        NEG(vm, result, operand1);
         break;
       case 0x0C:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file =
-            Get3Parament(bytecode_file, &result, &operand1, &operand2);
-        SHL(result, operand1, operand2);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        SHL(vm, result, operand1, operand2);
         break;
       case 0x0D:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file =
-            Get3Parament(bytecode_file, &result, &operand1, &operand2);
-        SHR(result, operand1, operand2);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        SHR(vm, result, operand1, operand2);
         break;
       case 0x0E:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file =
-            Get3Parament(bytecode_file, &result, &operand1, &operand2);
-        SAR(result, operand1, operand2);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        SAR(vm, result, operand1, operand2);
         break;
       case 0x0F:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file =
-            Get3Parament(bytecode_file, &result, &operand1, &operand2);
-        IF(run_code, result, operand1, operand2);
+        start = pc;
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        pc = IF(vm, vm->run_code, result, operand1, operand2);
+        if (pc <= start && --ticks == 0) {
+          vm->pc = pc;
+          if ((status = EndSlice(vm)) != 0) {
+            return status;
+          }
+          ticks = StartSlice(vm);
+        }
         break;
       case 0x10:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file =
-            Get3Parament(bytecode_file, &result, &operand1, &operand2);
-        AND(result, operand1, operand2);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        AND(vm, result, operand1, operand2);
         break;
       case 0x11:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file =
-            Get3Parament(bytecode_file, &result, &operand1, &operand2);
-        OR(result, operand1, operand2);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        OR(vm, result, operand1, operand2);
         break;
       case 0x12:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file =
-            Get3Parament(bytecode_file, &result, &operand1, &operand2);
-        XOR(result, operand1, operand2);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        XOR(vm, result, operand1, operand2);
         break;
       case 0x13:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file =
-            Get4Parament(bytecode_file, &result, &opcode, &operand1, &operand2);
-        CMP(result, opcode, operand1, operand2);
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get4Parament(pc, &result, &opcode, &operand1, &operand2);
+        CMP(vm, result, opcode, operand1, operand2);
         break;
       case 0x14:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file = GetUnknownCountParamentAndINVOKE(
-            bytecode_file, &return_value, &arg_count);
+        start = pc;
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = GetUnknownCountParamentAndINVOKE(vm, pc, &return_value,
+                                              &arg_count);
+        if (vm->blocked) {
+          vm->pc = start;
+          ChargeSlice(vm, ticks);
+          return VM_YIELDED;
+        }
+        if (--ticks == 0) {
+          vm->pc = pc;
+          if ((status = EndSlice(vm)) != 0) {
+            return status;
+          }
+          ticks = StartSlice(vm);
+        }
         break;
       case 0x15:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
+        pc = (void*)((uintptr_t)pc + 1);
         RETURN();
-        break;
+        vm->pc = pc;
+        ChargeSlice(vm, ticks);
+        return 0;
       case 0x16:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
-        bytecode_file = Get1Parament(bytecode_file, &operand1);
-        bytecode_file = GOTO(run_code, operand1);
+        start = pc;
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get1Parament(pc, &operand1);
+        pc = GOTO(vm, vm->run_code, operand1);
+        if (pc <= start && --ticks == 0) {
+          vm->pc = pc;
+          if ((status = EndSlice(vm)) != 0) {
+            return status;
+          }
+          ticks = StartSlice(vm);
+        }
         break;
       case 0x17:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
+        pc = (void*)((uintptr_t)pc + 1);
         THROW();
         break;
+      case 0x18:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get4Parament(pc, &result, &operand1, &operand2, &opcode);
+        PARFOR(vm, result, operand1, operand2, opcode);
+        break;
+      case 0x19:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &result, &operand1);
+        pc = GetParamentList(pc, &arg_count, &slots);
+        SPAWN(vm, result, operand1, arg_count, slots);
+        free(slots);
+        break;
+      case 0x1A:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get1Parament(pc, &result);
+        pc = GetParamentList(pc, &arg_count, &slots);
+        JOIN(vm, result, arg_count, slots);
+        free(slots);
+        break;
+      case 0x1B:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &result, &operand1);
+        pc = GetParamentList(pc, &arg_count, &slots);
+        scheduled = vm->scheduler != NULL;
+        GREEN(vm, result, operand1, arg_count, slots);
+        free(slots);
+        if (!scheduled && vm->scheduler != NULL) {
+          vm->green_remaining = vm->scheduler->budget;
+          ticks = ResumeSlice(vm, ticks);
+        }
+        break;
+      case 0x1C:
+        pc = (void*)((uintptr_t)pc + 1);
+        if (vm->scheduler != NULL) {
+          vm->pc = pc;
+          ChargeSlice(vm, ticks);
+          return VM_YIELDED;
+        }
+        break;
+      case 0x1D:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        ATOMIC_ADD(vm, result, operand1, operand2);
+        break;
+      case 0x1E:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get4Parament(pc, &result, &operand1, &operand2, &opcode);
+        CAS(vm, result, operand1, operand2, opcode);
+        break;
+      case 0x1F:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        XCHG(vm, result, operand1, operand2);
+        break;
+      case 0x20:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &result, &operand1);
+        LOAD_ACQUIRE(vm, result, operand1);
+        break;
+      case 0x21:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &operand1, &operand2);
+        STORE_RELEASE(vm, operand1, operand2);
+        break;
+      case 0x22:
+        pc = (void*)((uintptr_t)pc + 1);
+        FENCE();
+        break;
+      case 0x23:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &result, &operand1);
+        POPCNT(vm, result, operand1);
+        break;
+      case 0x24:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &result, &operand1);
+        CLZ(vm, result, operand1);
+        break;
+      case 0x25:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &result, &operand1);
+        CTZ(vm, result, operand1);
+        break;
+      case 0x26:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &result, &operand1);
+        BSWAP(vm, result, operand1);
+        break;
+      case 0x27:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        ROTL(vm, result, operand1, operand2);
+        break;
+      case 0x28:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        ROTR(vm, result, operand1, operand2);
+        break;
+      case 0x29:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get4Parament(pc, &result, &operand1, &operand2, &opcode);
+        FMA(vm, result, operand1, operand2, opcode);
+        break;
+      case 0x2A:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &result, &operand1);
+        SQRT(vm, result, operand1);
+        break;
+      case 0x2B:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        MIN(vm, result, operand1, operand2);
+        break;
+      case 0x2C:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get3Parament(pc, &result, &operand1, &operand2);
+        MAX(vm, result, operand1, operand2);
+        break;
+      case 0x2D:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &result, &operand1);
+        ABS(vm, result, operand1);
+        break;
+      case 0x2E:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &result, &operand1);
+        FLOOR(vm, result, operand1);
+        break;
+      case 0x2F:
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get2Parament(pc, &result, &operand1);
+        CEIL(vm, result, operand1);
+        break;
+      case 0x30:
+        start = pc;
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get4Parament(pc, &result, &operand1, &operand2, &opcode);
+        pc = ADD_CHECKED(vm, pc, result, operand1, operand2, opcode);
+        if (pc <= start && --ticks == 0) {
+          vm->pc = pc;
+          if ((status = EndSlice(vm)) != 0) {
+            return status;
+          }
+          ticks = StartSlice(vm);
+        }
+        break;
+      case 0x31:
+        start = pc;
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get4Parament(pc, &result, &operand1, &operand2, &opcode);
+        pc = SUB_CHECKED(vm, pc, result, operand1, operand2, opcode);
+        if (pc <= start && --ticks == 0) {
+          vm->pc = pc;
+          if ((status = EndSlice(vm)) != 0) {
+            return status;
+          }
+          ticks = StartSlice(vm);
+        }
+        break;
+      case 0x32:
+        start = pc;
+        pc = (void*)((uintptr_t)pc + 1);
+        pc = Get4Parament(pc, &result, &operand1, &operand2, &opcode);
+        pc = MUL_CHECKED(vm, pc, result, operand1, operand2, opcode);
+        if (pc <= start && --ticks == 0) {
+          vm->pc = pc;
+          if ((status = EndSlice(vm)) != 0) {
+            return status;
+          }
+          ticks = StartSlice(vm);
+        }
+        break;
       case 0xFF:
-        bytecode_file = (void*)((uintptr_t)bytecode_file + 1);
+        pc = (void*)((uintptr_t)pc + 1);
         WIDE();
         break;
       default:
         break;
     }
   }
+  vm->pc = pc;
+  ChargeSlice(vm, ticks);
+  return 0;
+}
+
+int RunVM(struct VM* vm) {
+#ifdef AQ_PROFILER
+  struct ProfileFrame frame;
+  PushProfileFrame(&frame, vm);
+  int status = ExecuteVM(vm);
+  PopProfileFrame(&frame);
+  return status;
+#else
+  return ExecuteVM(vm);
+#endif
+}
+
+int LoadProgram(void* bytecode, size_t bytecode_size,
+                struct Program** program) {
+  if (bytecode_size < 16 || ((char*)bytecode)[0] != 0x41 ||
+      ((char*)bytecode)[1] != 0x51 || ((char*)bytecode)[2] != 0x42 ||
+      ((char*)bytecode)[3] != 0x43) {
+    free(bytecode);
+    return AQ_ERROR_INVALID;
+  }
+
+  uint64_t temp;
+  memcpy(&temp, (void*)((uintptr_t)bytecode + 8), sizeof(uint64_t));
+  temp = SwapUint64t(temp);
+  size_t memory_size = temp;
+  if (memory_size > bytecode_size ||
+      16 + memory_size + memory_size / 2 + 1 > bytecode_size) {
+    free(bytecode);
+    return AQ_ERROR_INVALID;
+  }
+
+  struct Program* program_ptr =
+      (struct Program*)malloc(sizeof(struct Program));
+  if (program_ptr == NULL) {
+    free(bytecode);
+    return AQ_ERROR_MEMORY;
+  }
+  program_ptr->bytecode = bytecode;
+  program_ptr->bytecode_size = bytecode_size;
+  program_ptr->memory_size = memory_size;
+  program_ptr->data = (void*)((uintptr_t)bytecode + 16);
+  program_ptr->type = (uint8_t*)((uintptr_t)program_ptr->data + memory_size);
+  program_ptr->run_code =
+      (void*)((uintptr_t)program_ptr->type + memory_size / 2 + 1);
+  program_ptr->end = (void*)((uintptr_t)bytecode + bytecode_size);
+  CreateMemoryTemplate(program_ptr);
+
+  *program = program_ptr;
+  return AQ_OK;
+}
+
+static int aq_initialized = 0;
+
+void AqInitialize(void) {
+  if (aq_initialized++ == 0) {
+    InitializeNameTable(name_table);
+    InitializeCrc32c();
+    InitializeBitOperations();
+    InitializeMathOperations();
+  }
+}
+
+void AqDeinitialize(void) {
+  if (aq_initialized > 0 && --aq_initialized == 0) {
+    FreeGlobalThreadPool();
+#ifdef AQ_THREADS
+    FreeNamedChannels();
+#endif
+#ifdef AQ_PROFILER
+    FreeProfile();
+#endif
+    DeinitializeNameTable(name_table);
+  }
+}
+
+int AqLoadProgram(const char* path, AqProgram** program) {
+  FILE* bytecode = fopen(path, "rb");
+  if (bytecode == NULL) {
+    return AQ_ERROR_OPEN;
+  }
+
+  fseek(bytecode, 0, SEEK_END);
+  size_t bytecode_size = ftell(bytecode);
+  void* bytecode_file = malloc(bytecode_size);
+  if (bytecode_file == NULL) {
+    fclose(bytecode);
+    return AQ_ERROR_MEMORY;
+  }
+  fseek(bytecode, 0, SEEK_SET);
+  size_t read_size = fread(bytecode_file, 1, bytecode_size, bytecode);
+  fclose(bytecode);
+  if (read_size != bytecode_size) {
+    free(bytecode_file);
+    return AQ_ERROR_OPEN;
+  }
+
+  return LoadProgram(bytecode_file, bytecode_size, program);
+}
+
+int AqLoadProgramFromMemory(const void* buffer, size_t size,
+                            AqProgram** program) {
+  void* bytecode = malloc(size);
+  if (bytecode == NULL) {
+    return AQ_ERROR_MEMORY;
+  }
+  memcpy(bytecode, buffer, size);
+  return LoadProgram(bytecode, size, program);
+}
+
+void AqFreeProgram(AqProgram* program) {
+  FreeMemoryTemplate(program);
+  free(program->bytecode);
+  free(program);
+}
+
+AqVM* AqCreateVM(const AqProgram* program) { return CreateProgramVM(program); }
+
+int AqRunVM(AqVM* vm) { return RunVMThreads(vm); }
+
+void AqResetVM(AqVM* vm) {
+  DiscardGreenThreads(vm);
+  JoinSpawnedTasks(vm);
+  ResetRing(vm);
+  FreeAllHeap(vm);
+  UnmapFiles(vm);
+  ResetInstanceMemory(vm);
+  vm->pc = vm->program->run_code;
+  vm->blocked = false;
+  vm->deadline = 0;
+  vm->wait_fd = -1;
+}
+
+void AqFreeVM(AqVM* vm) {
+  DiscardGreenThreads(vm);
+  FreeInstanceMemory(vm);
+  FreeVM(vm);
+}
+
+void AqSetVMOutput(AqVM* vm, FILE* output) { vm->output = output; }
+
+void AqSetVMScheduler(AqVM* vm, int policy, size_t budget) {
+  vm->schedule_policy = policy;
+  vm->schedule_budget = budget != 0 ? budget : 1024;
+}
+
+void AqSetVMTimeSlice(AqVM* vm, size_t budget, long long nanoseconds) {
+  vm->slice_budget = budget;
+  vm->slice_time = nanoseconds;
+}
+
+void AqSetVMArguments(AqVM* vm, int argc, char** argv) {
+  vm->argc = argc;
+  vm->argv = argv;
+}
+
+void AqSetThreadCount(size_t count) { thread_count = count; }
+
+void AqSetPlacement(int enabled) {
+#ifdef AQ_NUMA
+  placement_enabled = enabled != 0;
+#endif
+}
+
+void AqPrintPlacement(FILE* output) {
+#ifdef AQ_NUMA
+  if (!placement_enabled) {
+    fprintf(output, "Placement: disabled\n");
+    return;
+  }
+  pthread_once(&topology_once, LoadTopology);
+  fprintf(output, "Placement: %zu node(s)\n", node_count);
+  struct ThreadPool* pool = atomic_load(&thread_pool);
+  for (size_t i = 0; pool != NULL && i < pool->size; i++) {
+    int cpu = pool->workers[i].cpu;
+    if (cpu >= 0) {
+      fprintf(output, "  worker %zu: cpu %d, node %d\n", i, cpu,
+              cpu_nodes[cpu]);
+    } else {
+      fprintf(output, "  worker %zu: not pinned\n", i);
+    }
+  }
+  for (size_t node = 0; node < node_count && node < AQ_MAX_NODES; node++) {
+    fprintf(output, "  node %zu: %zu instance(s)\n", node,
+            atomic_load(&node_instances[node]));
+  }
+#else
+  fprintf(output, "Placement: not supported\n");
+#endif
+}
 
-  printf("\nProgram finished\n");
-  DeinitializeNameTable(name_table);
-  FreeMemory(memory);
-  free(bytecode_begin);
+struct JobRun {
+  struct PoolTask task;
+  AqJob* job;
+  struct JobBatch* batch;
+  char* output;
+  size_t output_size;
+#ifdef AQ_THREADS
+  atomic_bool done;
+#else
+  bool done;
+#endif
+};
 
-  /*QueryPerformanceCounter(&end);
-  elapsedTime = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
-  printf("Elapsed time: %f seconds\n", elapsedTime);*/
+struct JobBatch {
+  struct JobRun* runs;
+  size_t count;
+  size_t next_flush;
+  FILE* output;
+#ifdef AQ_THREADS
+  pthread_mutex_t flush_lock;
+#endif
+};
 
-  return 0;
+// Writes the output of finished jobs in job order. Whoever finishes the job
+// at |next_flush| drains every consecutive finished job behind it.
+void FlushJobs(struct JobBatch* batch) {
+#ifdef AQ_THREADS
+  pthread_mutex_lock(&batch->flush_lock);
+  while (batch->next_flush < batch->count &&
+         atomic_load(&batch->runs[batch->next_flush].done)) {
+    struct JobRun* run = &batch->runs[batch->next_flush];
+    fwrite(run->output, 1, run->output_size, batch->output);
+    free(run->output);
+    batch->next_flush++;
+  }
+  fflush(batch->output);
+  pthread_mutex_unlock(&batch->flush_lock);
+#endif
+}
+
+void RunJob(struct PoolTask* task) {
+  struct JobRun* run = (struct JobRun*)task;
+  AqJob* job = run->job;
+#ifdef AQ_THREADS
+  FILE* output = open_memstream(&run->output, &run->output_size);
+#else
+  FILE* output = run->batch->output;
+#endif
+
+  AqVM* vm = NULL;
+  if (job->isolation != NULL) {
+    job->status = AqForkServerRun(job->isolation, job->argc, job->argv, output);
+  } else if ((vm = AqCreateVM(job->program)) == NULL) {
+    job->status = AQ_ERROR_MEMORY;
+  } else {
+    AqSetVMOutput(vm, output);
+    AqSetVMArguments(vm, job->argc, job->argv);
+    fprintf(output, "\nProgram started.\n");
+    job->status = AqRunVM(vm);
+    fprintf(output, "\nProgram finished\n");
+    AqFreeVM(vm);
+  }
+
+#ifdef AQ_THREADS
+  fclose(output);
+  atomic_store(&run->done, true);
+#endif
+  FlushJobs(run->batch);
+}
+
+int AqRunJobs(AqJob* jobs, size_t count, FILE* output) {
+  struct JobBatch batch;
+  batch.runs = (struct JobRun*)malloc(count * sizeof(struct JobRun));
+  if (batch.runs == NULL) {
+    return AQ_ERROR_MEMORY;
+  }
+  batch.count = count;
+  batch.next_flush = 0;
+  batch.output = output;
+#ifdef AQ_THREADS
+  pthread_mutex_init(&batch.flush_lock, NULL);
+#endif
+
+  struct ThreadPool* pool = GetThreadPool();
+  struct TaskGroup group;
+  InitializeTaskGroup(&group);
+  for (size_t i = 0; i < count; i++) {
+    batch.runs[i].job = &jobs[i];
+    batch.runs[i].batch = &batch;
+    batch.runs[i].output = NULL;
+    batch.runs[i].output_size = 0;
+#ifdef AQ_THREADS
+    atomic_init(&batch.runs[i].done, false);
+#endif
+  }
+  for (size_t i = 0; i < count; i++) {
+    batch.runs[i].task.run = RunJob;
+    SubmitTask(pool, &group, &batch.runs[i].task);
+  }
+  WaitTaskGroup(pool, &group);
+
+#ifdef AQ_THREADS
+  pthread_mutex_destroy(&batch.flush_lock);
+#endif
+  free(batch.runs);
+
+  int status = AQ_OK;
+  for (size_t i = 0; i < count; i++) {
+    if (jobs[i].status != AQ_OK) {
+      status = jobs[i].status;
+    }
+  }
+  return status;
+}
+
+#ifdef AQ_THREADS
+struct ServedProgram {
+  char* path;
+  AqProgram* program;
+  struct ServedProgram* next;
+};
+
+struct Server {
+  struct ThreadPool* pool;
+  struct TaskGroup group;
+  // Programs are loaded on first request and kept for the server's lifetime.
+  struct ServedProgram* programs;
+  pthread_mutex_t lock;
+};
+
+struct ServeRequest {
+  struct PoolTask task;
+  struct Server* server;
+  int fd;
+};
+
+// Seconds a client may stay silent while sending its request before the
+// worker reading it gives up, so idle connections cannot hold the pool.
+#define SERVE_READ_TIMEOUT 10
+
+bool ReadAll(int fd, void* buffer, size_t size) {
+  while (size > 0) {
+    ssize_t count = read(fd, buffer, size);
+    if (count <= 0) {
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buffer = (char*)buffer + count;
+    size -= count;
+  }
+  return true;
+}
+
+bool WriteAll(int fd, const void* buffer, size_t size) {
+  while (size > 0) {
+    ssize_t count = send(fd, buffer, size, MSG_NOSIGNAL);
+    if (count <= 0) {
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buffer = (const char*)buffer + count;
+    size -= count;
+  }
+  return true;
+}
+
+bool WriteFrame(int fd, char type, const void* payload, uint32_t size) {
+  char header[5];
+  header[0] = type;
+  memcpy(header + 1, &size, sizeof(size));
+  return WriteAll(fd, header, sizeof(header)) && WriteAll(fd, payload, size);
+}
+
+#ifdef __linux__
+ssize_t WriteServedOutput(void* cookie, const char* buffer, size_t size) {
+  if (!WriteFrame((int)(intptr_t)cookie, AQ_SERVE_OUTPUT, buffer, size)) {
+    return -1;
+  }
+  return size;
+}
+#endif
+
+int GetServedProgram(struct Server* server, const char* path,
+                     const AqProgram** program) {
+  int status = AQ_OK;
+  pthread_mutex_lock(&server->lock);
+  struct ServedProgram* served = server->programs;
+  while (served != NULL && strcmp(served->path, path) != 0) {
+    served = served->next;
+  }
+  if (served == NULL) {
+    AqProgram* loaded;
+    status = AqLoadProgram(path, &loaded);
+    if (status == AQ_OK) {
+      served = (struct ServedProgram*)malloc(sizeof(struct ServedProgram));
+      served->path = (char*)malloc(strlen(path) + 1);
+      strcpy(served->path, path);
+      served->program = loaded;
+      served->next = server->programs;
+      server->programs = served;
+    }
+  }
+  pthread_mutex_unlock(&server->lock);
+  *program = served != NULL ? served->program : NULL;
+  return status;
+}
+
+// Reads a request: a count followed by that many length-prefixed strings, the
+// first of which is the program path.
+char** ReadServeArguments(int fd, uint32_t* argc) {
+  if (!ReadAll(fd, argc, sizeof(*argc)) || *argc == 0 || *argc > 4096) {
+    return NULL;
+  }
+  char** argv = (char**)calloc(*argc + 1, sizeof(char*));
+  for (uint32_t i = 0; i < *argc; i++) {
+    uint32_t size;
+    if (!ReadAll(fd, &size, sizeof(size)) || size > (1 << 20) ||
+        (argv[i] = (char*)malloc(size + 1)) == NULL ||
+        !ReadAll(fd, argv[i], size)) {
+      for (uint32_t j = 0; j <= i; j++) {
+        free(argv[j]);
+      }
+      free(argv);
+      return NULL;
+    }
+    argv[i][size] = '\0';
+  }
+  return argv;
+}
+
+// Runs |vm| with the given arguments, streaming its output to |fd| as it is
+// written.
+int RunServedVM(int fd, AqVM* vm, uint32_t argc, char** argv) {
+#ifdef __linux__
+  cookie_io_functions_t functions = {NULL, WriteServedOutput, NULL, NULL};
+  FILE* output = fopencookie((void*)(intptr_t)fd, "w", functions);
+#else
+  char* buffer = NULL;
+  size_t size = 0;
+  FILE* output = open_memstream(&buffer, &size);
+#endif
+  AqSetVMOutput(vm, output);
+  AqSetVMArguments(vm, (int)argc, argv);
+  fprintf(output, "\nProgram started.\n");
+  int status = AqRunVM(vm);
+  fprintf(output, "\nProgram finished\n");
+  fclose(output);
+#ifndef __linux__
+  WriteFrame(fd, AQ_SERVE_OUTPUT, buffer, size);
+  free(buffer);
+#endif
+  return status;
+}
+
+// Runs one request on a fresh VM, streaming its output back as it is written
+// and finishing with a status frame.
+void ServeRequest(struct PoolTask* task) {
+  struct ServeRequest* request = (struct ServeRequest*)task;
+  uint32_t argc;
+  char** argv = ReadServeArguments(request->fd, &argc);
+  if (argv == NULL) {
+    close(request->fd);
+    free(request);
+    return;
+  }
+
+  const AqProgram* program;
+  int32_t status = GetServedProgram(request->server, argv[0], &program);
+  AqVM* vm = NULL;
+  if (status == AQ_OK && (vm = AqCreateVM(program)) == NULL) {
+    status = AQ_ERROR_MEMORY;
+  }
+  if (vm != NULL) {
+    status = RunServedVM(request->fd, vm, argc, argv);
+    AqFreeVM(vm);
+  }
+  WriteFrame(request->fd, AQ_SERVE_STATUS, &status, sizeof(status));
+
+  for (uint32_t i = 0; i < argc; i++) {
+    free(argv[i]);
+  }
+  free(argv);
+  close(request->fd);
+  free(request);
+}
+
+int AqServe(const char* path, size_t workers) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return AQ_ERROR_INVALID;
+  }
+  strcpy(address.sun_path, path);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    return AQ_ERROR_OPEN;
+  }
+  // Only replace a socket left by an earlier server, never another file.
+  struct stat existing;
+  if (lstat(path, &existing) == 0 &&
+      (!S_ISSOCK(existing.st_mode) || unlink(path) != 0)) {
+    close(listener);
+    return AQ_ERROR_OPEN;
+  }
+  if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listener, SOMAXCONN) != 0) {
+    close(listener);
+    return AQ_ERROR_OPEN;
+  }
+
+  struct Server server;
+  if (workers == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cpus > 0 ? (size_t)cpus : 1;
+  }
+  server.pool = CreateThreadPool(workers);
+  InitializeTaskGroup(&server.group);
+  server.programs = NULL;
+  pthread_mutex_init(&server.lock, NULL);
+
+  int status = AQ_OK;
+  while (true) {
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      status = AQ_ERROR_OPEN;
+      break;
+    }
+    struct timeval timeout = {SERVE_READ_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct ServeRequest* request =
+        (struct ServeRequest*)malloc(sizeof(struct ServeRequest));
+    if (request == NULL) {
+      close(fd);
+      continue;
+    }
+    request->task.run = ServeRequest;
+    request->server = &server;
+    request->fd = fd;
+    SubmitTask(server.pool, &server.group, &request->task);
+  }
+
+  WaitTaskGroup(server.pool, &server.group);
+  FreeThreadPool(server.pool);
+  while (server.programs != NULL) {
+    struct ServedProgram* next = server.programs->next;
+    AqFreeProgram(server.programs->program);
+    free(server.programs->path);
+    free(server.programs);
+    server.programs = next;
+  }
+  pthread_mutex_destroy(&server.lock);
+  close(listener);
+  unlink(path);
+  return status;
+}
+struct WarmChild {
+  pid_t pid;
+  int fd;
+};
+
+// Keeps forked children of a process that holds a loaded program and a VM
+// created for it. Each child serves exactly one request over its end of a
+// socket pair and exits, so requests are isolated from each other at the
+// process level while starting from the parent's warm image.
+struct ForkServer {
+  const AqProgram* program;
+  AqVM* vm;
+  struct WarmChild* idle;
+  size_t idle_count;
+  size_t warm;
+  // Sockets of children serving a request, which new children must close so
+  // that a child the parent abandons sees its socket close.
+  int* running;
+  size_t running_count;
+  size_t running_capacity;
+  pthread_mutex_t lock;
+};
+
+// The pool threads of the parent do not exist in a forked child.
+void ResetThreadsAfterFork() {
+  atomic_store(&thread_pool, NULL);
+  pthread_mutex_init(&thread_pool_lock, NULL);
+  pthread_mutex_init(&named_channels_lock, NULL);
+}
+
+void RunWarmChild(struct ForkServer* server, int fd) {
+  for (size_t i = 0; i < server->idle_count; i++) {
+    close(server->idle[i].fd);
+  }
+  for (size_t i = 0; i < server->running_count; i++) {
+    close(server->running[i]);
+  }
+  ResetThreadsAfterFork();
+
+  uint32_t argc;
+  char** argv = ReadServeArguments(fd, &argc);
+  if (argv != NULL) {
+    int32_t status = RunServedVM(fd, server->vm, argc, argv);
+    WriteFrame(fd, AQ_SERVE_STATUS, &status, sizeof(status));
+  }
+  _exit(0);
+}
+
+// Forks a child and adds it to the idle list. Called with |server->lock|
+// held.
+bool ForkWarmChild(struct ForkServer* server) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+    return false;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    RunWarmChild(server, fds[1]);
+  }
+  close(fds[1]);
+  if (pid < 0) {
+    close(fds[0]);
+    return false;
+  }
+  server->idle[server->idle_count].pid = pid;
+  server->idle[server->idle_count].fd = fds[0];
+  server->idle_count++;
+  return true;
+}
+
+AqForkServer* AqCreateForkServer(const AqProgram* program, size_t warm) {
+  struct ForkServer* server =
+      (struct ForkServer*)malloc(sizeof(struct ForkServer));
+  server->program = program;
+  server->vm = AqCreateVM(program);
+  server->warm = warm > 0 ? warm : 1;
+  server->idle =
+      (struct WarmChild*)malloc(server->warm * sizeof(struct WarmChild));
+  server->idle_count = 0;
+  server->running = NULL;
+  server->running_count = 0;
+  server->running_capacity = 0;
+  pthread_mutex_init(&server->lock, NULL);
+  if (server->vm == NULL || server->idle == NULL) {
+    AqFreeForkServer(server);
+    return NULL;
+  }
+  pthread_mutex_lock(&server->lock);
+  while (server->idle_count < server->warm && ForkWarmChild(server)) {
+  }
+  pthread_mutex_unlock(&server->lock);
+  return server;
+}
+
+bool WriteServeArgument(int fd, const char* argument) {
+  uint32_t size = strlen(argument);
+  return WriteAll(fd, &size, sizeof(size)) && WriteAll(fd, argument, size);
+}
+
+// Makes room to record one more running child. Called with |server->lock|
+// held.
+bool ReserveRunningChild(struct ForkServer* server) {
+  if (server->running_count < server->running_capacity) {
+    return true;
+  }
+  size_t capacity =
+      server->running_capacity == 0 ? 16 : 2 * server->running_capacity;
+  int* running = (int*)realloc(server->running, capacity * sizeof(int));
+  if (running == NULL) {
+    return false;
+  }
+  server->running = running;
+  server->running_capacity = capacity;
+  return true;
+}
+
+int AqForkServerRun(AqForkServer* server, int argc, char** argv,
+                    FILE* output) {
+  pthread_mutex_lock(&server->lock);
+  if (!ReserveRunningChild(server) ||
+      (server->idle_count == 0 && !ForkWarmChild(server))) {
+    pthread_mutex_unlock(&server->lock);
+    return AQ_ERROR_MEMORY;
+  }
+  struct WarmChild child = server->idle[--server->idle_count];
+  server->running[server->running_count++] = child.fd;
+  // Replace the child right away so the fork overlaps with the request.
+  ForkWarmChild(server);
+  pthread_mutex_unlock(&server->lock);
+
+  uint32_t count = argc;
+  bool sent = WriteAll(child.fd, &count, sizeof(count));
+  for (int i = 0; sent && i < argc; i++) {
+    sent = WriteServeArgument(child.fd, argv[i]);
+  }
+
+  int32_t status = AQ_ERROR_CHILD;
+  bool finished = false;
+  char header[5];
+  while (sent && ReadAll(child.fd, header, sizeof(header))) {
+    uint32_t size;
+    memcpy(&size, header + 1, sizeof(size));
+    char* payload = (char*)malloc(size);
+    if (payload == NULL || !ReadAll(child.fd, payload, size)) {
+      free(payload);
+      break;
+    }
+    if (header[0] == AQ_SERVE_OUTPUT) {
+      fwrite(payload, 1, size, output);
+    } else if (header[0] == AQ_SERVE_STATUS && size == sizeof(status)) {
+      memcpy(&status, payload, sizeof(status));
+      finished = true;
+    }
+    free(payload);
+  }
+
+  // Closed with the lock held so that no child forked in between inherits
+  // the socket or closes a descriptor that reused its number.
+  pthread_mutex_lock(&server->lock);
+  for (size_t i = 0; i < server->running_count; i++) {
+    if (server->running[i] == child.fd) {
+      server->running[i] = server->running[--server->running_count];
+      break;
+    }
+  }
+  close(child.fd);
+  pthread_mutex_unlock(&server->lock);
+  if (!finished) {
+    // The child may still be running the program; do not wait for it to end
+    // on its own.
+    kill(child.pid, SIGKILL);
+  }
+  waitpid(child.pid, NULL, 0);
+  return status;
+}
+
+void AqFreeForkServer(AqForkServer* server) {
+  for (size_t i = 0; i < server->idle_count; i++) {
+    // Closing the socket makes the child exit without running anything.
+    close(server->idle[i].fd);
+    waitpid(server->idle[i].pid, NULL, 0);
+  }
+  if (server->vm != NULL) {
+    AqFreeVM(server->vm);
+  }
+  pthread_mutex_destroy(&server->lock);
+  free(server->idle);
+  free(server->running);
+  free(server);
+}
+#else
+int AqServe(const char* path, size_t workers) { return AQ_ERROR_INVALID; }
+
+AqForkServer* AqCreateForkServer(const AqProgram* program, size_t warm) {
+  return NULL;
+}
+
+int AqForkServerRun(AqForkServer* server, int argc, char** argv,
+                    FILE* output) {
+  return AQ_ERROR_INVALID;
 }
+
+void AqFreeForkServer(AqForkServer* server) {}
+#endif
@@ -0,0 +1,148 @@
+// Copyright 2024 AQ author, All Rights Reserved.
+// This program is licensed under the AQ License. You can find the AQ license in
+// the root directory.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prototype/aq.h"
+#include "prototype/test_builder.h"
+
+// Starts a green thread of |priority| running the code at |body|.
+void EmitGreen(struct Builder* builder, long priority, size_t body) {
+  Emit(builder, 0x1B, 3, AddInteger(builder, 0x03, priority), body,
+       (size_t)0);
+}
+
+// Runs the program with a slice of |budget| ticks and no time limit until it
+// finishes or has been preempted |runs| times. Returns the number of
+// preemptions, or -1 after printing an error if the output is not |expected|.
+long RunSliced(struct Builder* builder, int policy, size_t budget, long runs,
+               const char* expected, const char* name) {
+  size_t size;
+  uint8_t* image = FinishProgram(builder, &size);
+  AqProgram* program;
+  if (AqLoadProgramFromMemory(image, size, &program) != AQ_OK) {
+    fprintf(stderr, "%s: Could not load the test program\n", name);
+    free(image);
+    return -1;
+  }
+  AqVM* vm = AqCreateVM(program);
+  FILE* output = tmpfile();
+  AqSetVMOutput(vm, output);
+  AqSetVMScheduler(vm, policy, 0);
+  AqSetVMTimeSlice(vm, budget, 0);
+  long preempted = 0;
+  while (preempted < runs && AqRunVM(vm) == AQ_PREEMPTED) {
+    preempted++;
+  }
+
+  char text[4096];
+  rewind(output);
+  size_t length = fread(text, 1, sizeof(text) - 1, output);
+  text[length] = '\0';
+  if (strcmp(text, expected) != 0) {
+    fprintf(stderr, "%s: Unexpected output:\n%s", name, text);
+    preempted = -1;
+  }
+
+  fclose(output);
+  AqFreeVM(vm);
+  AqFreeProgram(program);
+  free(image);
+  return preempted;
+}
+
+// A green thread spinning in |loop| must not keep a budget-only slice from
+// ending. With |yield|, the thread yields on every iteration so it never uses
+// up its own ticks.
+long RunSpinningThread(int yield) {
+  static struct Builder builder;
+  struct Builder* b = &builder;
+  StartProgram(b);
+  size_t body = AddInteger(b, 0x03, 0);
+  size_t loop = AddInteger(b, 0x03, 0);
+  size_t finish = AddInteger(b, 0x03, 0);
+  EmitGreen(b, 0, body);
+  Emit(b, 0x16, 1, finish);
+  SetLabel(b, body);
+  SetLabel(b, loop);
+  if (yield) {
+    Emit(b, 0x1C, 0);
+  }
+  Emit(b, 0x16, 1, loop);
+  SetLabel(b, finish);
+  return RunSliced(b, AQ_SCHEDULE_ROUND_ROBIN, 100000, 3, "done\n",
+                   yield ? "yielding green thread" : "spinning green thread");
+}
+
+// A looping thread of higher priority than the owner starves it, so the
+// owner's own ticks alone never end the slice.
+long RunStarvingThread(void) {
+  static struct Builder builder;
+  struct Builder* b = &builder;
+  StartProgram(b);
+  size_t body = AddInteger(b, 0x03, 0);
+  size_t loop = AddInteger(b, 0x03, 0);
+  size_t owner_loop = AddInteger(b, 0x03, 0);
+  EmitGreen(b, 1, body);
+  SetLabel(b, owner_loop);
+  Emit(b, 0x16, 1, owner_loop);
+  SetLabel(b, body);
+  SetLabel(b, loop);
+  Emit(b, 0x16, 1, loop);
+  return RunSliced(b, AQ_SCHEDULE_PRIORITY, 100000, 3, "",
+                   "high-priority green thread");
+}
+
+// A green thread counting to 10000 is preempted along the way and finishes
+// when resumed.
+long RunCountingThread(void) {
+  static struct Builder builder;
+  struct Builder* b = &builder;
+  StartProgram(b);
+  size_t body = AddInteger(b, 0x03, 0);
+  size_t loop = AddInteger(b, 0x03, 0);
+  size_t exit = AddInteger(b, 0x03, 0);
+  size_t finish = AddInteger(b, 0x03, 0);
+  size_t counter = AddInteger(b, 0x03, 0);
+  size_t step = AddInteger(b, 0x03, 1);
+  size_t limit = AddInteger(b, 0x03, 10000);
+  size_t less = AddInteger(b, 0x01, 2);
+  EmitGreen(b, 0, body);
+  Emit(b, 0x16, 1, finish);
+  SetLabel(b, body);
+  SetLabel(b, loop);
+  Emit(b, 0x06, 3, counter, counter, step);
+  Emit(b, 0x13, 4, b->flag, less, counter, limit);
+  Emit(b, 0x0F, 3, b->flag, loop, exit);
+  SetLabel(b, exit);
+  // The thread starts from the program's initial memory, without the native
+  // StartProgram() looked up.
+  Emit(b, 0x05, 2, AddString(b, "print"), b->print);
+  Print(b, "counted\n");
+  Emit(b, 0x15, 0);
+  SetLabel(b, finish);
+  return RunSliced(b, AQ_SCHEDULE_ROUND_ROBIN, 100, 1000000,
+                   "done\ncounted\n", "counting green thread");
+}
+
+int main(void) {
+  AqInitialize();
+  int failed = 0;
+  if (RunSpinningThread(0) != 3 || RunSpinningThread(1) != 3 ||
+      RunStarvingThread() != 3) {
+    fprintf(stderr, "Failed: A green thread outran the slice budget\n");
+    failed = 1;
+  }
+  long preempted = RunCountingThread();
+  if (preempted < 50 || preempted > 200) {
+    fprintf(stderr, "Failed: Counting to 10000 was preempted %ld times\n",
+            preempted);
+    failed = 1;
+  }
+  AqDeinitialize();
+  return failed;
+}
@@ -0,0 +1,116 @@
+// Copyright 2024 AQ author, All Rights Reserved.
+// This program is licensed under the AQ License. You can find the AQ license in
+// the root directory.
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prototype/test_builder.h"
+
+size_t AddSlot(struct Builder* builder, uint8_t type, size_t size,
+               uint64_t bits) {
+  size_t index = builder->size;
+  for (size_t i = 0; i < size; i++) {
+    builder->data[index + i] = (uint8_t)(bits >> (8 * (size - 1 - i)));
+    builder->types[index + i] = type;
+  }
+  builder->size += size;
+  return index;
+}
+
+size_t AddInteger(struct Builder* builder, uint8_t type, int64_t value) {
+  static const size_t kSizes[] = {8, 1, 4, 8, 4, 8, 2, 1, 2, 4, 8};
+  return AddSlot(builder, type, kSizes[type], (uint64_t)value);
+}
+
+size_t AddFloat(struct Builder* builder, float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return AddSlot(builder, 0x04, 4, bits);
+}
+
+size_t AddDouble(struct Builder* builder, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return AddSlot(builder, 0x05, 8, bits);
+}
+
+size_t AddString(struct Builder* builder, const char* text) {
+  size_t index = builder->size;
+  do {
+    AddSlot(builder, 0x01, 1, (uint8_t)*text);
+  } while (*text++ != '\0');
+  return index;
+}
+
+void Emit(struct Builder* builder, uint8_t opcode, int count, ...) {
+  builder->code[builder->code_size++] = opcode;
+  va_list operands;
+  va_start(operands, count);
+  for (int i = 0; i < count; i++) {
+    size_t operand = va_arg(operands, size_t);
+    for (; operand >= 255; operand -= 255) {
+      builder->code[builder->code_size++] = 255;
+    }
+    builder->code[builder->code_size++] = (uint8_t)operand;
+  }
+  va_end(operands);
+}
+
+void SetLabel(struct Builder* builder, size_t label) {
+  for (int i = 0; i < 8; i++) {
+    builder->data[label + i] =
+        (uint8_t)((uint64_t)builder->code_size >> (8 * (7 - i)));
+  }
+}
+
+void Print(struct Builder* builder, const char* message) {
+  size_t text = AddString(builder, message);
+  Emit(builder, 0x05, 2, text, builder->format);
+  Emit(builder, 0x14, 4, builder->print, builder->status, (size_t)1,
+       builder->format);
+}
+
+void Expect(struct Builder* builder, size_t actual, size_t expected,
+            const char* message) {
+  size_t next = AddInteger(builder, 0x03, 0);
+  size_t failed = AddInteger(builder, 0x03, 0);
+  Emit(builder, 0x13, 4, builder->flag, builder->equal, actual, expected);
+  Emit(builder, 0x0F, 3, builder->flag, next, failed);
+  SetLabel(builder, failed);
+  Print(builder, message);
+  SetLabel(builder, next);
+}
+
+void StartProgram(struct Builder* builder) {
+  memset(builder, 0, sizeof(*builder));
+  builder->print = AddInteger(builder, 0x00, 0);
+  builder->format = AddInteger(builder, 0x00, 0);
+  builder->flag = AddInteger(builder, 0x01, 0);
+  builder->equal = AddInteger(builder, 0x01, 0);
+  builder->status = AddInteger(builder, 0x02, 0);
+  builder->zero = AddInteger(builder, 0x01, 0);
+  builder->one = AddInteger(builder, 0x01, 1);
+  Emit(builder, 0x05, 2, AddString(builder, "print"), builder->print);
+}
+
+uint8_t* FinishProgram(struct Builder* builder, size_t* size) {
+  Print(builder, "done\n");
+  Emit(builder, 0x15, 0);
+  size_t types = builder->size / 2 + 1;
+  *size = 16 + builder->size + types + builder->code_size;
+  uint8_t* image = (uint8_t*)calloc(1, *size);
+  memcpy(image, "AQBC", 4);
+  for (int i = 0; i < 8; i++) {
+    image[8 + i] = (uint8_t)((uint64_t)builder->size >> (8 * (7 - i)));
+  }
+  memcpy(image + 16, builder->data, builder->size);
+  uint8_t* nibbles = image + 16 + builder->size;
+  for (size_t i = 0; i < builder->size; i++) {
+    nibbles[i / 2] |= builder->types[i] << (i % 2 == 0 ? 4 : 0);
+  }
+  memcpy(nibbles + types, builder->code, builder->code_size);
+  return image;
+}
@@ -0,0 +1,53 @@
+// Copyright 2024 AQ author, All Rights Reserved.
+// This program is licensed under the AQ License. You can find the AQ license in
+// the root directory.
+
+#ifndef AQ_PROTOTYPE_TEST_BUILDER_H_
+#define AQ_PROTOTYPE_TEST_BUILDER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Builds an AQBC program in memory for the tests. Every check compares a slot
+// with the expected value and prints a message when they differ, so a passing
+// run prints nothing but the final "done".
+struct Builder {
+  uint8_t data[8192];
+  uint8_t types[8192];
+  size_t size;
+  uint8_t code[65536];
+  size_t code_size;
+  size_t print;
+  size_t format;
+  size_t flag;
+  size_t equal;
+  size_t status;
+  size_t zero;
+  size_t one;
+};
+
+// Appends a slot of |size| bytes holding |bits| in big-endian order and
+// returns its index.
+size_t AddSlot(struct Builder* builder, uint8_t type, size_t size,
+               uint64_t bits);
+size_t AddInteger(struct Builder* builder, uint8_t type, int64_t value);
+size_t AddFloat(struct Builder* builder, float value);
+size_t AddDouble(struct Builder* builder, double value);
+size_t AddString(struct Builder* builder, const char* text);
+
+// Appends |opcode| followed by |count| size_t operands.
+void Emit(struct Builder* builder, uint8_t opcode, int count, ...);
+// Points the long slot |label| at the next instruction.
+void SetLabel(struct Builder* builder, size_t label);
+
+void Print(struct Builder* builder, const char* message);
+// Prints |message| unless the slots |actual| and |expected| compare equal.
+void Expect(struct Builder* builder, size_t actual, size_t expected,
+            const char* message);
+
+void StartProgram(struct Builder* builder);
+// Prints "done", returns and gives the AQBC image of the program, allocated
+// with malloc.
+uint8_t* FinishProgram(struct Builder* builder, size_t* size);
+
+#endif  // AQ_PROTOTYPE_TEST_BUILDER_H_